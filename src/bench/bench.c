@@ -0,0 +1,289 @@
+/*
+ * Crypto microbenchmarks
+ *
+ * Times the primitives and the handshake in isolation and prints the results as JSON, for comparing kernel and
+ * backend choices and catching regressions between releases:
+ *
+ *   make bench                            # build and run with the defaults
+ *   bench/wg_bench -c avx2 -b openssl -t 0.5
+ *
+ * -c selects the ChaCha20 kernel, -b the crypto backend and -t the time per measurement in seconds.
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../wireguard.h"
+#include "../wireguard-internal.h"
+#include "../wireguard-platform.h"
+#include "../crypto.h"
+
+// Sizes swept for the per-packet primitives - a minimal packet up to the default MTU
+static const size_t bench_sizes[] = { 64, 128, 256, 512, 1024, 1420 };
+#define BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+#define BENCH_MAX_SIZE 1420
+
+static double bench_seconds = 0.2;
+static bool bench_first = true;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// CPU cycles where there is a cycle counter, otherwise nanoseconds
+static uint64_t bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+struct bench_result {
+	double ops_per_sec;
+	double cycles_per_op;
+};
+
+// Run op() in growing batches until bench_seconds have passed
+#define BENCH_RUN(result, op) do { \
+	uint64_t _iters = 1, _i, _c0, _c1; \
+	double _t0, _t1; \
+	for (;;) { \
+		_t0 = bench_now(); \
+		_c0 = bench_cycles(); \
+		for (_i = 0; _i < _iters; _i++) { \
+			op; \
+		} \
+		_c1 = bench_cycles(); \
+		_t1 = bench_now(); \
+		if ((_t1 - _t0) >= bench_seconds) { \
+			break; \
+		} \
+		_iters *= 2; \
+	} \
+	(result).ops_per_sec = _iters / (_t1 - _t0); \
+	(result).cycles_per_op = (double)(_c1 - _c0) / _iters; \
+} while (0)
+
+static void bench_emit_bytes(const char *name, size_t size, const struct bench_result *r) {
+	printf("%s\n    { \"name\": \"%s\", \"size\": %zu, \"cycles_per_byte\": %.2f, \"packets_per_sec\": %.0f }",
+		bench_first ? "" : ",", name, size, r->cycles_per_op / size, r->ops_per_sec);
+	bench_first = false;
+}
+
+static void bench_emit_op(const char *name, const char *rate, const struct bench_result *r) {
+	printf("%s\n    { \"name\": \"%s\", \"cycles_per_op\": %.0f, \"%s\": %.0f }",
+		bench_first ? "" : ",", name, r->cycles_per_op, rate, r->ops_per_sec);
+	bench_first = false;
+}
+
+static void bench_fill(uint8_t *buf, size_t len, uint8_t seed) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		buf[i] = (uint8_t)(i * 31 + seed);
+	}
+}
+
+static void bench_primitives(void) {
+	static uint8_t src[BENCH_MAX_SIZE], dst[BENCH_MAX_SIZE + WIREGUARD_AUTHTAG_LEN];
+	uint8_t key[32], tag[16], digest[32], out1[32], out2[32];
+	wireguard_aead_ctx aead_key;
+	struct chacha20_ctx chacha;
+	poly1305_context poly;
+	struct bench_result r;
+	size_t i, size;
+
+	bench_fill(src, sizeof(src), 1);
+	bench_fill(key, sizeof(key), 2);
+	wireguard_aead_init_ctx(&aead_key, key);
+	chacha20_init_key(&chacha, key);
+
+	for (i = 0; i < BENCH_SIZES; i++) {
+		size = bench_sizes[i];
+
+		BENCH_RUN(r, {
+			chacha20_set_nonce(&chacha, 0);
+			chacha20(&chacha, dst, src, size);
+		});
+		bench_emit_bytes("chacha20", size, &r);
+
+		BENCH_RUN(r, {
+			poly1305_init(&poly, key);
+			poly1305_update(&poly, src, size);
+			poly1305_finish(&poly, tag);
+		});
+		bench_emit_bytes("poly1305_update", size, &r);
+
+		BENCH_RUN(r, wireguard_aead_encrypt_ctx(dst, src, size, NULL, 0, _i, &aead_key));
+		bench_emit_bytes("chacha20poly1305_encrypt", size, &r);
+
+		// Decrypt a valid packet every time, so the cost includes the full decryption and not just the tag check
+		wireguard_aead_encrypt_ctx(dst, src, size, NULL, 0, 0, &aead_key);
+		BENCH_RUN(r, {
+			if (!wireguard_aead_decrypt_ctx(src, dst, size + WIREGUARD_AUTHTAG_LEN, NULL, 0, 0, &aead_key)) {
+				abort();
+			}
+		});
+		bench_emit_bytes("chacha20poly1305_decrypt", size, &r);
+
+		BENCH_RUN(r, wireguard_blake2s(digest, sizeof(digest), NULL, 0, src, size));
+		bench_emit_bytes("blake2s", size, &r);
+	}
+
+	BENCH_RUN(r, wireguard_kdf2(out1, out2, key, src, WIREGUARD_PUBLIC_KEY_LEN));
+	bench_emit_op("wireguard_kdf2", "ops_per_sec", &r);
+
+	bench_fill(out1, sizeof(out1), 3);
+	out1[31] &= 127;
+	BENCH_RUN(r, wireguard_x25519(digest, key, out1));
+	bench_emit_op("x25519", "ops_per_sec", &r);
+
+	BENCH_RUN(r, wireguard_x25519_base(digest, key));
+	bench_emit_op("x25519_base", "ops_per_sec", &r);
+}
+
+// Two devices that are each other's only peer
+static struct wireguard_device bench_devices[2];
+
+static struct wireguard_peer *bench_setup_device(struct wireguard_device *device, const uint8_t *private_key,
+	const uint8_t *peer_public_key) {
+	struct wireguard_peer *peer;
+
+	if (!wireguard_device_init(device, private_key)) {
+		return NULL;
+	}
+	peer = peer_alloc(device);
+	if (peer && !wireguard_peer_init(device, peer, peer_public_key, NULL)) {
+		peer = NULL;
+	}
+	return peer;
+}
+
+static void bench_handshake(void) {
+	struct message_handshake_initiation initiation;
+	struct message_handshake_response response;
+	struct wireguard_peer *initiator, *responder, *peer;
+	uint8_t priv[2][WIREGUARD_PRIVATE_KEY_LEN], pub[2][WIREGUARD_PUBLIC_KEY_LEN];
+	struct bench_result r;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		bench_fill(priv[i], sizeof(priv[i]), (uint8_t)(5 + i));
+		priv[i][0] &= 248;
+		priv[i][31] = (priv[i][31] & 127) | 64;
+		wireguard_x25519_base(pub[i], priv[i]);
+	}
+	initiator = bench_setup_device(&bench_devices[0], priv[0], pub[1]);
+	responder = bench_setup_device(&bench_devices[1], priv[1], pub[0]);
+	if (!initiator || !responder) {
+		fprintf(stderr, "wg_bench: cannot set up the handshake peers\n");
+		exit(1);
+	}
+
+	BENCH_RUN(r, {
+		if (!wireguard_create_handshake_initiation(&bench_devices[0], initiator, &initiation)) {
+			abort();
+		}
+	});
+	bench_emit_op("wireguard_create_handshake_initiation", "handshakes_per_sec", &r);
+
+	// The replay and flood protection would reject all but the first, so rewind them each time
+	BENCH_RUN(r, {
+		responder->last_initiation_rx = wireguard_sys_now() + 1000;
+		memset(responder->greatest_timestamp, 0, sizeof(responder->greatest_timestamp));
+		if (wireguard_process_initiation_message(&bench_devices[1], &initiation) != responder) {
+			abort();
+		}
+	});
+	bench_emit_op("wireguard_process_initiation_message", "handshakes_per_sec", &r);
+
+	// Initiation, response and both session key derivations
+	BENCH_RUN(r, {
+		responder->last_initiation_rx = wireguard_sys_now() + 1000;
+		memset(responder->greatest_timestamp, 0, sizeof(responder->greatest_timestamp));
+		if (!wireguard_create_handshake_initiation(&bench_devices[0], initiator, &initiation)) {
+			abort();
+		}
+		peer = wireguard_process_initiation_message(&bench_devices[1], &initiation);
+		if ((peer != responder) || !wireguard_create_handshake_response(&bench_devices[1], responder, &response)) {
+			abort();
+		}
+		wireguard_start_session(responder, false);
+		if (!wireguard_process_handshake_response(&bench_devices[0], initiator, &response)) {
+			abort();
+		}
+		wireguard_start_session(initiator, true);
+	});
+	bench_emit_op("handshake_round_trip", "handshakes_per_sec", &r);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-c chacha20_kernel] [-b crypto_backend] [-t seconds_per_test]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int chacha20_kernel = CHACHA20_KERNEL_AUTO;
+	int backend = WIREGUARD_CRYPTO_BUNDLED;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:b:t:h")) != -1) {
+		switch (opt) {
+			case 'c':
+				chacha20_kernel = chacha20_kernel_by_name(optarg);
+				if (chacha20_kernel < 0) {
+					usage(argv[0]);
+				}
+				break;
+			case 'b':
+				backend = wireguard_crypto_backend_by_name(optarg);
+				if (backend < 0) {
+					usage(argv[0]);
+				}
+				break;
+			case 't':
+				bench_seconds = atof(optarg);
+				if (bench_seconds <= 0) {
+					usage(argv[0]);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	backend = wireguard_crypto_select(backend);
+	chacha20_kernel = chacha20_select_kernel(chacha20_kernel);
+	wireguard_init();
+
+	printf("{\n");
+	printf("  \"crypto_backend\": \"%s\",\n", wireguard_crypto_backend_name(backend));
+	printf("  \"chacha20_kernel\": \"%s\",\n", chacha20_kernel_name(chacha20_kernel));
+	printf("  \"poly1305_kernel\": \"%s\",\n", poly1305_kernel_name(poly1305_select_kernel(POLY1305_KERNEL_AUTO)));
+	printf("  \"blake2s_kernel\": \"%s\",\n", blake2s_kernel_name(blake2s_select_kernel(BLAKE2S_KERNEL_AUTO)));
+#if defined(__x86_64__) || defined(__i386__)
+	printf("  \"cycle_counter\": \"tsc\",\n");
+#else
+	printf("  \"cycle_counter\": \"ns\",\n");
+#endif
+	printf("  \"results\": [");
+	bench_primitives();
+	bench_handshake();
+	printf("\n  ]\n}\n");
+	return 0;
+}
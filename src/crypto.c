@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 void crypto_zero(void *dest, size_t len) {
 	volatile uint8_t *p = (uint8_t *)dest;
@@ -53,3 +54,95 @@ bool crypto_equal(const void *a, const void *b, size_t size) {
 	}
 	return (neq) ? false : true;
 }
+
+void wireguard_aead_key_init(struct wireguard_aead_key *ctx, const uint8_t *key) {
+	chacha20_init_key(&ctx->state, key);
+	memcpy(ctx->key, key, sizeof(ctx->key));
+}
+
+// Bundled backend - the code under crypto/
+static int bundled_x25519(uint8_t *out, const uint8_t *scalar, const uint8_t *point) {
+	return x25519(out, scalar, point, 1);
+}
+
+static int bundled_x25519_base(uint8_t *out, const uint8_t *scalar) {
+	return x25519_base(out, scalar, 1);
+}
+
+static void bundled_aead_encrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	chacha20poly1305_encrypt_ctx(dst, src, src_len, ad, ad_len, nonce, &ctx->state);
+}
+
+static bool bundled_aead_decrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	return chacha20poly1305_decrypt_ctx(dst, src, src_len, ad, ad_len, nonce, &ctx->state);
+}
+
+static void bundled_aead_encrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	chacha20poly1305_encrypt_batch(packets, count, &ctx->state);
+}
+
+static void bundled_aead_decrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	chacha20poly1305_decrypt_batch(packets, count, &ctx->state);
+}
+
+static const struct wireguard_crypto_backend wireguard_crypto_bundled = {
+	.name = "bundled",
+	.init = NULL,
+	.x25519 = bundled_x25519,
+	.x25519_base = bundled_x25519_base,
+	.aead_encrypt = chacha20poly1305_encrypt,
+	.aead_decrypt = chacha20poly1305_decrypt,
+	.aead_encrypt_ctx = bundled_aead_encrypt_ctx,
+	.aead_decrypt_ctx = bundled_aead_decrypt_ctx,
+	.aead_encrypt_batch = bundled_aead_encrypt_batch,
+	.aead_decrypt_batch = bundled_aead_decrypt_batch,
+};
+
+// Indexed by enum wireguard_crypto_backend_id - NULL where not built in
+static const struct wireguard_crypto_backend *const wireguard_crypto_backends[] = {
+	[WIREGUARD_CRYPTO_BUNDLED] = &wireguard_crypto_bundled,
+#ifdef WITH_OPENSSL
+	[WIREGUARD_CRYPTO_OPENSSL] = &wireguard_crypto_openssl,
+#endif
+#ifdef WITH_SODIUM
+	[WIREGUARD_CRYPTO_SODIUM] = &wireguard_crypto_sodium,
+#endif
+};
+
+#define WIREGUARD_CRYPTO_BACKENDS (sizeof(wireguard_crypto_backends) / sizeof(wireguard_crypto_backends[0]))
+
+const struct wireguard_crypto_backend *wireguard_crypto = &wireguard_crypto_bundled;
+
+const char *wireguard_crypto_backend_name(int backend) {
+	switch (backend) {
+		case WIREGUARD_CRYPTO_BUNDLED: return "bundled";
+		case WIREGUARD_CRYPTO_OPENSSL: return "openssl";
+		case WIREGUARD_CRYPTO_SODIUM: return "sodium";
+	}
+	return "unknown";
+}
+
+int wireguard_crypto_backend_by_name(const char *name) {
+	int backend;
+
+	for (backend = WIREGUARD_CRYPTO_BUNDLED; backend <= WIREGUARD_CRYPTO_SODIUM; backend++) {
+		if (strcmp(name, wireguard_crypto_backend_name(backend)) == 0) {
+			return backend;
+		}
+	}
+	return -1;
+}
+
+int wireguard_crypto_select(int backend) {
+	const struct wireguard_crypto_backend *candidate = NULL;
+
+	if ((backend >= 0) && ((size_t)backend < WIREGUARD_CRYPTO_BACKENDS)) {
+		candidate = wireguard_crypto_backends[backend];
+	}
+	if ((candidate == NULL) || (candidate->init && !candidate->init())) {
+		backend = WIREGUARD_CRYPTO_BUNDLED;
+		candidate = &wireguard_crypto_bundled;
+	}
+	wireguard_crypto = candidate;
+	return backend;
+}
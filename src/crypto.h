@@ -11,22 +11,86 @@
 #define wireguard_blake2s_init(ctx,outlen,key,keylen) blake2s_init(ctx,outlen,key,keylen)
 #define wireguard_blake2s_update(ctx,in,inlen) blake2s_update(ctx,in,inlen)
 #define wireguard_blake2s_final(ctx,out) blake2s_final(ctx,out)
+#define wireguard_blake2s_compress_pending(ctx) blake2s_compress_pending(ctx)
 #define wireguard_blake2s(out,outlen,key,keylen,in,inlen) blake2s(out,outlen,key,keylen,in,inlen)
+#define wireguard_blake2s_many(out,outlen,key,keylen,in,inlen,count) blake2s_many(out,outlen,key,keylen,in,inlen,count)
+#define WIREGUARD_BLAKE2S_LANES BLAKE2S_LANES
 
 // X25519 IMPLEMENTATION
 #include "crypto/x25519.h"
-#define wireguard_x25519(a,b,c)	x25519(a,b,c,1)
+#define wireguard_x25519(a,b,c)	wireguard_crypto->x25519(a,b,c)
+#define wireguard_x25519_base(a,b)	wireguard_crypto->x25519_base(a,b)
+#define wireguard_x25519_base_init()	x25519_base_init()
 
 //#include "crypto/cortex/scalarmult.h"
 //#define wireguard_x25519(a,b,c)	crypto_scalarmult_curve25519(a,b,c)
 
 // CHACHA20POLY1305 IMPLEMENTATION
+#include "crypto/chacha20.h"
+#include "crypto/poly1305-donna.h"
 #include "crypto/chacha20poly1305.h"
-#define wireguard_aead_encrypt(dst,src,srclen,ad,adlen,nonce,key) chacha20poly1305_encrypt(dst,src,srclen,ad,adlen,nonce,key)
-#define wireguard_aead_decrypt(dst,src,srclen,ad,adlen,nonce,key) chacha20poly1305_decrypt(dst,src,srclen,ad,adlen,nonce,key)
+#define wireguard_aead_encrypt(dst,src,srclen,ad,adlen,nonce,key) wireguard_crypto->aead_encrypt(dst,src,srclen,ad,adlen,nonce,key)
+#define wireguard_aead_decrypt(dst,src,srclen,ad,adlen,nonce,key) wireguard_crypto->aead_decrypt(dst,src,srclen,ad,adlen,nonce,key)
+#define wireguard_aead_ctx struct wireguard_aead_key
+#define wireguard_aead_init_ctx(ctx,key) wireguard_aead_key_init(ctx,key)
+#define wireguard_aead_encrypt_ctx(dst,src,srclen,ad,adlen,nonce,ctx) wireguard_crypto->aead_encrypt_ctx(dst,src,srclen,ad,adlen,nonce,ctx)
+#define wireguard_aead_decrypt_ctx(dst,src,srclen,ad,adlen,nonce,ctx) wireguard_crypto->aead_decrypt_ctx(dst,src,srclen,ad,adlen,nonce,ctx)
+#define wireguard_aead_batch struct chacha20poly1305_batch
+#define wireguard_aead_encrypt_batch(packets,count,ctx) wireguard_crypto->aead_encrypt_batch(packets,count,ctx)
+#define wireguard_aead_decrypt_batch(packets,count,ctx) wireguard_crypto->aead_decrypt_batch(packets,count,ctx)
 #define wireguard_xaead_encrypt(dst,src,srclen,ad,adlen,nonce,key) xchacha20poly1305_encrypt(dst,src,srclen,ad,adlen,nonce,key)
 #define wireguard_xaead_decrypt(dst,src,srclen,ad,adlen,nonce,key) xchacha20poly1305_decrypt(dst,src,srclen,ad,adlen,nonce,key)
 
+// CRYPTO BACKEND
+// X25519 and ChaCha20Poly1305 go through the backend selected at startup: the bundled code above or, when built
+// with WITH_OPENSSL=1 / WITH_SODIUM=1, OpenSSL 3 or libsodium. BLAKE2s and XChaCha20Poly1305 are always the bundled
+// code - libsodium has no BLAKE2s and OpenSSL no XChaCha20.
+enum wireguard_crypto_backend_id {
+	WIREGUARD_CRYPTO_BUNDLED = 0,
+	WIREGUARD_CRYPTO_OPENSSL,
+	WIREGUARD_CRYPTO_SODIUM,
+};
+
+// Per-key AEAD state kept with each keypair: the expanded key for the bundled code, the raw key for the others
+struct wireguard_aead_key {
+	struct chacha20_ctx state;
+	uint8_t key[CHACHA20_KEY_SIZE];
+};
+
+struct wireguard_crypto_backend {
+	const char *name;
+	// Prepare the library - returns false if it cannot be used
+	bool (*init)(void);
+	// Return 0 on success, -1 for an all-zero result (the scalar is clamped)
+	int (*x25519)(uint8_t *out, const uint8_t *scalar, const uint8_t *point);
+	int (*x25519_base)(uint8_t *out, const uint8_t *scalar);
+	// The 64-bit nonce is the WireGuard counter; decryption zeroes dst if the tag does not match
+	void (*aead_encrypt)(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key);
+	bool (*aead_decrypt)(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key);
+	void (*aead_encrypt_ctx)(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx);
+	bool (*aead_decrypt_ctx)(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx);
+	void (*aead_encrypt_batch)(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx);
+	void (*aead_decrypt_batch)(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx);
+};
+
+// The backend in use - the bundled one until wireguard_crypto_select() picks another
+extern const struct wireguard_crypto_backend *wireguard_crypto;
+
+// Switch to the given backend if it was built in and initialises; returns the one in use
+int wireguard_crypto_select(int backend);
+const char *wireguard_crypto_backend_name(int backend);
+// Backend for a name as returned by wireguard_crypto_backend_name() - returns -1 if unknown
+int wireguard_crypto_backend_by_name(const char *name);
+
+void wireguard_aead_key_init(struct wireguard_aead_key *ctx, const uint8_t *key);
+
+#ifdef WITH_OPENSSL
+extern const struct wireguard_crypto_backend wireguard_crypto_openssl;
+#endif
+#ifdef WITH_SODIUM
+extern const struct wireguard_crypto_backend wireguard_crypto_sodium;
+#endif
+
 
 // Endian / unaligned helper macros
 #define U8C(v) (v##U)
@@ -0,0 +1,167 @@
+// OpenSSL 3 crypto backend - EVP ChaCha20-Poly1305 and X25519
+// Built with WITH_OPENSSL=1; selected with crypto_backend=openssl
+
+#ifdef WITH_OPENSSL
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "../crypto.h"
+
+#define OPENSSL_TAG_LEN 16
+
+static EVP_CIPHER *openssl_chacha20poly1305;
+
+// One cipher context per thread and direction, set up once and rekeyed for every packet
+static __thread EVP_CIPHER_CTX *openssl_enc_ctx;
+static __thread EVP_CIPHER_CTX *openssl_dec_ctx;
+
+static bool openssl_init(void) {
+	if (openssl_chacha20poly1305 == NULL) {
+		openssl_chacha20poly1305 = EVP_CIPHER_fetch(NULL, "ChaCha20-Poly1305", NULL);
+	}
+	return (openssl_chacha20poly1305 != NULL);
+}
+
+static EVP_CIPHER_CTX *openssl_cipher_ctx(EVP_CIPHER_CTX **ctx, int enc) {
+	if (*ctx == NULL) {
+		*ctx = EVP_CIPHER_CTX_new();
+		if ((*ctx == NULL) || !EVP_CipherInit_ex(*ctx, openssl_chacha20poly1305, NULL, NULL, NULL, enc)) {
+			abort();
+		}
+	}
+	return *ctx;
+}
+
+// The 96-bit nonce is 32 zero bits followed by the little-endian counter
+static void openssl_nonce(uint8_t iv[12], uint64_t nonce) {
+	memset(iv, 0, 4);
+	U64TO8_LITTLE(iv + 4, nonce);
+}
+
+static void openssl_aead_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	EVP_CIPHER_CTX *ctx = openssl_cipher_ctx(&openssl_enc_ctx, 1);
+	uint8_t iv[12];
+	int len;
+	int ok;
+
+	openssl_nonce(iv, nonce);
+	ok = EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv);
+	if (ok && (ad_len > 0)) {
+		ok = EVP_EncryptUpdate(ctx, NULL, &len, ad, (int)ad_len);
+	}
+	if (ok && (src_len > 0)) {
+		ok = EVP_EncryptUpdate(ctx, dst, &len, src, (int)src_len);
+	}
+	ok = ok && EVP_EncryptFinal_ex(ctx, dst + src_len, &len);
+	ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, OPENSSL_TAG_LEN, dst + src_len);
+	if (!ok) {
+		// Never let plain text or a partial result go out as if encrypted
+		abort();
+	}
+}
+
+static bool openssl_aead_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	EVP_CIPHER_CTX *ctx;
+	uint8_t iv[12];
+	uint8_t tag[OPENSSL_TAG_LEN];
+	size_t len;
+	int outl;
+	int ok;
+
+	if (src_len < OPENSSL_TAG_LEN) {
+		return false;
+	}
+	len = src_len - OPENSSL_TAG_LEN;
+	// The tag may be overwritten if decrypting in place
+	memcpy(tag, src + len, sizeof(tag));
+
+	ctx = openssl_cipher_ctx(&openssl_dec_ctx, 0);
+	openssl_nonce(iv, nonce);
+	ok = EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv);
+	ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, OPENSSL_TAG_LEN, tag);
+	if (ok && (ad_len > 0)) {
+		ok = EVP_DecryptUpdate(ctx, NULL, &outl, ad, (int)ad_len);
+	}
+	if (ok && (len > 0)) {
+		ok = (dst != NULL) && EVP_DecryptUpdate(ctx, dst, &outl, src, (int)len);
+	}
+	ok = ok && (EVP_DecryptFinal_ex(ctx, NULL, &outl) > 0);
+	if (!ok && (dst != NULL)) {
+		crypto_zero(dst, len);
+	}
+	return ok;
+}
+
+static void openssl_aead_encrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	openssl_aead_encrypt(dst, src, src_len, ad, ad_len, nonce, ctx->key);
+}
+
+static bool openssl_aead_decrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	return openssl_aead_decrypt(dst, src, src_len, ad, ad_len, nonce, ctx->key);
+}
+
+static void openssl_aead_encrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		openssl_aead_encrypt(packets[i].dst, packets[i].src, packets[i].src_len, packets[i].ad, packets[i].ad_len, packets[i].nonce, ctx->key);
+		packets[i].valid = true;
+	}
+}
+
+static void openssl_aead_decrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		packets[i].valid = openssl_aead_decrypt(packets[i].dst, packets[i].src, packets[i].src_len, packets[i].ad, packets[i].ad_len, packets[i].nonce, ctx->key);
+	}
+}
+
+static int openssl_x25519(uint8_t *out, const uint8_t *scalar, const uint8_t *point) {
+	EVP_PKEY *priv = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, scalar, X25519_BYTES);
+	EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, point, X25519_BYTES);
+	EVP_PKEY_CTX *ctx = (priv != NULL) ? EVP_PKEY_CTX_new(priv, NULL) : NULL;
+	size_t len = X25519_BYTES;
+	int ret = -1;
+
+	// OpenSSL refuses to derive an all-zero secret, which is our -1 case
+	if ((peer != NULL) && (ctx != NULL) && (EVP_PKEY_derive_init(ctx) > 0) &&
+		(EVP_PKEY_derive_set_peer_ex(ctx, peer, 0) > 0) && (EVP_PKEY_derive(ctx, out, &len) > 0) && (len == X25519_BYTES)) {
+		ret = 0;
+	} else {
+		memset(out, 0, X25519_BYTES);
+	}
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(peer);
+	EVP_PKEY_free(priv);
+	return ret;
+}
+
+static int openssl_x25519_base(uint8_t *out, const uint8_t *scalar) {
+	EVP_PKEY *priv = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, scalar, X25519_BYTES);
+	size_t len = X25519_BYTES;
+	int ret = -1;
+
+	if ((priv != NULL) && (EVP_PKEY_get_raw_public_key(priv, out, &len) > 0) && (len == X25519_BYTES)) {
+		ret = 0;
+	}
+	EVP_PKEY_free(priv);
+	return ret;
+}
+
+const struct wireguard_crypto_backend wireguard_crypto_openssl = {
+	.name = "openssl",
+	.init = openssl_init,
+	.x25519 = openssl_x25519,
+	.x25519_base = openssl_x25519_base,
+	.aead_encrypt = openssl_aead_encrypt,
+	.aead_decrypt = openssl_aead_decrypt,
+	.aead_encrypt_ctx = openssl_aead_encrypt_ctx,
+	.aead_decrypt_ctx = openssl_aead_decrypt_ctx,
+	.aead_encrypt_batch = openssl_aead_encrypt_batch,
+	.aead_decrypt_batch = openssl_aead_decrypt_batch,
+};
+
+#endif /* WITH_OPENSSL */
@@ -0,0 +1,96 @@
+// libsodium crypto backend - IETF ChaCha20-Poly1305 and X25519
+// Built with WITH_SODIUM=1; selected with crypto_backend=sodium
+
+#ifdef WITH_SODIUM
+
+#include <string.h>
+#include <sodium.h>
+
+#include "../crypto.h"
+
+static bool sodium_backend_init(void) {
+	// 0 on first initialisation, 1 if already done
+	return (sodium_init() >= 0);
+}
+
+// The 96-bit nonce is 32 zero bits followed by the little-endian counter
+static void sodium_nonce(uint8_t npub[crypto_aead_chacha20poly1305_IETF_NPUBBYTES], uint64_t nonce) {
+	memset(npub, 0, 4);
+	U64TO8_LITTLE(npub + 4, nonce);
+}
+
+static void sodium_aead_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	uint8_t npub[crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
+
+	sodium_nonce(npub, nonce);
+	crypto_aead_chacha20poly1305_ietf_encrypt_detached(dst, dst + src_len, NULL, src, src_len, ad, ad_len, NULL, npub, key);
+}
+
+static bool sodium_aead_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	uint8_t npub[crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
+	uint8_t tag[crypto_aead_chacha20poly1305_IETF_ABYTES];
+	size_t len;
+
+	if (src_len < sizeof(tag)) {
+		return false;
+	}
+	len = src_len - sizeof(tag);
+	// The tag may be overwritten if decrypting in place
+	memcpy(tag, src + len, sizeof(tag));
+	if ((dst == NULL) && (len > 0)) {
+		return false;
+	}
+
+	sodium_nonce(npub, nonce);
+	// Like the bundled code, libsodium zeroes dst when the tag does not match (and only verifies if dst is NULL)
+	return (crypto_aead_chacha20poly1305_ietf_decrypt_detached(dst, NULL, src, len, tag, ad, ad_len, npub, key) == 0);
+}
+
+static void sodium_aead_encrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	sodium_aead_encrypt(dst, src, src_len, ad, ad_len, nonce, ctx->key);
+}
+
+static bool sodium_aead_decrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct wireguard_aead_key *ctx) {
+	return sodium_aead_decrypt(dst, src, src_len, ad, ad_len, nonce, ctx->key);
+}
+
+static void sodium_aead_encrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		sodium_aead_encrypt(packets[i].dst, packets[i].src, packets[i].src_len, packets[i].ad, packets[i].ad_len, packets[i].nonce, ctx->key);
+		packets[i].valid = true;
+	}
+}
+
+static void sodium_aead_decrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct wireguard_aead_key *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		packets[i].valid = sodium_aead_decrypt(packets[i].dst, packets[i].src, packets[i].src_len, packets[i].ad, packets[i].ad_len, packets[i].nonce, ctx->key);
+	}
+}
+
+// Both clamp the scalar; crypto_scalarmult() fails on an all-zero result
+static int sodium_x25519(uint8_t *out, const uint8_t *scalar, const uint8_t *point) {
+	return (crypto_scalarmult_curve25519(out, scalar, point) == 0) ? 0 : -1;
+}
+
+static int sodium_x25519_base(uint8_t *out, const uint8_t *scalar) {
+	return (crypto_scalarmult_curve25519_base(out, scalar) == 0) ? 0 : -1;
+}
+
+const struct wireguard_crypto_backend wireguard_crypto_sodium = {
+	.name = "sodium",
+	.init = sodium_backend_init,
+	.x25519 = sodium_x25519,
+	.x25519_base = sodium_x25519_base,
+	.aead_encrypt = sodium_aead_encrypt,
+	.aead_decrypt = sodium_aead_decrypt,
+	.aead_encrypt_ctx = sodium_aead_encrypt_ctx,
+	.aead_decrypt_ctx = sodium_aead_decrypt_ctx,
+	.aead_encrypt_batch = sodium_aead_encrypt_batch,
+	.aead_decrypt_batch = sodium_aead_decrypt_batch,
+};
+
+#endif /* WITH_SODIUM */
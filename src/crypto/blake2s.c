@@ -3,6 +3,22 @@
 #include "blake2s.h"
 #include "../crypto.h"
 
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLAKE2S_SSE41 1
+#else
+#define BLAKE2S_SSE41 0
+#endif
+
+#if defined(__x86_64__)
+#define BLAKE2S_AVX2 1
+#else
+#define BLAKE2S_AVX2 0
+#endif
+
 // Cyclic right rotation.
 
 #ifndef ROTR32
@@ -27,10 +43,8 @@ static const uint32_t blake2s_iv[8] =
 	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
 };
 
-// Compression function. "last" flag indicates last block.
-static void blake2s_compress(blake2s_ctx *ctx, int last)
-{
-	const uint8_t sigma[10][16] = {
+// Message schedule
+static const uint8_t blake2s_sigma[10][16] = {
 		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
 		{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
 		{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
@@ -41,7 +55,12 @@ static void blake2s_compress(blake2s_ctx *ctx, int last)
 		{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
 		{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
 		{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
-	};
+};
+
+// Compression function. "last" flag indicates last block.
+static void blake2s_compress_ref(blake2s_ctx *ctx, int last)
+{
+	const uint8_t (*sigma)[16] = blake2s_sigma;
 	int i;
 	uint32_t v[16], m[16];
 
@@ -72,6 +91,215 @@ static void blake2s_compress(blake2s_ctx *ctx, int last)
 		ctx->h[i] ^= v[i] ^ v[i + 8];
 }
 
+#if BLAKE2S_SSE41
+// Row-wise SSE4.1 compression: the 4x4 state is held as rows a, b, c, d, so each half-round runs the four G
+// functions on one vector each; between the column and diagonal steps rows b, c and d are rotated by one, two and
+// three lanes. The message words for each step are gathered (pinsrd) according to sigma, the 16 and 8 bit
+// rotations are byte shuffles and the 12 and 7 bit ones shifts.
+#define B2S_SSE_G(a, b, c, d, mx, my) {                                          \
+	a = _mm_add_epi32(_mm_add_epi32(a, b), mx);                                  \
+	d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot16);                            \
+	c = _mm_add_epi32(c, d);                                                     \
+	b = _mm_xor_si128(b, c);                                                     \
+	b = _mm_or_si128(_mm_srli_epi32(b, 12), _mm_slli_epi32(b, 20));              \
+	a = _mm_add_epi32(_mm_add_epi32(a, b), my);                                  \
+	d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot8);                             \
+	c = _mm_add_epi32(c, d);                                                     \
+	b = _mm_xor_si128(b, c);                                                     \
+	b = _mm_or_si128(_mm_srli_epi32(b, 7), _mm_slli_epi32(b, 25)); }
+
+#define B2S_SSE_LOAD(m, s, i0, i1, i2, i3) \
+	_mm_setr_epi32((int)m[s[i0]], (int)m[s[i1]], (int)m[s[i2]], (int)m[s[i3]])
+
+__attribute__((target("sse4.1")))
+static void blake2s_compress_sse41(blake2s_ctx *ctx, int last)
+{
+	const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m128i rot8 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	const __m128i h0 = _mm_loadu_si128((const __m128i *)&ctx->h[0]);
+	const __m128i h1 = _mm_loadu_si128((const __m128i *)&ctx->h[4]);
+	__m128i a = h0, b = h1, c, d;
+	uint32_t m[16];
+	int i;
+
+	memcpy(m, ctx->b, sizeof(m));       // the block is little-endian, as is x86
+	c = _mm_loadu_si128((const __m128i *)&blake2s_iv[0]);
+	d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&blake2s_iv[4]),
+		_mm_setr_epi32((int)ctx->t[0], (int)ctx->t[1], last ? -1 : 0, 0));
+
+	for (i = 0; i < 10; i++) {
+		const uint8_t *s = blake2s_sigma[i];
+
+		// Columns
+		B2S_SSE_G(a, b, c, d, B2S_SSE_LOAD(m, s, 0, 2, 4, 6), B2S_SSE_LOAD(m, s, 1, 3, 5, 7));
+		// Diagonals: line them up as columns, mix, and turn them back
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+		c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+		B2S_SSE_G(a, b, c, d, B2S_SSE_LOAD(m, s, 8, 10, 12, 14), B2S_SSE_LOAD(m, s, 9, 11, 13, 15));
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+		c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	_mm_storeu_si128((__m128i *)&ctx->h[0], _mm_xor_si128(h0, _mm_xor_si128(a, c)));
+	_mm_storeu_si128((__m128i *)&ctx->h[4], _mm_xor_si128(h1, _mm_xor_si128(b, d)));
+}
+
+static bool blake2s_cpu_sse41(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.1");
+}
+#endif /* BLAKE2S_SSE41 */
+
+// Reference code until blake2s_select_kernel() has been run
+static void (*blake2s_compress)(blake2s_ctx *ctx, int last) = blake2s_compress_ref;
+// blake2s_many() hashes BLAKE2S_LANES messages at a time once this is set
+static bool blake2s_many_avx2;
+
+#if BLAKE2S_AVX2
+// Multi-buffer AVX2 compression: each of v[0..15] holds one state word for eight independent messages, so the G
+// functions are the scalar ones with every operation eight lanes wide and no diagonal shuffling at all. The eight
+// blocks are transposed into message-word vectors on the way in.
+#define B2S_X8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define B2S_X8_G(a, b, c, d, x, y) {                                     \
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);            \
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);     \
+	v[c] = _mm256_add_epi32(v[c], v[d]);                                 \
+	v[b] = B2S_X8_ROTR(_mm256_xor_si256(v[b], v[c]), 12);                \
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);            \
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8);      \
+	v[c] = _mm256_add_epi32(v[c], v[d]);                                 \
+	v[b] = B2S_X8_ROTR(_mm256_xor_si256(v[b], v[c]), 7); }
+
+// m[j] = word j + i of each lane's row, for rows holding eight words each
+__attribute__((target("avx2")))
+static inline void blake2s_transpose_x8(__m256i m[8], const __m256i r[8]) {
+	__m256i t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		m[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		m[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+static void blake2s_compress_x8(__m256i h[8], const uint8_t *const block[BLAKE2S_LANES], uint64_t t, int last)
+{
+	const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+		1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	__m256i v[16], m[16], r[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r[i] = _mm256_loadu_si256((const __m256i *)block[i]);
+	}
+	blake2s_transpose_x8(&m[0], r);
+	for (i = 0; i < 8; i++) {
+		r[i] = _mm256_loadu_si256((const __m256i *)(block[i] + 32));
+	}
+	blake2s_transpose_x8(&m[8], r);
+
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = _mm256_set1_epi32((int)blake2s_iv[i]);
+	}
+	v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi32((int)(uint32_t)t));
+	v[13] = _mm256_xor_si256(v[13], _mm256_set1_epi32((int)(uint32_t)(t >> 32)));
+	if (last)
+		v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi32(-1));
+
+	for (i = 0; i < 10; i++) {
+		const uint8_t *s = blake2s_sigma[i];
+
+		B2S_X8_G( 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		B2S_X8_G( 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		B2S_X8_G( 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		B2S_X8_G( 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		B2S_X8_G( 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		B2S_X8_G( 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		B2S_X8_G( 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		B2S_X8_G( 3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+	}
+}
+
+// Hashes count (2..BLAKE2S_LANES) messages of inlen (> 0) bytes under the same key. The key block is the same for
+// every message, so it is compressed once and the resulting state shared by all lanes.
+__attribute__((target("avx2")))
+static void blake2s_many_x8(uint8_t *const out[], size_t outlen, const void *key, size_t keylen,
+	const uint8_t *const in[], size_t inlen, size_t count)
+{
+	uint8_t tail[BLAKE2S_LANES][BLAKE2S_BLOCK_SIZE];
+	const uint8_t *block[BLAKE2S_LANES];
+	uint32_t digest[8][BLAKE2S_LANES];
+	__m256i h[8];
+	blake2s_ctx ctx;
+	uint64_t t = 0;
+	size_t i, j, offset, rem;
+
+	blake2s_init(&ctx, outlen, key, keylen);
+	if (keylen > 0) {
+		t = BLAKE2S_BLOCK_SIZE;
+		ctx.t[0] = BLAKE2S_BLOCK_SIZE;
+		blake2s_compress(&ctx, 0);
+	}
+	for (i = 0; i < 8; i++) {
+		h[i] = _mm256_set1_epi32((int)ctx.h[i]);
+	}
+
+	// Unused lanes just repeat the first message
+	for (offset = 0; inlen - offset > BLAKE2S_BLOCK_SIZE; offset += BLAKE2S_BLOCK_SIZE) {
+		for (j = 0; j < BLAKE2S_LANES; j++) {
+			block[j] = in[j < count ? j : 0] + offset;
+		}
+		t += BLAKE2S_BLOCK_SIZE;
+		blake2s_compress_x8(h, block, t, 0);
+	}
+	rem = inlen - offset;
+	for (j = 0; j < BLAKE2S_LANES; j++) {
+		memcpy(tail[j], in[j < count ? j : 0] + offset, rem);
+		memset(tail[j] + rem, 0, BLAKE2S_BLOCK_SIZE - rem);
+		block[j] = tail[j];
+	}
+	t += rem;
+	blake2s_compress_x8(h, block, t, 1);
+
+	for (i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i *)digest[i], h[i]);
+	}
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < outlen; i++) {
+			out[j][i] = (digest[i >> 2][j] >> (8 * (i & 3))) & 0xFF;
+		}
+	}
+	crypto_zero(&ctx, sizeof(ctx));
+	crypto_zero(tail, sizeof(tail));
+}
+
+static bool blake2s_cpu_avx2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* BLAKE2S_AVX2 */
+
 // Initialize the hashing context "ctx" with optional key "key".
 //      1 <= outlen <= 32 gives the digest size in bytes.
 //      Secret key (also <= 32 bytes) is optional (keylen = 0).
@@ -120,6 +348,20 @@ void blake2s_update(blake2s_ctx *ctx,
 	}
 }
 
+// Compress a full input buffer now instead of on the next update, so that
+//      a copy of the context starts with that work already done.
+//      Only valid if more input follows before blake2s_final().
+void blake2s_compress_pending(blake2s_ctx *ctx)
+{
+	if (ctx->c == 64) {
+		ctx->t[0] += ctx->c;
+		if (ctx->t[0] < ctx->c)
+			ctx->t[1]++;
+		blake2s_compress(ctx, 0);
+		ctx->c = 0;
+	}
+}
+
 // Generate the message digest (size given in init).
 //      Result placed in "out".
 void blake2s_final(blake2s_ctx *ctx, void *out)
@@ -154,3 +396,146 @@ int blake2s(void *out, size_t outlen,
 
 	return 0;
 }
+
+// Hash count messages of the same length under the same key - out[i] = BLAKE2s(key, in[i])
+int blake2s_many(uint8_t *const out[], size_t outlen,
+	const void *key, size_t keylen,
+	const uint8_t *const in[], size_t inlen, size_t count)
+{
+	size_t i, n;
+
+	if (outlen == 0 || outlen > 32 || keylen > 32)
+		return -1;
+
+	while (count > 0) {
+		n = (count < BLAKE2S_LANES) ? count : BLAKE2S_LANES;
+#if BLAKE2S_AVX2
+		if (blake2s_many_avx2 && (n > 1) && (inlen > 0)) {
+			blake2s_many_x8(out, outlen, key, keylen, in, inlen, n);
+		} else
+#endif
+		{
+			for (i = 0; i < n; i++) {
+				blake2s(out[i], outlen, key, keylen, in[i], inlen);
+			}
+		}
+		out += n;
+		in += n;
+		count -= n;
+	}
+	return 0;
+}
+
+// RFC7693 Appendix B - BLAKE2s-256("abc")
+static const uint8_t blake2s_kat_abc[32] = {
+	0x50, 0x8c, 0x5e, 0x8c, 0x32, 0x7c, 0x14, 0xe2, 0xe1, 0xa7, 0x2b, 0xa3, 0x4e, 0xeb, 0x45, 0x2f,
+	0x37, 0x45, 0x8b, 0x20, 0x9e, 0xd6, 0x3a, 0x29, 0x4d, 0x99, 0x9b, 0x4c, 0x86, 0x67, 0x59, 0x82
+};
+
+// Known answer test for one compression function: the RFC vector, then a comparison against the reference code
+// for keyed and unkeyed hashes over one to several blocks
+static bool blake2s_kernel_selftest(void (*compress)(blake2s_ctx *ctx, int last)) {
+	static const size_t lengths[] = { 0, 1, 63, 64, 65, 116, 128, 255 };
+	void (*saved)(blake2s_ctx *ctx, int last) = blake2s_compress;
+	uint8_t key[32], msg[255];
+	uint8_t expected[32], actual[32];
+	bool result = true;
+	size_t i, k;
+
+	for (i = 0; i < sizeof(key); i++) {
+		key[i] = (uint8_t)(i * 7 + 3);
+	}
+	for (i = 0; i < sizeof(msg); i++) {
+		msg[i] = (uint8_t)(i * 13 + 1);
+	}
+
+	blake2s_compress = compress;
+	blake2s(actual, 32, NULL, 0, "abc", 3);
+	result = (memcmp(actual, blake2s_kat_abc, sizeof(actual)) == 0);
+	for (k = 0; result && (k <= sizeof(key)); k += 16) {
+		for (i = 0; result && (i < sizeof(lengths) / sizeof(lengths[0])); i++) {
+			blake2s_compress = blake2s_compress_ref;
+			blake2s(expected, 32, key, k, msg, lengths[i]);
+			blake2s_compress = compress;
+			blake2s(actual, 32, key, k, msg, lengths[i]);
+			result = (memcmp(expected, actual, sizeof(actual)) == 0);
+		}
+	}
+	blake2s_compress = saved;
+	return result;
+}
+
+const char *blake2s_kernel_name(int kernel) {
+	switch (kernel) {
+		case BLAKE2S_KERNEL_AUTO: return "auto";
+		case BLAKE2S_KERNEL_SCALAR: return "scalar";
+		case BLAKE2S_KERNEL_SSE41: return "sse4.1";
+		case BLAKE2S_KERNEL_AVX2: return "avx2";
+	}
+	return "unknown";
+}
+
+#if BLAKE2S_AVX2
+// The multi-buffer code against one message at a time, with partly filled batches and one to several blocks
+static bool blake2s_many_selftest(void) {
+	static const size_t lengths[] = { 1, 63, 64, 65, 116, 180, 255 };
+	uint8_t key[32], msg[BLAKE2S_LANES][255];
+	uint8_t digest[BLAKE2S_LANES][32], expected[32];
+	uint8_t *out[BLAKE2S_LANES];
+	const uint8_t *in[BLAKE2S_LANES];
+	bool saved = blake2s_many_avx2;
+	bool result = true;
+	size_t i, j, k, count;
+
+	for (i = 0; i < sizeof(key); i++) {
+		key[i] = (uint8_t)(i * 5 + 9);
+	}
+	for (j = 0; j < BLAKE2S_LANES; j++) {
+		for (i = 0; i < sizeof(msg[j]); i++) {
+			msg[j][i] = (uint8_t)(i * 13 + j * 31 + 1);
+		}
+		out[j] = digest[j];
+		in[j] = msg[j];
+	}
+
+	blake2s_many_avx2 = true;
+	for (k = 0; result && (k <= sizeof(key)); k += 16) {
+		for (i = 0; result && (i < sizeof(lengths) / sizeof(lengths[0])); i++) {
+			count = (i & 1) ? 5 : BLAKE2S_LANES;
+			blake2s_many(out, 16 + k / 2, key, k, in, lengths[i], count);
+			for (j = 0; result && (j < count); j++) {
+				blake2s(expected, 16 + k / 2, key, k, msg[j], lengths[i]);
+				result = (memcmp(expected, digest[j], 16 + k / 2) == 0);
+			}
+		}
+	}
+	blake2s_many_avx2 = saved;
+	return result;
+}
+#endif
+
+int blake2s_select_kernel(int kernel) {
+	int best = BLAKE2S_KERNEL_SCALAR;
+
+	blake2s_compress = blake2s_compress_ref;
+	blake2s_many_avx2 = false;
+#if BLAKE2S_SSE41
+	if (((kernel == BLAKE2S_KERNEL_AUTO) || (kernel == BLAKE2S_KERNEL_SSE41)) && blake2s_cpu_sse41() &&
+		blake2s_kernel_selftest(blake2s_compress_sse41)) {
+		blake2s_compress = blake2s_compress_sse41;
+		best = BLAKE2S_KERNEL_SSE41;
+	}
+#if BLAKE2S_AVX2
+	// On top of the SSE4.1 compression for single messages
+	if (((kernel == BLAKE2S_KERNEL_AUTO) || (kernel == BLAKE2S_KERNEL_AVX2)) && (best == BLAKE2S_KERNEL_SSE41) &&
+		blake2s_cpu_avx2() && blake2s_many_selftest()) {
+		blake2s_many_avx2 = true;
+		best = BLAKE2S_KERNEL_AVX2;
+	}
+#endif
+#else
+	(void)kernel;
+	(void)blake2s_kernel_selftest;
+#endif
+	return best;
+}
@@ -4,6 +4,7 @@
 #define _BLAKE2S_H
 
 #define BLAKE2S_BLOCK_SIZE 64
+#define BLAKE2S_LANES 8                 // messages blake2s_many() hashes in parallel
 
 #include <stdint.h>
 #include <stddef.h>
@@ -27,6 +28,11 @@ int blake2s_init(blake2s_ctx *ctx, size_t outlen,
 void blake2s_update(blake2s_ctx *ctx,   // context
     const void *in, size_t inlen);      // data to be hashed
 
+// Compress a full input buffer now rather than on the next update, so
+//      copies of the context share that work (e.g. a keyed HMAC pad).
+//      Only valid if more input will follow before blake2s_final().
+void blake2s_compress_pending(blake2s_ctx *ctx);
+
 // Generate the message digest (size given in init).
 //      Result placed in "out".
 void blake2s_final(blake2s_ctx *ctx, void *out);
@@ -36,4 +42,23 @@ int blake2s(void *out, size_t outlen,   // return buffer for digest
     const void *key, size_t keylen,     // optional secret key
     const void *in, size_t inlen);      // data to be hashed
 
+// Hash "count" messages of the same length "inlen" under the same key:
+//      out[i] = BLAKE2s(key, in[i]). Up to BLAKE2S_LANES of them are
+//      hashed in parallel when the avx2 kernel is selected.
+int blake2s_many(uint8_t *const out[], size_t outlen,
+    const void *key, size_t keylen,
+    const uint8_t *const in[], size_t inlen, size_t count);
+
+// Compression function used by all of the above - the reference code, or a SIMD one on CPUs that have it
+enum blake2s_kernel {
+    BLAKE2S_KERNEL_AUTO = 0,
+    BLAKE2S_KERNEL_SCALAR,
+    BLAKE2S_KERNEL_SSE41,
+    BLAKE2S_KERNEL_AVX2,                // sse4.1, plus 8-lane blake2s_many()
+};
+
+// BLAKE2S_KERNEL_AUTO picks the fastest supported kernel that passes the RFC7693 test vector; returns the one in use
+int blake2s_select_kernel(int kernel);
+const char *blake2s_kernel_name(int kernel);
+
 #endif
@@ -39,8 +39,16 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "../crypto.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA20_X86 1
+#else
+#define CHACHA20_X86 0
+#endif
+
 // 2.3.  The ChaCha20 Block Function
 // The first four words (0-3) are constants: 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
 static const uint32_t CHACHA20_CONSTANT_1 = 0x61707865;
@@ -99,46 +107,656 @@ static inline void INNER_BLOCK(uint32_t *block) {
 //	state += working_state
 //	return serialize(state)
 // end
-static void chacha20_block(struct chacha20_ctx *ctx, uint8_t *stream) {
-	uint32_t working_state[16];
+static void chacha20_block(const struct chacha20_ctx *ctx, uint32_t *stream) {
 	int i;
 
 	for (i = 0; i < 16; ++i) {
-		working_state[i] = ctx->state[i];
+		stream[i] = ctx->state[i];
 	}
 
-	TWENTY_ROUNDS(working_state);
+	TWENTY_ROUNDS(stream);
 
 	for (i = 0; i < 16; ++i) {
-		U32TO8_LITTLE(stream + (4 * i), PLUS(working_state[i], ctx->state[i]));
+		stream[i] = PLUS(stream[i], ctx->state[i]);
 	}
 }
 
-void chacha20(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+// Portable implementation - one block at a time, XORed a 32-bit word at a time
+static void chacha20_scalar(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+	uint32_t stream[16];
 	uint8_t output[CHACHA20_BLOCK_SIZE];
 	uint32_t i;
 
+	while (len >= CHACHA20_BLOCK_SIZE) {
+		chacha20_block(ctx, stream);
+		// Word 12 is a block counter
+		ctx->state[12] = PLUSONE(ctx->state[12]);
+		for (i = 0; i < 16; ++i) {
+			U32TO8_LITTLE(out + (4 * i), U8TO32_LITTLE(in + (4 * i)) ^ stream[i]);
+		}
+		len -= CHACHA20_BLOCK_SIZE;
+		out += CHACHA20_BLOCK_SIZE;
+		in += CHACHA20_BLOCK_SIZE;
+	}
 	if (len) {
-		for (;;) {
-			chacha20_block(ctx, output);
-			// Word 12 is a block counter
-			ctx->state[12] = PLUSONE(ctx->state[12]);
-			if (len <= 64) {
-				for (i = 0;i < len;++i) {
-					out[i] = in[i] ^ output[i];
-			    }
-			    return;
-			}
-			for (i = 0;i < 64;++i) {
-				out[i] = in[i] ^ output[i];
-			}
-			len -= 64;
-			out += 64;
-			in += 64;
+		chacha20_block(ctx, stream);
+		ctx->state[12] = PLUSONE(ctx->state[12]);
+		for (i = 0; i < 16; ++i) {
+			U32TO8_LITTLE(output + (4 * i), stream[i]);
+		}
+		for (i = 0; i < len; ++i) {
+			out[i] = in[i] ^ output[i];
+		}
+		crypto_zero(output, sizeof(output));
+	}
+	crypto_zero(stream, sizeof(stream));
+}
+
+// One block for the (block counter, nonce) pair under the key in ctx
+static void chacha20_lanes_scalar(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces, uint8_t *stream) {
+	struct chacha20_ctx lane = *ctx;
+	uint32_t block[16];
+	int i;
+
+	lane.state[12] = counters[0];
+	lane.state[14] = nonces[0] & 0xFFFFFFFF;
+	lane.state[15] = nonces[0] >> 32;
+	chacha20_block(&lane, block);
+	for (i = 0; i < 16; ++i) {
+		U32TO8_LITTLE(stream + (4 * i), block[i]);
+	}
+	crypto_zero(&lane, sizeof(lane));
+	crypto_zero(block, sizeof(block));
+}
+
+#if CHACHA20_X86
+// Multi-block x86 kernels
+// The state is held "word-sliced": vector i carries word i of N consecutive blocks, one block per lane, so the
+// quarter rounds of N blocks run side by side. Only word 12 (the block counter) differs between the lanes.
+// After the rounds the N x 16 words are transposed back into N serialized keystream blocks.
+
+#define CHACHA20_SSE2_BLOCKS	(4)
+#define CHACHA20_AVX2_BLOCKS	(8)
+
+#define SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32((v), (n)), _mm_srli_epi32((v), 32 - (n)))
+
+#define SSE2_QUARTERROUND(a, b, c, d) \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d, 16); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b, 12); \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d,  8); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b,  7)
+
+// Transpose words w..w+3 of four lanes and store them into their blocks
+#define SSE2_STORE4(stream, x, w) { \
+	__m128i t0 = _mm_unpacklo_epi32(x[w + 0], x[w + 1]); \
+	__m128i t1 = _mm_unpacklo_epi32(x[w + 2], x[w + 3]); \
+	__m128i t2 = _mm_unpackhi_epi32(x[w + 0], x[w + 1]); \
+	__m128i t3 = _mm_unpackhi_epi32(x[w + 2], x[w + 3]); \
+	_mm_storeu_si128((__m128i *)(stream + 0 * CHACHA20_BLOCK_SIZE + 4 * w), _mm_unpacklo_epi64(t0, t1)); \
+	_mm_storeu_si128((__m128i *)(stream + 1 * CHACHA20_BLOCK_SIZE + 4 * w), _mm_unpackhi_epi64(t0, t1)); \
+	_mm_storeu_si128((__m128i *)(stream + 2 * CHACHA20_BLOCK_SIZE + 4 * w), _mm_unpacklo_epi64(t2, t3)); \
+	_mm_storeu_si128((__m128i *)(stream + 3 * CHACHA20_BLOCK_SIZE + 4 * w), _mm_unpackhi_epi64(t2, t3)); }
+
+// Four blocks for the per-lane input words in s, serialized into stream
+__attribute__((target("sse2")))
+static inline void chacha20_rounds_sse2(const __m128i s[16], uint8_t *stream) {
+	__m128i x[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = s[i];
+	}
+
+	for (i = 0; i < 10; ++i) {
+		SSE2_QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+		SSE2_QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+		SSE2_QUARTERROUND(x[2], x[6], x[10], x[14]);
+		SSE2_QUARTERROUND(x[3], x[7], x[11], x[15]);
+		SSE2_QUARTERROUND(x[0], x[5], x[10], x[15]);
+		SSE2_QUARTERROUND(x[1], x[6], x[11], x[12]);
+		SSE2_QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+		SSE2_QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = _mm_add_epi32(x[i], s[i]);
+	}
+	SSE2_STORE4(stream, x, 0);
+	SSE2_STORE4(stream, x, 4);
+	SSE2_STORE4(stream, x, 8);
+	SSE2_STORE4(stream, x, 12);
+}
+
+// Four blocks of keystream starting at the current block counter
+__attribute__((target("sse2")))
+static void chacha20_stream_sse2(const struct chacha20_ctx *ctx, uint8_t *stream) {
+	__m128i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+	chacha20_rounds_sse2(s, stream);
+}
+
+// One block for each of four (block counter, nonce) pairs under the key in ctx
+__attribute__((target("sse2")))
+static void chacha20_lanes_sse2(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces, uint8_t *stream) {
+	__m128i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm_loadu_si128((const __m128i *)counters);
+	s[14] = _mm_set_epi32((uint32_t)nonces[3], (uint32_t)nonces[2], (uint32_t)nonces[1], (uint32_t)nonces[0]);
+	s[15] = _mm_set_epi32((uint32_t)(nonces[3] >> 32), (uint32_t)(nonces[2] >> 32), (uint32_t)(nonces[1] >> 32),
+			(uint32_t)(nonces[0] >> 32));
+	chacha20_rounds_sse2(s, stream);
+}
+
+__attribute__((target("sse2")))
+static void chacha20_xor_sse2(uint8_t *out, const uint8_t *in, const uint8_t *stream, uint32_t len) {
+	uint32_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)),
+				_mm_loadu_si128((const __m128i *)(stream + i))));
+	}
+	for (; i < len; ++i) {
+		out[i] = in[i] ^ stream[i];
+	}
+}
+
+__attribute__((target("sse2")))
+static void chacha20_sse2(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+	uint8_t stream[CHACHA20_SSE2_BLOCKS * CHACHA20_BLOCK_SIZE] __attribute__((aligned(16)));
+	uint32_t blocks;
+
+	while (len >= sizeof(stream)) {
+		chacha20_stream_sse2(ctx, stream);
+		chacha20_xor_sse2(out, in, stream, sizeof(stream));
+		ctx->state[12] += CHACHA20_SSE2_BLOCKS;
+		len -= sizeof(stream);
+		out += sizeof(stream);
+		in += sizeof(stream);
+	}
+	if (len > 2 * CHACHA20_BLOCK_SIZE) {
+		// Three or four blocks left - still cheaper as one 4-way pass
+		blocks = (len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE;
+		chacha20_stream_sse2(ctx, stream);
+		chacha20_xor_sse2(out, in, stream, len);
+		ctx->state[12] += blocks;
+		crypto_zero(stream, sizeof(stream));
+	} else if (len) {
+		chacha20_scalar(ctx, out, in, len);
+	}
+}
+
+#define AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32((v), (n)), _mm256_srli_epi32((v), 32 - (n)))
+
+#define AVX2_QUARTERROUND(a, b, c, d) \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 12); \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 7)
+
+// Unpack works within 128-bit lanes, so transposing words w..w+3 yields blocks j and j+4 in the two halves
+#define AVX2_STORE8(stream, x, w) { \
+	__m256i t0 = _mm256_unpacklo_epi32(x[w + 0], x[w + 1]); \
+	__m256i t1 = _mm256_unpacklo_epi32(x[w + 2], x[w + 3]); \
+	__m256i t2 = _mm256_unpackhi_epi32(x[w + 0], x[w + 1]); \
+	__m256i t3 = _mm256_unpackhi_epi32(x[w + 2], x[w + 3]); \
+	__m256i b0 = _mm256_unpacklo_epi64(t0, t1); \
+	__m256i b1 = _mm256_unpackhi_epi64(t0, t1); \
+	__m256i b2 = _mm256_unpacklo_epi64(t2, t3); \
+	__m256i b3 = _mm256_unpackhi_epi64(t2, t3); \
+	_mm_storeu_si128((__m128i *)(stream + 0 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_castsi256_si128(b0)); \
+	_mm_storeu_si128((__m128i *)(stream + 1 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_castsi256_si128(b1)); \
+	_mm_storeu_si128((__m128i *)(stream + 2 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_castsi256_si128(b2)); \
+	_mm_storeu_si128((__m128i *)(stream + 3 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_castsi256_si128(b3)); \
+	_mm_storeu_si128((__m128i *)(stream + 4 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_extracti128_si256(b0, 1)); \
+	_mm_storeu_si128((__m128i *)(stream + 5 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_extracti128_si256(b1, 1)); \
+	_mm_storeu_si128((__m128i *)(stream + 6 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_extracti128_si256(b2, 1)); \
+	_mm_storeu_si128((__m128i *)(stream + 7 * CHACHA20_BLOCK_SIZE + 4 * w), _mm256_extracti128_si256(b3, 1)); }
+
+// Eight blocks for the per-lane input words in s, serialized into stream
+__attribute__((target("avx2")))
+static inline void chacha20_rounds_avx2(const __m256i s[16], uint8_t *stream) {
+	const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+			13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+			14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	__m256i x[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = s[i];
+	}
+
+	for (i = 0; i < 10; ++i) {
+		AVX2_QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+		AVX2_QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+		AVX2_QUARTERROUND(x[2], x[6], x[10], x[14]);
+		AVX2_QUARTERROUND(x[3], x[7], x[11], x[15]);
+		AVX2_QUARTERROUND(x[0], x[5], x[10], x[15]);
+		AVX2_QUARTERROUND(x[1], x[6], x[11], x[12]);
+		AVX2_QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+		AVX2_QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = _mm256_add_epi32(x[i], s[i]);
+	}
+	AVX2_STORE8(stream, x, 0);
+	AVX2_STORE8(stream, x, 4);
+	AVX2_STORE8(stream, x, 8);
+	AVX2_STORE8(stream, x, 12);
+}
+
+// Eight blocks of keystream starting at the current block counter
+__attribute__((target("avx2")))
+static void chacha20_stream_avx2(const struct chacha20_ctx *ctx, uint8_t *stream) {
+	__m256i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm256_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm256_add_epi32(s[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	chacha20_rounds_avx2(s, stream);
+}
+
+// One block for each of eight (block counter, nonce) pairs under the key in ctx
+__attribute__((target("avx2")))
+static void chacha20_lanes_avx2(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces, uint8_t *stream) {
+	__m256i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm256_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm256_loadu_si256((const __m256i *)counters);
+	s[14] = _mm256_set_epi32((uint32_t)nonces[7], (uint32_t)nonces[6], (uint32_t)nonces[5], (uint32_t)nonces[4],
+			(uint32_t)nonces[3], (uint32_t)nonces[2], (uint32_t)nonces[1], (uint32_t)nonces[0]);
+	s[15] = _mm256_set_epi32((uint32_t)(nonces[7] >> 32), (uint32_t)(nonces[6] >> 32), (uint32_t)(nonces[5] >> 32),
+			(uint32_t)(nonces[4] >> 32), (uint32_t)(nonces[3] >> 32), (uint32_t)(nonces[2] >> 32),
+			(uint32_t)(nonces[1] >> 32), (uint32_t)(nonces[0] >> 32));
+	chacha20_rounds_avx2(s, stream);
+}
+
+__attribute__((target("avx2")))
+static void chacha20_xor_avx2(uint8_t *out, const uint8_t *in, const uint8_t *stream, uint32_t len) {
+	uint32_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(in + i)),
+				_mm256_loadu_si256((const __m256i *)(stream + i))));
+	}
+	for (; i < len; ++i) {
+		out[i] = in[i] ^ stream[i];
+	}
+}
+
+__attribute__((target("avx2")))
+static void chacha20_avx2(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+	uint8_t stream[CHACHA20_AVX2_BLOCKS * CHACHA20_BLOCK_SIZE] __attribute__((aligned(32)));
+	uint32_t blocks;
+
+	while (len >= sizeof(stream)) {
+		chacha20_stream_avx2(ctx, stream);
+		chacha20_xor_avx2(out, in, stream, sizeof(stream));
+		ctx->state[12] += CHACHA20_AVX2_BLOCKS;
+		len -= sizeof(stream);
+		out += sizeof(stream);
+		in += sizeof(stream);
+	}
+	if (len > 4 * CHACHA20_BLOCK_SIZE) {
+		blocks = (len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE;
+		chacha20_stream_avx2(ctx, stream);
+		chacha20_xor_avx2(out, in, stream, len);
+		ctx->state[12] += blocks;
+		crypto_zero(stream, sizeof(stream));
+	} else if (len) {
+		chacha20_sse2(ctx, out, in, len);
+	}
+}
+
+#define CHACHA20_AVX512_BLOCKS	(16)
+// Below this the wide registers are not worth their frequency licence - leave short messages to AVX2
+#define CHACHA20_AVX512_MIN_LEN	(8 * CHACHA20_BLOCK_SIZE)
+
+#define AVX512_QUARTERROUND(a, b, c, d) \
+	a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = _mm512_rol_epi32(d, 16); \
+	c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = _mm512_rol_epi32(b, 12); \
+	a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = _mm512_rol_epi32(d,  8); \
+	c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = _mm512_rol_epi32(b,  7)
+
+// As for AVX2, but each register now holds blocks j, j+4, j+8 and j+12 in its four 128-bit lanes
+#define AVX512_STORE_LANES(stream, b, j, w) \
+	_mm_storeu_si128((__m128i *)(stream + (j +  0) * CHACHA20_BLOCK_SIZE + 4 * w), _mm512_extracti32x4_epi32(b, 0)); \
+	_mm_storeu_si128((__m128i *)(stream + (j +  4) * CHACHA20_BLOCK_SIZE + 4 * w), _mm512_extracti32x4_epi32(b, 1)); \
+	_mm_storeu_si128((__m128i *)(stream + (j +  8) * CHACHA20_BLOCK_SIZE + 4 * w), _mm512_extracti32x4_epi32(b, 2)); \
+	_mm_storeu_si128((__m128i *)(stream + (j + 12) * CHACHA20_BLOCK_SIZE + 4 * w), _mm512_extracti32x4_epi32(b, 3))
+
+#define AVX512_STORE16(stream, x, w) { \
+	__m512i t0 = _mm512_unpacklo_epi32(x[w + 0], x[w + 1]); \
+	__m512i t1 = _mm512_unpacklo_epi32(x[w + 2], x[w + 3]); \
+	__m512i t2 = _mm512_unpackhi_epi32(x[w + 0], x[w + 1]); \
+	__m512i t3 = _mm512_unpackhi_epi32(x[w + 2], x[w + 3]); \
+	__m512i b0 = _mm512_unpacklo_epi64(t0, t1); \
+	__m512i b1 = _mm512_unpackhi_epi64(t0, t1); \
+	__m512i b2 = _mm512_unpacklo_epi64(t2, t3); \
+	__m512i b3 = _mm512_unpackhi_epi64(t2, t3); \
+	AVX512_STORE_LANES(stream, b0, 0, w); \
+	AVX512_STORE_LANES(stream, b1, 1, w); \
+	AVX512_STORE_LANES(stream, b2, 2, w); \
+	AVX512_STORE_LANES(stream, b3, 3, w); }
+
+// Sixteen blocks for the per-lane input words in s, serialized into stream
+__attribute__((target("avx512f,avx512vl")))
+static inline void chacha20_rounds_avx512(const __m512i s[16], uint8_t *stream) {
+	__m512i x[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = s[i];
+	}
+
+	for (i = 0; i < 10; ++i) {
+		AVX512_QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+		AVX512_QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+		AVX512_QUARTERROUND(x[2], x[6], x[10], x[14]);
+		AVX512_QUARTERROUND(x[3], x[7], x[11], x[15]);
+		AVX512_QUARTERROUND(x[0], x[5], x[10], x[15]);
+		AVX512_QUARTERROUND(x[1], x[6], x[11], x[12]);
+		AVX512_QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+		AVX512_QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = _mm512_add_epi32(x[i], s[i]);
+	}
+	AVX512_STORE16(stream, x, 0);
+	AVX512_STORE16(stream, x, 4);
+	AVX512_STORE16(stream, x, 8);
+	AVX512_STORE16(stream, x, 12);
+}
+
+// Sixteen blocks of keystream starting at the current block counter
+__attribute__((target("avx512f,avx512vl")))
+static void chacha20_stream_avx512(const struct chacha20_ctx *ctx, uint8_t *stream) {
+	__m512i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm512_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm512_add_epi32(s[12], _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+	chacha20_rounds_avx512(s, stream);
+}
+
+// One block for each of sixteen (block counter, nonce) pairs under the key in ctx
+__attribute__((target("avx512f,avx512vl")))
+static void chacha20_lanes_avx512(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces, uint8_t *stream) {
+	__m512i s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = _mm512_set1_epi32(ctx->state[i]);
+	}
+	s[12] = _mm512_loadu_si512((const void *)counters);
+	s[14] = _mm512_set_epi32((uint32_t)nonces[15], (uint32_t)nonces[14], (uint32_t)nonces[13], (uint32_t)nonces[12],
+			(uint32_t)nonces[11], (uint32_t)nonces[10], (uint32_t)nonces[9], (uint32_t)nonces[8],
+			(uint32_t)nonces[7], (uint32_t)nonces[6], (uint32_t)nonces[5], (uint32_t)nonces[4],
+			(uint32_t)nonces[3], (uint32_t)nonces[2], (uint32_t)nonces[1], (uint32_t)nonces[0]);
+	s[15] = _mm512_set_epi32((uint32_t)(nonces[15] >> 32), (uint32_t)(nonces[14] >> 32), (uint32_t)(nonces[13] >> 32),
+			(uint32_t)(nonces[12] >> 32), (uint32_t)(nonces[11] >> 32), (uint32_t)(nonces[10] >> 32),
+			(uint32_t)(nonces[9] >> 32), (uint32_t)(nonces[8] >> 32), (uint32_t)(nonces[7] >> 32),
+			(uint32_t)(nonces[6] >> 32), (uint32_t)(nonces[5] >> 32), (uint32_t)(nonces[4] >> 32),
+			(uint32_t)(nonces[3] >> 32), (uint32_t)(nonces[2] >> 32), (uint32_t)(nonces[1] >> 32),
+			(uint32_t)(nonces[0] >> 32));
+	chacha20_rounds_avx512(s, stream);
+}
+
+__attribute__((target("avx512f,avx512vl")))
+static void chacha20_xor_avx512(uint8_t *out, const uint8_t *in, const uint8_t *stream, uint32_t len) {
+	uint32_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		_mm512_storeu_si512((void *)(out + i), _mm512_xor_si512(_mm512_loadu_si512((const void *)(in + i)),
+				_mm512_loadu_si512((const void *)(stream + i))));
+	}
+	for (; i < len; ++i) {
+		out[i] = in[i] ^ stream[i];
+	}
+}
+
+__attribute__((target("avx512f,avx512vl")))
+static void chacha20_avx512(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+	uint8_t stream[CHACHA20_AVX512_BLOCKS * CHACHA20_BLOCK_SIZE] __attribute__((aligned(64)));
+	uint32_t blocks;
+
+	if (len < CHACHA20_AVX512_MIN_LEN) {
+		chacha20_avx2(ctx, out, in, len);
+		return;
+	}
+	while (len >= sizeof(stream)) {
+		chacha20_stream_avx512(ctx, stream);
+		chacha20_xor_avx512(out, in, stream, sizeof(stream));
+		ctx->state[12] += CHACHA20_AVX512_BLOCKS;
+		len -= sizeof(stream);
+		out += sizeof(stream);
+		in += sizeof(stream);
+	}
+	if (len > 8 * CHACHA20_BLOCK_SIZE) {
+		blocks = (len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE;
+		chacha20_stream_avx512(ctx, stream);
+		chacha20_xor_avx512(out, in, stream, len);
+		ctx->state[12] += blocks;
+		crypto_zero(stream, sizeof(stream));
+	} else if (len) {
+		chacha20_avx2(ctx, out, in, len);
+	}
+}
+
+static bool chacha20_cpu_sse2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool chacha20_cpu_avx2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool chacha20_cpu_avx512(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+}
+#endif /* CHACHA20_X86 */
+
+static bool chacha20_cpu_any(void) {
+	return true;
+}
+
+typedef void (*chacha20_fn)(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len);
+typedef void (*chacha20_lanes_fn)(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces, uint8_t *stream);
+
+struct chacha20_impl {
+	const char *name;
+	chacha20_fn fn;
+	bool (*supported)(void);
+	// Bytes per full-width pass - callers that feed the cipher piecewise should use multiples of this
+	uint32_t stride;
+	// Independent blocks, one per lane
+	chacha20_lanes_fn lanes_fn;
+	uint32_t lanes;
+};
+
+// Indexed by enum chacha20_kernel
+static const struct chacha20_impl chacha20_impls[] = {
+	[CHACHA20_KERNEL_SCALAR] = { "scalar", chacha20_scalar, chacha20_cpu_any, CHACHA20_BLOCK_SIZE,
+		chacha20_lanes_scalar, 1 },
+#if CHACHA20_X86
+	[CHACHA20_KERNEL_SSE2] = { "sse2", chacha20_sse2, chacha20_cpu_sse2, CHACHA20_SSE2_BLOCKS * CHACHA20_BLOCK_SIZE,
+		chacha20_lanes_sse2, CHACHA20_SSE2_BLOCKS },
+	[CHACHA20_KERNEL_AVX2] = { "avx2", chacha20_avx2, chacha20_cpu_avx2, CHACHA20_AVX2_BLOCKS * CHACHA20_BLOCK_SIZE,
+		chacha20_lanes_avx2, CHACHA20_AVX2_BLOCKS },
+	[CHACHA20_KERNEL_AVX512] = { "avx512", chacha20_avx512, chacha20_cpu_avx512, CHACHA20_AVX512_BLOCKS * CHACHA20_BLOCK_SIZE,
+		chacha20_lanes_avx512, CHACHA20_AVX512_BLOCKS },
+#endif
+};
+
+#define CHACHA20_NUM_KERNELS (sizeof(chacha20_impls) / sizeof(chacha20_impls[0]))
+
+// Scalar until chacha20_select_kernel() has been run
+static chacha20_fn chacha20_impl = chacha20_scalar;
+static uint32_t chacha20_impl_stride = CHACHA20_BLOCK_SIZE;
+static int chacha20_impl_kernel = CHACHA20_KERNEL_SCALAR;
+
+void chacha20(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len) {
+	chacha20_impl(ctx, out, in, len);
+}
+
+uint32_t chacha20_stride(void) {
+	return chacha20_impl_stride;
+}
+
+static void chacha20_keystream_lanes_with(int kernel, const struct chacha20_ctx *ctx, const uint32_t *counters,
+		const uint64_t *nonces, size_t blocks, uint8_t *stream) {
+	// Full-width passes of the kernel, then the remainder on successively narrower ones
+	for (; kernel >= CHACHA20_KERNEL_SCALAR; kernel--) {
+		const struct chacha20_impl *impl = &chacha20_impls[kernel];
+		while (blocks >= impl->lanes) {
+			impl->lanes_fn(ctx, counters, nonces, stream);
+			counters += impl->lanes;
+			nonces += impl->lanes;
+			stream += impl->lanes * CHACHA20_BLOCK_SIZE;
+			blocks -= impl->lanes;
+		}
+	}
+}
+
+void chacha20_keystream_lanes(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces,
+		size_t blocks, uint8_t *stream) {
+	chacha20_keystream_lanes_with(chacha20_impl_kernel, ctx, counters, nonces, blocks, stream);
+}
+
+// RFC7539 2.4.2 - Example and Test Vector for the ChaCha20 Cipher
+static const uint8_t chacha20_kat_plaintext[114] = "Ladies and Gentlemen of the class of '99: "
+		"If I could offer you only one tip for the future, sunscreen would be it.";
+static const uint8_t chacha20_kat_ciphertext[114] = {
+	0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+	0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+	0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+	0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+	0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+	0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+	0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+	0x87, 0x4d
+};
+
+// Known answer test for one kernel: the RFC vector, then a comparison against the scalar code over lengths that
+// exercise the full-width, partial-width and tail paths - including the block counter carried between calls
+static bool chacha20_kernel_selftest(int kernel) {
+	chacha20_fn fn = chacha20_impls[kernel].fn;
+	static const uint32_t lengths[] = { 1, 63, 64, 65, 191, 256, 320, 511, 512, 600, 1024, 1100, 1420, 2047 };
+	uint32_t counters[31];
+	uint64_t nonces[31];
+	uint8_t key[CHACHA20_KEY_SIZE];
+	uint8_t src[2048];
+	uint8_t expected[2048];
+	uint8_t actual[2048];
+	struct chacha20_ctx ref, ctx;
+	uint32_t i;
+	bool result = true;
+
+	for (i = 0; i < sizeof(key); ++i) {
+		key[i] = i;
+	}
+	chacha20_init(&ctx, key, (uint64_t)0x4a000000);
+	ctx.state[12] = 1;
+	fn(&ctx, actual, chacha20_kat_plaintext, sizeof(chacha20_kat_plaintext));
+	if (memcmp(actual, chacha20_kat_ciphertext, sizeof(chacha20_kat_ciphertext)) != 0) {
+		result = false;
+	}
+
+	for (i = 0; i < sizeof(src); ++i) {
+		src[i] = (uint8_t)(i * 7 + 3);
+	}
+	for (i = 0; result && (i < sizeof(lengths) / sizeof(lengths[0])); ++i) {
+		chacha20_init(&ref, key, 0x0123456789abcdefULL + i);
+		chacha20_init(&ctx, key, 0x0123456789abcdefULL + i);
+		// Start near the top of the 32-bit block counter so the lanes wrap
+		ref.state[12] = ctx.state[12] = 0xfffffffc;
+		chacha20_scalar(&ref, expected, src, lengths[i]);
+		chacha20_scalar(&ref, expected + lengths[i], src, sizeof(src) - lengths[i]);
+		fn(&ctx, actual, src, lengths[i]);
+		fn(&ctx, actual + lengths[i], src, sizeof(src) - lengths[i]);
+		if ((memcmp(expected, actual, sizeof(expected)) != 0) || (ref.state[12] != ctx.state[12])) {
+			result = false;
+		}
+	}
+
+	// Independent lanes - an odd count so every narrower kernel takes part too
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i) {
+		counters[i] = 0xfffffff0 + 3 * i;
+		nonces[i] = 0x0123456789abcdefULL * (i + 1);
+		chacha20_lanes_scalar(&ref, &counters[i], &nonces[i], expected + i * CHACHA20_BLOCK_SIZE);
+	}
+	chacha20_keystream_lanes_with(kernel, &ref, counters, nonces, i, actual);
+	if (memcmp(expected, actual, i * CHACHA20_BLOCK_SIZE) != 0) {
+		result = false;
+	}
+	return result;
+}
+
+const char *chacha20_kernel_name(int kernel) {
+	if ((kernel > CHACHA20_KERNEL_AUTO) && ((size_t)kernel < CHACHA20_NUM_KERNELS) && chacha20_impls[kernel].fn) {
+		return chacha20_impls[kernel].name;
+	}
+	return (kernel == CHACHA20_KERNEL_AUTO) ? "auto" : "unknown";
+}
+
+int chacha20_kernel_by_name(const char *name) {
+	int x;
+
+	if (!strcmp(name, "auto")) {
+		return CHACHA20_KERNEL_AUTO;
+	}
+	for (x = CHACHA20_KERNEL_SCALAR; (size_t)x < CHACHA20_NUM_KERNELS; x++) {
+		if (chacha20_impls[x].fn && !strcmp(name, chacha20_impls[x].name)) {
+			return x;
 		}
 	}
+	return -1;
 }
 
+int chacha20_select_kernel(int kernel) {
+	int best = CHACHA20_KERNEL_SCALAR;
+	int x;
+
+	// Fastest kernel the CPU supports and that reproduces the reference output
+	for (x = CHACHA20_NUM_KERNELS - 1; x > CHACHA20_KERNEL_SCALAR; x--) {
+		if (chacha20_impls[x].fn && chacha20_impls[x].supported() && chacha20_kernel_selftest(x)) {
+			best = x;
+			break;
+		}
+	}
+
+	// A forced kernel is only honoured if it is usable here
+	if ((kernel > CHACHA20_KERNEL_AUTO) && ((size_t)kernel < CHACHA20_NUM_KERNELS) && chacha20_impls[kernel].fn &&
+		chacha20_impls[kernel].supported() && chacha20_kernel_selftest(kernel)) {
+		best = kernel;
+	}
+
+	chacha20_impl = chacha20_impls[best].fn;
+	chacha20_impl_stride = chacha20_impls[best].stride;
+	chacha20_impl_kernel = best;
+	return best;
+}
 
 // 2.3.  The ChaCha20 Block Function
 // The first four words (0-3) are constants: 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
@@ -147,6 +765,12 @@ void chacha20(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_
 // Words 13-15 are a nonce, which should not be repeated for the same key.
 // For wireguard: "nonce being composed of 32 bits of zeros followed by the 64-bit little-endian value of counter." where counter comes from the Wireguard layer and is separate from the block counter in word 12
 void chacha20_init(struct chacha20_ctx *ctx, const uint8_t *key, const uint64_t nonce) {
+	chacha20_init_key(ctx, key);
+	chacha20_set_nonce(ctx, nonce);
+}
+
+// The constant and key words only - a template that chacha20_set_nonce() turns into a ready to use state
+void chacha20_init_key(struct chacha20_ctx *ctx, const uint8_t *key) {
 	ctx->state[0] = CHACHA20_CONSTANT_1;
 	ctx->state[1] = CHACHA20_CONSTANT_2;
 	ctx->state[2] = CHACHA20_CONSTANT_3;
@@ -159,6 +783,14 @@ void chacha20_init(struct chacha20_ctx *ctx, const uint8_t *key, const uint64_t
 	ctx->state[9] = U8TO32_LITTLE(key + 20);
 	ctx->state[10] = U8TO32_LITTLE(key + 24);
 	ctx->state[11] = U8TO32_LITTLE(key + 28);
+	ctx->state[12] = 0;
+	ctx->state[13] = 0;
+	ctx->state[14] = 0;
+	ctx->state[15] = 0;
+}
+
+// Reset the block counter and set the nonce words, leaving the key words alone
+void chacha20_set_nonce(struct chacha20_ctx *ctx, const uint64_t nonce) {
 	ctx->state[12] = 0;
 	ctx->state[13] = 0;
 	ctx->state[14] = nonce & 0xFFFFFFFF;
@@ -38,16 +38,42 @@
 #define _CHACHA20_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define CHACHA20_BLOCK_SIZE		(64)
 #define CHACHA20_KEY_SIZE		(32)
 
 struct chacha20_ctx {
 	uint32_t state[16];
+} __attribute__((aligned(16)));
+
+// Implementations of the bulk cipher - higher values are faster, not all are available on every CPU
+enum chacha20_kernel {
+	CHACHA20_KERNEL_AUTO = 0,
+	CHACHA20_KERNEL_SCALAR,
+	CHACHA20_KERNEL_SSE2,
+	CHACHA20_KERNEL_AVX2,
+	CHACHA20_KERNEL_AVX512,
 };
 
 void chacha20_init(struct chacha20_ctx *ctx, const uint8_t *key, const uint64_t nonce);
+// chacha20_init() in two steps, so the expanded key can be kept and reused with many nonces
+void chacha20_init_key(struct chacha20_ctx *ctx, const uint8_t *key);
+void chacha20_set_nonce(struct chacha20_ctx *ctx, const uint64_t nonce);
 void chacha20(struct chacha20_ctx *ctx, uint8_t *out, const uint8_t *in, uint32_t len);
 void hchacha20(uint8_t *out, const uint8_t *nonce, const uint8_t *key);
 
+// Pick the kernel used by chacha20() - CHACHA20_KERNEL_AUTO selects the fastest one the CPU supports
+// Every candidate is checked against the RFC7539 test vector first; returns the kernel actually in use
+int chacha20_select_kernel(int kernel);
+const char *chacha20_kernel_name(int kernel);
+// Bytes the selected kernel processes per full-width pass (always a multiple of CHACHA20_BLOCK_SIZE)
+uint32_t chacha20_stride(void);
+// Keystream for independent blocks under one key - block i uses counters[i] and nonces[i] in place of the
+// counter and nonce words of ctx. Spreads the blocks (e.g. of several short packets) across the SIMD lanes.
+void chacha20_keystream_lanes(const struct chacha20_ctx *ctx, const uint32_t *counters, const uint64_t *nonces,
+		size_t blocks, uint8_t *stream);
+// Kernel for a name as returned by chacha20_kernel_name() or "auto" - returns -1 if unknown
+int chacha20_kernel_by_name(const char *name);
+
 #endif /* _CHACHA20_H_ */
@@ -38,22 +38,32 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "../crypto.h"
 
 #define POLY1305_KEY_SIZE		32
 #define POLY1305_MAC_SIZE		16
 
+// The cipher and the MAC take turns on chunks of this size (or the cipher's stride if larger), so each chunk of
+// ciphertext is still in L1 when the second pass over it runs - a whole message is only swept once
+#define CHACHA20POLY1305_CHUNK_SIZE	256
+
 static const uint8_t zero[CHACHA20_BLOCK_SIZE] = { 0 };
 
+static size_t chunk_size(void) {
+	size_t stride = chacha20_stride();
+	return (stride > CHACHA20POLY1305_CHUNK_SIZE) ? stride : CHACHA20POLY1305_CHUNK_SIZE;
+}
+
 // 2.6.  Generating the Poly1305 Key Using ChaCha20
-static void generate_poly1305_key(struct poly1305_context *poly1305_state, struct chacha20_ctx *chacha20_state, const uint8_t *key, uint64_t nonce) {
+// chacha20_state holds the key and nonce with the block counter at zero
+static void generate_poly1305_key(struct poly1305_context *poly1305_state, struct chacha20_ctx *chacha20_state) {
 	uint8_t block[POLY1305_KEY_SIZE] = {0};
 
 	// The method is to call the block function with the following parameters:
 	// - The 256-bit session integrity key is used as the ChaCha20 key.
 	// - The block counter is set to zero.
 	// - The protocol will specify a 96-bit or 64-bit nonce
-	chacha20_init(chacha20_state, key, nonce);
 
 	// We take the first 256 bits or the serialized state, and use those as the one-time Poly1305 key
 	chacha20(chacha20_state, block, block, sizeof(block));
@@ -64,17 +74,16 @@ static void generate_poly1305_key(struct poly1305_context *poly1305_state, struc
 }
 
 // 2.8.  AEAD Construction (Encryption)
-void chacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+static void aead_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, struct chacha20_ctx *chacha20_state) {
 	struct poly1305_context poly1305_state;
-	struct chacha20_ctx chacha20_state;
 	uint8_t block[8];
 	size_t padded_len;
+	size_t chunk = chunk_size();
+	size_t offset;
+	size_t len;
 
 	// First, a Poly1305 one-time key is generated from the 256-bit key and nonce using the procedure described in Section 2.6.
-	generate_poly1305_key(&poly1305_state, &chacha20_state, key, nonce);
-
-	// Next, the ChaCha20 encryption function is called to encrypt the plaintext, using the same key and nonce, and with the initial counter set to 1.
-	chacha20(&chacha20_state, dst, src, src_len);
+	generate_poly1305_key(&poly1305_state, chacha20_state);
 
 	// Finally, the Poly1305 function is called with the Poly1305 key calculated above, and a message constructed as a concatenation of the following:
 	// - The AAD
@@ -83,7 +92,13 @@ void chacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len,
 	padded_len = (ad_len + 15) & 0xFFFFFFF0; // Round up to next 16 bytes
 	poly1305_update(&poly1305_state, zero, padded_len - ad_len);
 	// - The ciphertext
-	poly1305_update(&poly1305_state, dst, src_len);
+	// Next, the ChaCha20 encryption function is called to encrypt the plaintext, using the same key and nonce, and with the initial counter set to 1.
+	// Each chunk is encrypted and then MACed straight away. Chunks are whole blocks so the block counter carries over.
+	for (offset = 0; offset < src_len; offset += len) {
+		len = (src_len - offset < chunk) ? src_len - offset : chunk;
+		chacha20(chacha20_state, dst + offset, src + offset, len);
+		poly1305_update(&poly1305_state, dst + offset, len);
+	}
 	// - padding2 -- the padding is up to 15 zero bytes, and it brings the total length so far to an integral multiple of 16.
 	padded_len = (src_len + 15) & 0xFFFFFFF0; // Round up to next 16 bytes
 	poly1305_update(&poly1305_state, zero, padded_len - src_len);
@@ -99,19 +114,38 @@ void chacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len,
 	// - A 128-bit tag, which is the output of the Poly1305 function. (append to dst)
 	poly1305_finish(&poly1305_state, dst + src_len);
 
+	crypto_zero(&block, sizeof(block));
+}
+
+void chacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	struct chacha20_ctx chacha20_state;
+
+	chacha20_init(&chacha20_state, key, nonce);
+	aead_encrypt(dst, src, src_len, ad, ad_len, &chacha20_state);
+
 	// Make sure we leave nothing sensitive on the stack
 	crypto_zero(&chacha20_state, sizeof(chacha20_state));
-	crypto_zero(&block, sizeof(block));
+}
+
+void chacha20poly1305_encrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct chacha20_ctx *key_state) {
+	struct chacha20_ctx chacha20_state = *key_state;
+
+	chacha20_set_nonce(&chacha20_state, nonce);
+	aead_encrypt(dst, src, src_len, ad, ad_len, &chacha20_state);
+
+	crypto_zero(&chacha20_state, sizeof(chacha20_state));
 }
 
 // 2.8.  AEAD Construction (Decryption)
-bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+static bool aead_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, struct chacha20_ctx *chacha20_state) {
 	struct poly1305_context poly1305_state;
-	struct chacha20_ctx chacha20_state;
 	uint8_t block[8];
 	uint8_t mac[POLY1305_MAC_SIZE];
 	size_t padded_len;
-	int dst_len;
+	size_t dst_len;
+	size_t chunk = chunk_size();
+	size_t offset;
+	size_t len;
 	bool result = false;
 
 	// Decryption is similar [to encryption] with the following differences:
@@ -123,9 +157,7 @@ bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len,
 		dst_len = src_len - POLY1305_MAC_SIZE;
 
 		// First, a Poly1305 one-time key is generated from the 256-bit key and nonce using the procedure described in Section 2.6.
-		generate_poly1305_key(&poly1305_state, &chacha20_state, key, nonce);
-
-		// Calculate the MAC before attempting decryption
+		generate_poly1305_key(&poly1305_state, chacha20_state);
 
 		// the Poly1305 function is called with the Poly1305 key calculated above, and a message constructed as a concatenation of the following:
 		// - The AAD
@@ -134,7 +166,13 @@ bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len,
 		padded_len = (ad_len + 15) & 0xFFFFFFF0; // Round up to next 16 bytes
 		poly1305_update(&poly1305_state, zero, padded_len - ad_len);
 		// - The ciphertext (note the Poly1305 function is still run on the AAD and the ciphertext, not the plaintext)
-		poly1305_update(&poly1305_state, src, dst_len);
+		// Each chunk is MACed and then decrypted while it is hot. This works in place (dst == src), but the plaintext is
+		// only provisional until the tag has been checked below.
+		for (offset = 0; offset < dst_len; offset += len) {
+			len = (dst_len - offset < chunk) ? dst_len - offset : chunk;
+			poly1305_update(&poly1305_state, src + offset, len);
+			chacha20(chacha20_state, dst + offset, src + offset, len);
+		}
 		// - padding2 -- the padding is up to 15 zero bytes, and it brings the total length so far to an integral multiple of 16.
 		padded_len = (dst_len + 15) & 0xFFFFFFF0; // Round up to next 16 bytes
 		poly1305_update(&poly1305_state, zero, padded_len - dst_len);
@@ -146,21 +184,174 @@ bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len,
 		poly1305_update(&poly1305_state, block, sizeof(block));
 
 		// The output from the AEAD is twofold:
-		// - A plaintext of the same length as the ciphertext. (below, output of chacha20 into dst)
+		// - A plaintext of the same length as the ciphertext. (above, output of chacha20 into dst)
 		// - A 128-bit tag, which is the output of the Poly1305 function. (into mac for checking against passed mac)
 		poly1305_finish(&poly1305_state, mac);
 
-
 		if (crypto_equal(mac, src + dst_len, POLY1305_MAC_SIZE)) {
-			// mac is correct - do the decryption
-			// Next, the ChaCha20 encryption function is called to decrypt the ciphertext, using the same key and nonce, and with the initial counter set to 1.
-			chacha20(&chacha20_state, dst, src, dst_len);
 			result = true;
+		} else if (dst_len) {
+			// Never hand out unauthenticated plaintext
+			crypto_zero(dst, dst_len);
 		}
 	}
 	return result;
 }
 
+bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key) {
+	struct chacha20_ctx chacha20_state;
+	bool result;
+
+	chacha20_init(&chacha20_state, key, nonce);
+	result = aead_decrypt(dst, src, src_len, ad, ad_len, &chacha20_state);
+
+	crypto_zero(&chacha20_state, sizeof(chacha20_state));
+	return result;
+}
+
+bool chacha20poly1305_decrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct chacha20_ctx *key_state) {
+	struct chacha20_ctx chacha20_state = *key_state;
+	bool result;
+
+	chacha20_set_nonce(&chacha20_state, nonce);
+	result = aead_decrypt(dst, src, src_len, ad, ad_len, &chacha20_state);
+
+	crypto_zero(&chacha20_state, sizeof(chacha20_state));
+	return result;
+}
+
+// Batches
+// Short packets are too small to fill the SIMD lanes on their own, so the keystream for a group of packets - the
+// Poly1305 key block and the data blocks of each - is generated in one go with the blocks spread across the lanes.
+// Packets long enough to fill the lanes by themselves take the single packet path.
+
+#define CHACHA20POLY1305_BATCH_BLOCKS	64
+#define CHACHA20POLY1305_BATCH_MAX_LEN	(8 * CHACHA20_BLOCK_SIZE)
+
+// Poly1305 over the AEAD construction of 2.8
+static void aead_mac(uint8_t *mac, const uint8_t *poly1305_key, const uint8_t *ad, size_t ad_len, const uint8_t *ct, size_t ct_len) {
+	struct poly1305_context poly1305_state;
+	uint8_t block[8];
+
+	poly1305_init(&poly1305_state, poly1305_key);
+	poly1305_update(&poly1305_state, ad, ad_len);
+	poly1305_update(&poly1305_state, zero, ((ad_len + 15) & 0xFFFFFFF0) - ad_len);
+	poly1305_update(&poly1305_state, ct, ct_len);
+	poly1305_update(&poly1305_state, zero, ((ct_len + 15) & 0xFFFFFFF0) - ct_len);
+	U64TO8_LITTLE(block, (uint64_t)ad_len);
+	poly1305_update(&poly1305_state, block, sizeof(block));
+	U64TO8_LITTLE(block, (uint64_t)ct_len);
+	poly1305_update(&poly1305_state, block, sizeof(block));
+	poly1305_finish(&poly1305_state, mac);
+}
+
+static void xor_stream(uint8_t *dst, const uint8_t *src, const uint8_t *stream, size_t len) {
+	uint64_t a, b;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&a, src + i, 8);
+		memcpy(&b, stream + i, 8);
+		a ^= b;
+		memcpy(dst + i, &a, 8);
+	}
+	for (; i < len; i++) {
+		dst[i] = src[i] ^ stream[i];
+	}
+}
+
+// Keystream blocks needed by a packet with len bytes of plain text, including the Poly1305 key block
+static size_t batch_blocks(size_t len) {
+	return 1 + (len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE;
+}
+
+// Runs fn on groups of consecutive short packets whose keystream fits the buffer, with the keystream of packet i
+// starting at stream + offsets[i]; long packets go to single
+static void batch_process(struct chacha20poly1305_batch *packets, size_t count, size_t tag_len, const struct chacha20_ctx *key_state,
+		void (*fn)(struct chacha20poly1305_batch *packet, const uint8_t *stream, const struct chacha20_ctx *key_state),
+		void (*single)(struct chacha20poly1305_batch *packet, const struct chacha20_ctx *key_state)) {
+	uint8_t stream[CHACHA20POLY1305_BATCH_BLOCKS * CHACHA20_BLOCK_SIZE] __attribute__((aligned(64)));
+	uint32_t counters[CHACHA20POLY1305_BATCH_BLOCKS];
+	uint64_t nonces[CHACHA20POLY1305_BATCH_BLOCKS];
+	size_t first, last, blocks, need, len, i, j;
+
+	for (first = 0; first < count; first = last) {
+		// Collect the next group
+		blocks = 0;
+		for (last = first; last < count; last++) {
+			len = (packets[last].src_len >= tag_len) ? packets[last].src_len - tag_len : 0;
+			if (len > CHACHA20POLY1305_BATCH_MAX_LEN) {
+				break;
+			}
+			need = batch_blocks(len);
+			if (blocks + need > CHACHA20POLY1305_BATCH_BLOCKS) {
+				break;
+			}
+			for (j = 0; j < need; j++) {
+				counters[blocks + j] = j;
+				nonces[blocks + j] = packets[last].nonce;
+			}
+			blocks += need;
+		}
+
+		if (last == first) {
+			single(&packets[last], key_state);
+			last++;
+			continue;
+		}
+
+		chacha20_keystream_lanes(key_state, counters, nonces, blocks, stream);
+		for (i = first, j = 0; i < last; i++) {
+			len = (packets[i].src_len >= tag_len) ? packets[i].src_len - tag_len : 0;
+			fn(&packets[i], stream + j * CHACHA20_BLOCK_SIZE, key_state);
+			j += batch_blocks(len);
+		}
+		crypto_zero(stream, blocks * CHACHA20_BLOCK_SIZE);
+	}
+}
+
+static void batch_encrypt_one(struct chacha20poly1305_batch *packet, const uint8_t *stream, const struct chacha20_ctx *key_state) {
+	(void)key_state;
+	// Block 0 is the one-time Poly1305 key, the data starts with block 1
+	xor_stream(packet->dst, packet->src, stream + CHACHA20_BLOCK_SIZE, packet->src_len);
+	aead_mac(packet->dst + packet->src_len, stream, packet->ad, packet->ad_len, packet->dst, packet->src_len);
+	packet->valid = true;
+}
+
+static void batch_encrypt_single(struct chacha20poly1305_batch *packet, const struct chacha20_ctx *key_state) {
+	chacha20poly1305_encrypt_ctx(packet->dst, packet->src, packet->src_len, packet->ad, packet->ad_len, packet->nonce, key_state);
+	packet->valid = true;
+}
+
+static void batch_decrypt_one(struct chacha20poly1305_batch *packet, const uint8_t *stream, const struct chacha20_ctx *key_state) {
+	uint8_t mac[POLY1305_MAC_SIZE];
+	size_t dst_len;
+
+	(void)key_state;
+	packet->valid = false;
+	if (packet->src_len >= POLY1305_MAC_SIZE) {
+		dst_len = packet->src_len - POLY1305_MAC_SIZE;
+		// The keystream is already there, so the tag can be checked before any plain text is written
+		aead_mac(mac, stream, packet->ad, packet->ad_len, packet->src, dst_len);
+		if (crypto_equal(mac, packet->src + dst_len, POLY1305_MAC_SIZE)) {
+			xor_stream(packet->dst, packet->src, stream + CHACHA20_BLOCK_SIZE, dst_len);
+			packet->valid = true;
+		}
+	}
+}
+
+static void batch_decrypt_single(struct chacha20poly1305_batch *packet, const struct chacha20_ctx *key_state) {
+	packet->valid = chacha20poly1305_decrypt_ctx(packet->dst, packet->src, packet->src_len, packet->ad, packet->ad_len, packet->nonce, key_state);
+}
+
+void chacha20poly1305_encrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct chacha20_ctx *key_state) {
+	batch_process(packets, count, 0, key_state, batch_encrypt_one, batch_encrypt_single);
+}
+
+void chacha20poly1305_decrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct chacha20_ctx *key_state) {
+	batch_process(packets, count, POLY1305_MAC_SIZE, key_state, batch_decrypt_one, batch_decrypt_single);
+}
+
 // AEAD_XChaCha20_Poly1305
 // XChaCha20-Poly1305 is a variant of the ChaCha20-Poly1305 AEAD construction as defined in [RFC7539] that uses a 192-bit nonce instead of a 96-bit nonce.
 // The algorithm for XChaCha20-Poly1305 is as follows:
@@ -37,11 +37,33 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "chacha20.h"
+
 // Aead(key, counter, plain text, auth text) ChaCha20Poly1305 AEAD, as specified in RFC7539 [17], with its nonce being composed of 32 bits of zeros followed by the 64-bit little-endian value of counter.
 // AEAD_CHACHA20_POLY1305 as described in https://tools.ietf.org/html/rfc7539
 void chacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key);
 bool chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const uint8_t *key);
 
+// As above, but with the key already expanded by chacha20_init_key() - the template is not modified
+void chacha20poly1305_encrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct chacha20_ctx *key_state);
+bool chacha20poly1305_decrypt_ctx(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, uint64_t nonce, const struct chacha20_ctx *key_state);
+
+// One packet of a batch: src_len bytes at src are encrypted (plus the tag) or decrypted (minus the tag) into dst
+// with the given nonce. valid is set on return - always for encryption, only if the tag matched for decryption.
+struct chacha20poly1305_batch {
+	uint8_t *dst;
+	const uint8_t *src;
+	size_t src_len;
+	const uint8_t *ad;
+	size_t ad_len;
+	uint64_t nonce;
+	bool valid;
+};
+
+// Encrypt/decrypt count packets under the same expanded key, spreading short packets across the SIMD lanes
+void chacha20poly1305_encrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct chacha20_ctx *key_state);
+void chacha20poly1305_decrypt_batch(struct chacha20poly1305_batch *packets, size_t count, const struct chacha20_ctx *key_state);
+
 // Xaead(key, nonce, plain text, auth text) XChaCha20Poly1305 AEAD, with a 24-byte random nonce, instantiated using HChaCha20 [6] and ChaCha20Poly1305.
 // AEAD_XChaCha20_Poly1305 as described in https://tools.ietf.org/id/draft-arciszewski-xchacha-02.html
 void xchacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len, const uint8_t *nonce, const uint8_t *key);
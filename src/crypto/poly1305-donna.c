@@ -1,7 +1,181 @@
 // Taken from https://github.com/floodyberry/poly1305-donna - public domain or MIT
 
 #include "poly1305-donna.h"
+
+// 64-bit hosts get 44-bit limbs with 64x64->128 multiplies, everything else 26-bit limbs
+#if defined(__SIZEOF_INT128__)
+#include "poly1305-donna-64.h"
+#else
 #include "poly1305-donna-32.h"
+#endif
+
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) && defined(__SIZEOF_INT128__)
+#include <immintrin.h>
+#define POLY1305_AVX2 1
+#else
+#define POLY1305_AVX2 0
+#endif
+
+#if POLY1305_AVX2
+// AVX2 4-way Horner
+// Four 16-byte blocks are absorbed per step, block j of each group going to lane j. Each lane runs Horner's rule
+// with r^4, so after the last group h = A0*r^4 + A1*r^3 + A2*r^2 + A3*r. The lanes use 26-bit limbs, so that the
+// products fit the 32x32->64 bit vpmuludq, and are converted from/to the 44-bit limbs of the scalar state at the
+// edges. Worth it only for long spans - the setup costs three scalar multiplies for the powers of r.
+
+#define POLY1305_AVX2_MIN_LEN	(256)
+#define POLY1305_AVX2_STRIDE	(4 * poly1305_block_size)
+
+#define MASK26 (0x3ffffff)
+
+// a = a * b (mod 2^130 - 5), partially reduced, 26-bit limbs
+static void poly1305_mul26(unsigned long long a[5], const unsigned long long b[5]) {
+	unsigned long long s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5;
+	unsigned long long d0, d1, d2, d3, d4, c;
+
+	d0 = a[0] * b[0] + a[1] * s4 + a[2] * s3 + a[3] * s2 + a[4] * s1;
+	d1 = a[0] * b[1] + a[1] * b[0] + a[2] * s4 + a[3] * s3 + a[4] * s2;
+	d2 = a[0] * b[2] + a[1] * b[1] + a[2] * b[0] + a[3] * s4 + a[4] * s3;
+	d3 = a[0] * b[3] + a[1] * b[2] + a[2] * b[1] + a[3] * b[0] + a[4] * s4;
+	d4 = a[0] * b[4] + a[1] * b[3] + a[2] * b[2] + a[3] * b[1] + a[4] * b[0];
+
+	             c = d0 >> 26; a[0] = d0 & MASK26;
+	d1 += c;     c = d1 >> 26; a[1] = d1 & MASK26;
+	d2 += c;     c = d2 >> 26; a[2] = d2 & MASK26;
+	d3 += c;     c = d3 >> 26; a[3] = d3 & MASK26;
+	d4 += c;     c = d4 >> 26; a[4] = d4 & MASK26;
+	a[0] += c * 5; c = a[0] >> 26; a[0] &= MASK26;
+	a[1] += c;
+}
+
+// 44-bit limbs (h0 and h1 may hold a carry) to 26-bit limbs
+static void poly1305_limbs_44to26(unsigned long long out[5], const unsigned long long in[3]) {
+	unsigned long long h0 = in[0], h1 = in[1], h2 = in[2], c;
+
+	c = h0 >> 44; h0 &= 0xfffffffffff; h1 += c;
+	c = h1 >> 44; h1 &= 0xfffffffffff; h2 += c;
+	out[0] = h0 & MASK26;
+	out[1] = ((h0 >> 26) | (h1 << 18)) & MASK26;
+	out[2] = (h1 >> 8) & MASK26;
+	out[3] = ((h1 >> 34) | (h2 << 10)) & MASK26;
+	out[4] = h2 >> 16;
+}
+
+// 26-bit limbs back to the 44-bit limbs of the scalar state, carried but not fully reduced
+static void poly1305_limbs_26to44(unsigned long long out[3], unsigned long long in[5]) {
+	unsigned long long c;
+
+	             c = in[0] >> 26; in[0] &= MASK26;
+	in[1] += c;  c = in[1] >> 26; in[1] &= MASK26;
+	in[2] += c;  c = in[2] >> 26; in[2] &= MASK26;
+	in[3] += c;  c = in[3] >> 26; in[3] &= MASK26;
+	in[4] += c;  c = in[4] >> 26; in[4] &= MASK26;
+	in[0] += c * 5; c = in[0] >> 26; in[0] &= MASK26;
+	in[1] += c;
+
+	out[0] = (in[0] | (in[1] << 26)) & 0xfffffffffff;
+	out[1] = ((in[1] >> 18) | (in[2] << 8) | (in[3] << 34)) & 0xfffffffffff;
+	out[2] = (in[3] >> 10) | (in[4] << 16);
+}
+
+#define AVX2_MASK26 _mm256_set1_epi64x(MASK26)
+
+// d = h * r (mod 2^130 - 5), per lane, partially reduced back into h
+#define AVX2_MULR(h, r, s) { \
+	__m256i d0, d1, d2, d3, d4, c; \
+	d0 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[0], r[0]), _mm256_mul_epu32(h[1], s[4])), \
+		_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], s[3]), _mm256_mul_epu32(h[3], s[2])), _mm256_mul_epu32(h[4], s[1]))); \
+	d1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[0], r[1]), _mm256_mul_epu32(h[1], r[0])), \
+		_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], s[4]), _mm256_mul_epu32(h[3], s[3])), _mm256_mul_epu32(h[4], s[2]))); \
+	d2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[0], r[2]), _mm256_mul_epu32(h[1], r[1])), \
+		_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[0]), _mm256_mul_epu32(h[3], s[4])), _mm256_mul_epu32(h[4], s[3]))); \
+	d3 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[0], r[3]), _mm256_mul_epu32(h[1], r[2])), \
+		_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[1]), _mm256_mul_epu32(h[3], r[0])), _mm256_mul_epu32(h[4], s[4]))); \
+	d4 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[0], r[4]), _mm256_mul_epu32(h[1], r[3])), \
+		_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[2]), _mm256_mul_epu32(h[3], r[1])), _mm256_mul_epu32(h[4], r[0]))); \
+	                              c = _mm256_srli_epi64(d0, 26); h[0] = _mm256_and_si256(d0, AVX2_MASK26); \
+	d1 = _mm256_add_epi64(d1, c); c = _mm256_srli_epi64(d1, 26); h[1] = _mm256_and_si256(d1, AVX2_MASK26); \
+	d2 = _mm256_add_epi64(d2, c); c = _mm256_srli_epi64(d2, 26); h[2] = _mm256_and_si256(d2, AVX2_MASK26); \
+	d3 = _mm256_add_epi64(d3, c); c = _mm256_srli_epi64(d3, 26); h[3] = _mm256_and_si256(d3, AVX2_MASK26); \
+	d4 = _mm256_add_epi64(d4, c); c = _mm256_srli_epi64(d4, 26); h[4] = _mm256_and_si256(d4, AVX2_MASK26); \
+	h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2))); \
+	c = _mm256_srli_epi64(h[0], 26); h[0] = _mm256_and_si256(h[0], AVX2_MASK26); \
+	h[1] = _mm256_add_epi64(h[1], c); }
+
+// Split four consecutive blocks into 26-bit limbs, one block per lane, and add them to h
+__attribute__((target("avx2")))
+static inline void poly1305_load4_avx2(__m256i h[5], const unsigned char *m) {
+	const __m256i hibit = _mm256_set1_epi64x(1 << 24); /* 1 << 128 */
+	__m256i a = _mm256_loadu_si256((const __m256i *)(m + 0));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(m + 32));
+	// unpack leaves the lanes in block order 0, 2, 1, 3
+	__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+	__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+
+	h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, AVX2_MASK26));
+	h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), AVX2_MASK26));
+	h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), AVX2_MASK26));
+	h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), AVX2_MASK26));
+	h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+}
+
+// Absorb bytes (a multiple of POLY1305_AVX2_STRIDE) of full, non-final blocks
+__attribute__((target("avx2")))
+static void poly1305_blocks_avx2(poly1305_state_internal_t *st, const unsigned char *m, size_t bytes) {
+	unsigned long long r1[5], r2[5], r3[5], r4[5], h[5];
+	__m256i vh[5], vr[5], vs[5];
+	int i;
+
+	poly1305_limbs_44to26(r1, st->r);
+	memcpy(r2, r1, sizeof(r2));
+	poly1305_mul26(r2, r1);
+	memcpy(r3, r2, sizeof(r3));
+	poly1305_mul26(r3, r1);
+	memcpy(r4, r3, sizeof(r4));
+	poly1305_mul26(r4, r1);
+
+	// The incoming h joins the first block of lane 0
+	poly1305_limbs_44to26(h, st->h);
+	for (i = 0; i < 5; i++) {
+		vh[i] = _mm256_set_epi64x(0, 0, 0, h[i]);
+		vr[i] = _mm256_set1_epi64x(r4[i]);
+		vs[i] = _mm256_set1_epi64x(r4[i] * 5);
+	}
+	poly1305_load4_avx2(vh, m);
+	m += POLY1305_AVX2_STRIDE;
+	bytes -= POLY1305_AVX2_STRIDE;
+
+	while (bytes >= POLY1305_AVX2_STRIDE) {
+		AVX2_MULR(vh, vr, vs);
+		poly1305_load4_avx2(vh, m);
+		m += POLY1305_AVX2_STRIDE;
+		bytes -= POLY1305_AVX2_STRIDE;
+	}
+
+	// Lane j still owes r^(4-j)
+	for (i = 0; i < 5; i++) {
+		vr[i] = _mm256_set_epi64x(r1[i], r2[i], r3[i], r4[i]);
+		vs[i] = _mm256_set_epi64x(r1[i] * 5, r2[i] * 5, r3[i] * 5, r4[i] * 5);
+	}
+	AVX2_MULR(vh, vr, vs);
+
+	for (i = 0; i < 5; i++) {
+		__m128i t = _mm_add_epi64(_mm256_castsi256_si128(vh[i]), _mm256_extracti128_si256(vh[i], 1));
+		h[i] = (unsigned long long)_mm_cvtsi128_si64(t) + (unsigned long long)_mm_extract_epi64(t, 1);
+	}
+	poly1305_limbs_26to44(st->h, h);
+}
+
+static bool poly1305_cpu_avx2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* POLY1305_AVX2 */
+
+static int poly1305_kernel = POLY1305_KERNEL_SCALAR;
 
 void
 poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes) {
@@ -25,6 +199,14 @@ poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes) {
 	}
 
 	/* process full blocks */
+#if POLY1305_AVX2
+	if ((poly1305_kernel == POLY1305_KERNEL_AVX2) && (bytes >= POLY1305_AVX2_MIN_LEN)) {
+		size_t want = (bytes & ~(POLY1305_AVX2_STRIDE - 1));
+		poly1305_blocks_avx2(st, m, want);
+		m += want;
+		bytes -= want;
+	}
+#endif
 	if (bytes >= poly1305_block_size) {
 		size_t want = (bytes & ~(poly1305_block_size - 1));
 		poly1305_blocks(st, m, want);
@@ -39,3 +221,83 @@ poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes) {
 		st->leftover += bytes;
 	}
 }
+
+// RFC7539 2.5.2 - Poly1305 Example and Test Vector
+static const unsigned char poly1305_kat_key[32] = {
+	0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+	0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+};
+static const unsigned char poly1305_kat_tag[16] = {
+	0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+};
+
+static void poly1305_mac(int kernel, unsigned char mac[16], const unsigned char key[32], const unsigned char *m, size_t split, size_t bytes) {
+	poly1305_context ctx;
+	int saved = poly1305_kernel;
+
+	poly1305_kernel = kernel;
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, m, split);
+	poly1305_update(&ctx, m + split, bytes - split);
+	poly1305_finish(&ctx, mac);
+	poly1305_kernel = saved;
+}
+
+// Known answer test for one kernel: the RFC vector, then a comparison against the scalar code over lengths that
+// exercise the vector path, the scalar tail and input that starts with a partial block buffered
+static bool poly1305_kernel_selftest(int kernel) {
+	static const char kat_msg[] = "Cryptographic Forum Research Group";
+	static const size_t lengths[] = { 34, 256, 257, 319, 320, 1024, 1436, 2000 };
+	unsigned char key[32];
+	unsigned char msg[2000];
+	unsigned char expected[16], actual[16];
+	size_t i, j;
+
+	poly1305_mac(kernel, actual, poly1305_kat_key, (const unsigned char *)kat_msg, 0, sizeof(kat_msg) - 1);
+	if (memcmp(actual, poly1305_kat_tag, sizeof(actual)) != 0) {
+		return false;
+	}
+
+	// All-ones key and message limbs stress the carries
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < sizeof(key); i++) {
+			key[i] = j ? 0xff : (unsigned char)(i * 29 + 1);
+		}
+		for (i = 0; i < sizeof(msg); i++) {
+			msg[i] = j ? 0xff : (unsigned char)(i * 13 + 7);
+		}
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			poly1305_mac(POLY1305_KERNEL_SCALAR, expected, key, msg, i & 1 ? 5 : 0, lengths[i]);
+			poly1305_mac(kernel, actual, key, msg, i & 1 ? 5 : 0, lengths[i]);
+			if (memcmp(expected, actual, sizeof(actual)) != 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+const char *poly1305_kernel_name(int kernel) {
+	switch (kernel) {
+		case POLY1305_KERNEL_AUTO: return "auto";
+		case POLY1305_KERNEL_SCALAR: return "scalar";
+		case POLY1305_KERNEL_AVX2: return "avx2";
+	}
+	return "unknown";
+}
+
+int poly1305_select_kernel(int kernel) {
+	int best = POLY1305_KERNEL_SCALAR;
+
+#if POLY1305_AVX2
+	if (((kernel == POLY1305_KERNEL_AUTO) || (kernel == POLY1305_KERNEL_AVX2)) && poly1305_cpu_avx2() &&
+		poly1305_kernel_selftest(POLY1305_KERNEL_AVX2)) {
+		best = POLY1305_KERNEL_AVX2;
+	}
+#else
+	(void)kernel;
+	(void)poly1305_kernel_selftest;
+#endif
+	poly1305_kernel = best;
+	return best;
+}
@@ -13,4 +13,15 @@ void poly1305_init(poly1305_context *ctx, const unsigned char key[32]);
 void poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes);
 void poly1305_finish(poly1305_context *ctx, unsigned char mac[16]);
 
+// Block function used by poly1305_update() for long inputs - the scalar code always handles tails and short input
+enum poly1305_kernel {
+	POLY1305_KERNEL_AUTO = 0,
+	POLY1305_KERNEL_SCALAR,
+	POLY1305_KERNEL_AVX2,
+};
+
+// POLY1305_KERNEL_AUTO picks the fastest supported kernel that passes the RFC7539 test vector; returns the one in use
+int poly1305_select_kernel(int kernel);
+const char *poly1305_kernel_name(int kernel);
+
 #endif /* POLY1305_DONNA_H */
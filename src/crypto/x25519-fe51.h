@@ -0,0 +1,537 @@
+// X25519 (RFC7748) on 64-bit hosts
+// Field elements mod 2^255 - 19 are held in radix 2^51: five 51-bit limbs in 64-bit words, with the limb products
+// accumulated in 128 bits (mul/mulx on x86_64, mul/umulh on aarch64). Four limb products fit where the 32-bit
+// backend needs sixteen, and the spare 13 bits per limb let additions skip the carry chain.
+// Included by x25519.c in place of the 32-bit limb code whenever the compiler has a 128-bit integer type.
+
+typedef unsigned __int128 fe51_dlimb;
+typedef uint64_t fe51[5];
+
+#define FE51_MASK ((UINT64_C(1) << 51) - 1)
+
+static inline uint64_t fe51_load64(const uint8_t *p) {
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline void fe51_store64(uint8_t *p, uint64_t v) {
+	int i;
+	for (i = 0; i < 8; i++) {
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+// The top bit is ignored as RFC7748 5. requires
+static void fe51_frombytes(fe51 h, const uint8_t s[32]) {
+	uint64_t w0 = fe51_load64(s), w1 = fe51_load64(s + 8), w2 = fe51_load64(s + 16), w3 = fe51_load64(s + 24);
+
+	h[0] = w0 & FE51_MASK;
+	h[1] = ((w0 >> 51) | (w1 << 13)) & FE51_MASK;
+	h[2] = ((w1 >> 38) | (w2 << 26)) & FE51_MASK;
+	h[3] = ((w2 >> 25) | (w3 << 39)) & FE51_MASK;
+	h[4] = (w3 >> 12) & FE51_MASK;
+}
+
+static inline void fe51_carry(fe51 h) {
+	uint64_t c;
+
+	c = h[0] >> 51; h[0] &= FE51_MASK; h[1] += c;
+	c = h[1] >> 51; h[1] &= FE51_MASK; h[2] += c;
+	c = h[2] >> 51; h[2] &= FE51_MASK; h[3] += c;
+	c = h[3] >> 51; h[3] &= FE51_MASK; h[4] += c;
+	c = h[4] >> 51; h[4] &= FE51_MASK; h[0] += c * 19;
+}
+
+// Fully reduced little-endian encoding
+static void fe51_tobytes(uint8_t s[32], const fe51 f) {
+	fe51 t;
+	uint64_t q;
+
+	memcpy(t, f, sizeof(t));
+	fe51_carry(t);
+	fe51_carry(t);
+
+	// q = 1 if t >= p, i.e. if t + 19 carries out of bit 255
+	q = (t[0] + 19) >> 51;
+	q = (t[1] + q) >> 51;
+	q = (t[2] + q) >> 51;
+	q = (t[3] + q) >> 51;
+	q = (t[4] + q) >> 51;
+	// then t - p = t + 19 - 2^255: carry through, dropping the carry out of the top limb
+	t[0] += 19 * q;
+	t[1] += t[0] >> 51; t[0] &= FE51_MASK;
+	t[2] += t[1] >> 51; t[1] &= FE51_MASK;
+	t[3] += t[2] >> 51; t[2] &= FE51_MASK;
+	t[4] += t[3] >> 51; t[3] &= FE51_MASK;
+	t[4] &= FE51_MASK;
+
+	fe51_store64(s, t[0] | (t[1] << 51));
+	fe51_store64(s + 8, (t[1] >> 13) | (t[2] << 38));
+	fe51_store64(s + 16, (t[2] >> 26) | (t[3] << 25));
+	fe51_store64(s + 24, (t[3] >> 39) | (t[4] << 12));
+}
+
+static inline void fe51_add(fe51 h, const fe51 f, const fe51 g) {
+	h[0] = f[0] + g[0];
+	h[1] = f[1] + g[1];
+	h[2] = f[2] + g[2];
+	h[3] = f[3] + g[3];
+	h[4] = f[4] + g[4];
+}
+
+// h = f - g, with 2p added so the limbs stay positive - g must be (nearly) reduced
+static inline void fe51_sub(fe51 h, const fe51 f, const fe51 g) {
+	h[0] = (f[0] + UINT64_C(0xfffffffffffda)) - g[0];
+	h[1] = (f[1] + UINT64_C(0xffffffffffffe)) - g[1];
+	h[2] = (f[2] + UINT64_C(0xffffffffffffe)) - g[2];
+	h[3] = (f[3] + UINT64_C(0xffffffffffffe)) - g[3];
+	h[4] = (f[4] + UINT64_C(0xffffffffffffe)) - g[4];
+}
+
+// Products by 2^255 wrap around as 19
+static void fe51_mul(fe51 h, const fe51 f, const fe51 g) {
+	const uint64_t g1_19 = g[1] * 19, g2_19 = g[2] * 19, g3_19 = g[3] * 19, g4_19 = g[4] * 19;
+	fe51_dlimb r0, r1, r2, r3, r4;
+	uint64_t c;
+
+	r0 = (fe51_dlimb)f[0] * g[0] + (fe51_dlimb)f[1] * g4_19 + (fe51_dlimb)f[2] * g3_19 + (fe51_dlimb)f[3] * g2_19 + (fe51_dlimb)f[4] * g1_19;
+	r1 = (fe51_dlimb)f[0] * g[1] + (fe51_dlimb)f[1] * g[0] + (fe51_dlimb)f[2] * g4_19 + (fe51_dlimb)f[3] * g3_19 + (fe51_dlimb)f[4] * g2_19;
+	r2 = (fe51_dlimb)f[0] * g[2] + (fe51_dlimb)f[1] * g[1] + (fe51_dlimb)f[2] * g[0] + (fe51_dlimb)f[3] * g4_19 + (fe51_dlimb)f[4] * g3_19;
+	r3 = (fe51_dlimb)f[0] * g[3] + (fe51_dlimb)f[1] * g[2] + (fe51_dlimb)f[2] * g[1] + (fe51_dlimb)f[3] * g[0] + (fe51_dlimb)f[4] * g4_19;
+	r4 = (fe51_dlimb)f[0] * g[4] + (fe51_dlimb)f[1] * g[3] + (fe51_dlimb)f[2] * g[2] + (fe51_dlimb)f[3] * g[1] + (fe51_dlimb)f[4] * g[0];
+
+	              c = (uint64_t)(r0 >> 51); h[0] = (uint64_t)r0 & FE51_MASK;
+	r1 += c;      c = (uint64_t)(r1 >> 51); h[1] = (uint64_t)r1 & FE51_MASK;
+	r2 += c;      c = (uint64_t)(r2 >> 51); h[2] = (uint64_t)r2 & FE51_MASK;
+	r3 += c;      c = (uint64_t)(r3 >> 51); h[3] = (uint64_t)r3 & FE51_MASK;
+	r4 += c;      c = (uint64_t)(r4 >> 51); h[4] = (uint64_t)r4 & FE51_MASK;
+	h[0] += c * 19; c = h[0] >> 51; h[0] &= FE51_MASK;
+	h[1] += c;
+}
+
+static void fe51_sq(fe51 h, const fe51 f) {
+	const uint64_t f0_2 = f[0] * 2, f1_2 = f[1] * 2;
+	const uint64_t f1_38 = f[1] * 38, f2_38 = f[2] * 38, f3_38 = f[3] * 38;
+	const uint64_t f3_19 = f[3] * 19, f4_19 = f[4] * 19;
+	fe51_dlimb r0, r1, r2, r3, r4;
+	uint64_t c;
+
+	r0 = (fe51_dlimb)f[0] * f[0] + (fe51_dlimb)f1_38 * f[4] + (fe51_dlimb)f2_38 * f[3];
+	r1 = (fe51_dlimb)f0_2 * f[1] + (fe51_dlimb)f2_38 * f[4] + (fe51_dlimb)f3_19 * f[3];
+	r2 = (fe51_dlimb)f0_2 * f[2] + (fe51_dlimb)f[1] * f[1] + (fe51_dlimb)f3_38 * f[4];
+	r3 = (fe51_dlimb)f0_2 * f[3] + (fe51_dlimb)f1_2 * f[2] + (fe51_dlimb)f4_19 * f[4];
+	r4 = (fe51_dlimb)f0_2 * f[4] + (fe51_dlimb)f1_2 * f[3] + (fe51_dlimb)f[2] * f[2];
+
+	              c = (uint64_t)(r0 >> 51); h[0] = (uint64_t)r0 & FE51_MASK;
+	r1 += c;      c = (uint64_t)(r1 >> 51); h[1] = (uint64_t)r1 & FE51_MASK;
+	r2 += c;      c = (uint64_t)(r2 >> 51); h[2] = (uint64_t)r2 & FE51_MASK;
+	r3 += c;      c = (uint64_t)(r3 >> 51); h[3] = (uint64_t)r3 & FE51_MASK;
+	r4 += c;      c = (uint64_t)(r4 >> 51); h[4] = (uint64_t)r4 & FE51_MASK;
+	h[0] += c * 19; c = h[0] >> 51; h[0] &= FE51_MASK;
+	h[1] += c;
+}
+
+// h = f^(2^n)
+static void fe51_sqn(fe51 h, const fe51 f, int n) {
+	fe51_sq(h, f);
+	while (--n > 0) {
+		fe51_sq(h, h);
+	}
+}
+
+static void fe51_mul_small(fe51 h, const fe51 f, uint64_t n) {
+	fe51_dlimb r;
+	uint64_t c = 0;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		r = (fe51_dlimb)f[i] * n + c;
+		h[i] = (uint64_t)r & FE51_MASK;
+		c = (uint64_t)(r >> 51);
+	}
+	h[0] += c * 19;
+}
+
+// h = z^(p-2) = 1/z
+static void fe51_invert(fe51 h, const fe51 z) {
+	fe51 z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+
+	fe51_sq(z2, z);                     // 2
+	fe51_sqn(t, z2, 2);                 // 8
+	fe51_mul(z9, t, z);                 // 9
+	fe51_mul(z11, z9, z2);              // 11
+	fe51_sq(t, z11);                    // 22
+	fe51_mul(z2_5_0, t, z9);            // 2^5 - 2^0
+	fe51_sqn(t, z2_5_0, 5);
+	fe51_mul(z2_10_0, t, z2_5_0);       // 2^10 - 2^0
+	fe51_sqn(t, z2_10_0, 10);
+	fe51_mul(z2_20_0, t, z2_10_0);      // 2^20 - 2^0
+	fe51_sqn(t, z2_20_0, 20);
+	fe51_mul(t, t, z2_20_0);            // 2^40 - 2^0
+	fe51_sqn(t, t, 10);
+	fe51_mul(z2_50_0, t, z2_10_0);      // 2^50 - 2^0
+	fe51_sqn(t, z2_50_0, 50);
+	fe51_mul(z2_100_0, t, z2_50_0);     // 2^100 - 2^0
+	fe51_sqn(t, z2_100_0, 100);
+	fe51_mul(t, t, z2_100_0);           // 2^200 - 2^0
+	fe51_sqn(t, t, 50);
+	fe51_mul(t, t, z2_50_0);            // 2^250 - 2^0
+	fe51_sqn(t, t, 5);
+	fe51_mul(h, t, z11);                // 2^255 - 21
+}
+
+// Swap a and b if swap is all ones, leave them if it is zero - without branching on it
+static inline void fe51_cswap(fe51 a, fe51 b, uint64_t swap) {
+	uint64_t x;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		x = (a[i] ^ b[i]) & swap;
+		a[i] ^= x;
+		b[i] ^= x;
+	}
+}
+
+static inline int fe51_iszero(const fe51 f) {
+	uint8_t s[32];
+	uint8_t acc = 0;
+	int i;
+
+	fe51_tobytes(s, f);
+	for (i = 0; i < 32; i++) {
+		acc |= s[i];
+	}
+	return acc == 0;
+}
+
+// RFC7748 5. - the Montgomery ladder
+int x25519(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES], const uint8_t x1[X25519_BYTES], int clamp) {
+	fe51 u, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+	uint8_t k[X25519_BYTES];
+	uint64_t swap = 0, bit;
+	int i, ret = 0;
+
+	memcpy(k, scalar, sizeof(k));
+	if (clamp) {
+		k[0] &= 248;
+		k[31] &= 127;
+		k[31] |= 64;
+	}
+
+	fe51_frombytes(u, x1);
+	memset(x2, 0, sizeof(x2));
+	memset(z2, 0, sizeof(z2));
+	memset(z3, 0, sizeof(z3));
+	x2[0] = 1;
+	z3[0] = 1;
+	memcpy(x3, u, sizeof(x3));
+
+	for (i = 255; i >= 0; i--) {
+		bit = (k[i >> 3] >> (i & 7)) & 1;
+		swap ^= bit;
+		fe51_cswap(x2, x3, -swap);
+		fe51_cswap(z2, z3, -swap);
+		swap = bit;
+
+		fe51_add(a, x2, z2);
+		fe51_sq(aa, a);
+		fe51_sub(b, x2, z2);
+		fe51_sq(bb, b);
+		fe51_sub(e, aa, bb);
+		fe51_add(c, x3, z3);
+		fe51_sub(d, x3, z3);
+		fe51_mul(da, d, a);
+		fe51_mul(cb, c, b);
+		fe51_add(x3, da, cb);
+		fe51_sq(x3, x3);
+		fe51_sub(z3, da, cb);
+		fe51_sq(z3, z3);
+		fe51_mul(z3, z3, u);
+		fe51_mul(x2, aa, bb);
+		fe51_mul_small(z2, e, 121665);
+		fe51_add(z2, z2, aa);
+		fe51_mul(z2, z2, e);
+	}
+	fe51_cswap(x2, x3, -swap);
+	fe51_cswap(z2, z3, -swap);
+
+	fe51_invert(z2, z2);
+	fe51_mul(x2, x2, z2);
+	// Per RFC7748 an all-zero result (a small order input) is an error, as the 32-bit code reports it
+	if (clamp && fe51_iszero(x2)) {
+		ret = -1;
+	}
+	fe51_tobytes(out, x2);
+
+	memset(k, 0, sizeof(k));
+	return ret;
+}
+
+// Fixed-base multiplication
+// Basepoint 9 is the Montgomery image of the Ed25519 base point B, so k*9 can be computed on the twisted Edwards
+// curve -x^2 + y^2 = 1 + d x^2 y^2 and mapped back with u = (1 + y) / (1 - y). There, multiples of B are
+// precomputed: row i of the table holds j * 256^i * B for j = 1..8, and with k written as 64 signed radix-16 digits
+// the product is 64 constant-time table lookups and mixed additions plus just 4 doublings, instead of the 255 ladder
+// steps. The table is built once by x25519_base_init(); until then (or if it fails its check) the ladder is used.
+
+typedef struct { fe51 X, Y, Z; } ge51_p2;           // x = X/Z, y = Y/Z
+typedef struct { fe51 X, Y, Z, T; } ge51_p3;        // as p2, with XY = ZT
+typedef struct { fe51 X, Y, Z, T; } ge51_p1p1;      // x = X/Z, y = Y/T
+typedef struct { fe51 yplusx, yminusx, xy2d; } ge51_precomp;
+
+// 2d, and the base point coordinates, as little-endian field elements
+static const uint8_t ge51_d2_bytes[32] = {
+	0x59, 0xf1, 0xb2, 0x26, 0x94, 0x9b, 0xd6, 0xeb, 0x56, 0xb1, 0x83, 0x82, 0x9a, 0x14, 0xe0, 0x00,
+	0x30, 0xd1, 0xf3, 0xee, 0xf2, 0x80, 0x8e, 0x19, 0xe7, 0xfc, 0xdf, 0x56, 0xdc, 0xd9, 0x06, 0x24
+};
+static const uint8_t ge51_base_x[32] = {
+	0x1a, 0xd5, 0x25, 0x8f, 0x60, 0x2d, 0x56, 0xc9, 0xb2, 0xa7, 0x25, 0x95, 0x60, 0xc7, 0x2c, 0x69,
+	0x5c, 0xdc, 0xd6, 0xfd, 0x31, 0xe2, 0xa4, 0xc0, 0xfe, 0x53, 0x6e, 0xcd, 0xd3, 0x36, 0x69, 0x21
+};
+static const uint8_t ge51_base_y[32] = {
+	0x58, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66
+};
+
+static ge51_precomp ge51_base[32][8];
+static int ge51_base_ready;
+
+// As fe51_sub, but with 4p added - for subtrahends that are themselves unreduced sums or differences
+static inline void fe51_sub4(fe51 h, const fe51 f, const fe51 g) {
+	h[0] = (f[0] + UINT64_C(0x1fffffffffffb4)) - g[0];
+	h[1] = (f[1] + UINT64_C(0x1ffffffffffffc)) - g[1];
+	h[2] = (f[2] + UINT64_C(0x1ffffffffffffc)) - g[2];
+	h[3] = (f[3] + UINT64_C(0x1ffffffffffffc)) - g[3];
+	h[4] = (f[4] + UINT64_C(0x1ffffffffffffc)) - g[4];
+}
+
+// Replace f with g if move is all ones, leave it if it is zero
+static inline void fe51_cmov(fe51 f, const fe51 g, uint64_t move) {
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		f[i] ^= (f[i] ^ g[i]) & move;
+	}
+}
+
+static void ge51_p1p1_to_p2(ge51_p2 *r, const ge51_p1p1 *p) {
+	fe51_mul(r->X, p->X, p->T);
+	fe51_mul(r->Y, p->Y, p->Z);
+	fe51_mul(r->Z, p->Z, p->T);
+}
+
+static void ge51_p1p1_to_p3(ge51_p3 *r, const ge51_p1p1 *p) {
+	fe51_mul(r->X, p->X, p->T);
+	fe51_mul(r->Y, p->Y, p->Z);
+	fe51_mul(r->Z, p->Z, p->T);
+	fe51_mul(r->T, p->X, p->Y);
+}
+
+// r = 2p, using the dbl-2008-hwcd formulas
+static void ge51_p2_dbl(ge51_p1p1 *r, const ge51_p2 *p) {
+	fe51 t0;
+
+	fe51_sq(r->X, p->X);
+	fe51_sq(r->Z, p->Y);
+	fe51_sq(r->T, p->Z);
+	fe51_add(r->T, r->T, r->T);
+	fe51_add(r->Y, p->X, p->Y);
+	fe51_sq(t0, r->Y);
+	fe51_add(r->Y, r->Z, r->X);
+	fe51_sub(r->Z, r->Z, r->X);
+	fe51_sub4(r->X, t0, r->Y);
+	fe51_sub4(r->T, r->T, r->Z);
+}
+
+// r = p + q, with q in affine precomputed form (madd-2008-hwcd-3)
+static void ge51_madd(ge51_p1p1 *r, const ge51_p3 *p, const ge51_precomp *q) {
+	fe51 t0;
+
+	fe51_add(r->X, p->Y, p->X);
+	fe51_sub(r->Y, p->Y, p->X);
+	fe51_mul(r->Z, r->X, q->yplusx);
+	fe51_mul(r->Y, r->Y, q->yminusx);
+	fe51_mul(r->T, q->xy2d, p->T);
+	fe51_add(t0, p->Z, p->Z);
+	fe51_sub(r->X, r->Z, r->Y);
+	fe51_add(r->Y, r->Z, r->Y);
+	fe51_add(r->Z, t0, r->T);
+	fe51_sub(r->T, t0, r->T);
+}
+
+static void ge51_to_precomp(ge51_precomp *r, const ge51_p3 *p, const fe51 d2) {
+	fe51 zinv, x, y;
+
+	fe51_invert(zinv, p->Z);
+	fe51_mul(x, p->X, zinv);
+	fe51_mul(y, p->Y, zinv);
+	fe51_add(r->yplusx, y, x);
+	fe51_carry(r->yplusx);
+	fe51_sub(r->yminusx, y, x);
+	fe51_carry(r->yminusx);
+	fe51_mul(r->xy2d, x, y);
+	fe51_mul(r->xy2d, r->xy2d, d2);
+}
+
+// t = b * row, for -8 <= b <= 8, reading every entry of the row whatever b is
+static void ge51_select(ge51_precomp *t, const ge51_precomp row[8], int8_t b) {
+	const uint8_t bnegative = (uint8_t)b >> 7;
+	const uint8_t babs = (uint8_t)(b - ((-bnegative & b) * 2));
+	const uint64_t negative = -(uint64_t)bnegative;
+	ge51_precomp minus;
+	uint64_t eq;
+	int j;
+
+	memset(t, 0, sizeof(*t));
+	t->yplusx[0] = 1;
+	t->yminusx[0] = 1;
+	for (j = 0; j < 8; j++) {
+		eq = (uint64_t)(babs ^ (j + 1)) - 1;
+		eq = -(eq >> 63);
+		fe51_cmov(t->yplusx, row[j].yplusx, eq);
+		fe51_cmov(t->yminusx, row[j].yminusx, eq);
+		fe51_cmov(t->xy2d, row[j].xy2d, eq);
+	}
+	memcpy(minus.yplusx, t->yminusx, sizeof(fe51));
+	memcpy(minus.yminusx, t->yplusx, sizeof(fe51));
+	memset(minus.xy2d, 0, sizeof(fe51));
+	fe51_sub(minus.xy2d, minus.xy2d, t->xy2d);
+	fe51_cmov(t->yplusx, minus.yplusx, negative);
+	fe51_cmov(t->yminusx, minus.yminusx, negative);
+	fe51_cmov(t->xy2d, minus.xy2d, negative);
+}
+
+// h = a * B, for a < 2^255
+static void ge51_scalarmult_base(ge51_p3 *h, const uint8_t a[32]) {
+	int8_t e[64];
+	int8_t carry = 0;
+	ge51_p1p1 r;
+	ge51_p2 s;
+	ge51_precomp t;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		e[2 * i] = a[i] & 15;
+		e[2 * i + 1] = (a[i] >> 4) & 15;
+	}
+	// Recentre each digit to -8..7 (the last one to -8..8)
+	for (i = 0; i < 63; i++) {
+		e[i] += carry;
+		carry = (int8_t)((e[i] + 8) >> 4);
+		e[i] -= (int8_t)(carry * 16);
+	}
+	e[63] += carry;
+
+	memset(h, 0, sizeof(*h));
+	h->Y[0] = 1;
+	h->Z[0] = 1;
+
+	// The odd digits, then 16 * their sum, then the even digits
+	for (i = 1; i < 64; i += 2) {
+		ge51_select(&t, ge51_base[i / 2], e[i]);
+		ge51_madd(&r, h, &t);
+		ge51_p1p1_to_p3(h, &r);
+	}
+	memcpy(s.X, h->X, sizeof(fe51));
+	memcpy(s.Y, h->Y, sizeof(fe51));
+	memcpy(s.Z, h->Z, sizeof(fe51));
+	ge51_p2_dbl(&r, &s);
+	ge51_p1p1_to_p2(&s, &r);
+	ge51_p2_dbl(&r, &s);
+	ge51_p1p1_to_p2(&s, &r);
+	ge51_p2_dbl(&r, &s);
+	ge51_p1p1_to_p2(&s, &r);
+	ge51_p2_dbl(&r, &s);
+	ge51_p1p1_to_p3(h, &r);
+	for (i = 0; i < 64; i += 2) {
+		ge51_select(&t, ge51_base[i / 2], e[i]);
+		ge51_madd(&r, h, &t);
+		ge51_p1p1_to_p3(h, &r);
+	}
+
+	memset(e, 0, sizeof(e));
+}
+
+static int x25519_base_comb(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES]) {
+	ge51_p3 A;
+	fe51 num, den;
+	uint8_t k[X25519_BYTES];
+	int ret = 0;
+
+	memcpy(k, scalar, sizeof(k));
+	k[0] &= 248;
+	k[31] &= 127;
+	k[31] |= 64;
+
+	ge51_scalarmult_base(&A, k);
+	// u = (1 + y) / (1 - y) = (Z + Y) / (Z - Y)
+	fe51_add(num, A.Z, A.Y);
+	fe51_sub(den, A.Z, A.Y);
+	fe51_invert(den, den);
+	fe51_mul(num, num, den);
+	if (fe51_iszero(num)) {
+		ret = -1;
+	}
+	fe51_tobytes(out, num);
+
+	memset(k, 0, sizeof(k));
+	memset(&A, 0, sizeof(A));
+	return ret;
+}
+
+void x25519_base_init(void) {
+	static const uint8_t check_scalar[X25519_BYTES] = {
+		0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d, 0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+		0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a, 0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a
+	};
+	uint8_t comb[X25519_BYTES], ladder[X25519_BYTES];
+	ge51_p3 P, acc;
+	ge51_p2 s;
+	ge51_p1p1 r;
+	fe51 d2;
+	int i, j;
+
+	if (ge51_base_ready) {
+		return;
+	}
+
+	fe51_frombytes(d2, ge51_d2_bytes);
+	fe51_frombytes(P.X, ge51_base_x);
+	fe51_frombytes(P.Y, ge51_base_y);
+	memset(P.Z, 0, sizeof(fe51));
+	P.Z[0] = 1;
+	fe51_mul(P.T, P.X, P.Y);
+
+	for (i = 0; i < 32; i++) {
+		// Row i: j * P for P = 256^i * B
+		ge51_to_precomp(&ge51_base[i][0], &P, d2);
+		acc = P;
+		for (j = 1; j < 8; j++) {
+			ge51_madd(&r, &acc, &ge51_base[i][0]);
+			ge51_p1p1_to_p3(&acc, &r);
+			ge51_to_precomp(&ge51_base[i][j], &acc, d2);
+		}
+		memcpy(s.X, P.X, sizeof(fe51));
+		memcpy(s.Y, P.Y, sizeof(fe51));
+		memcpy(s.Z, P.Z, sizeof(fe51));
+		for (j = 0; j < 7; j++) {
+			ge51_p2_dbl(&r, &s);
+			ge51_p1p1_to_p2(&s, &r);
+		}
+		ge51_p2_dbl(&r, &s);
+		ge51_p1p1_to_p3(&P, &r);
+	}
+
+	// Only switch over if the table reproduces the ladder
+	x25519_base_comb(comb, check_scalar);
+	x25519(ladder, check_scalar, X25519_BASE_POINT, 1);
+	ge51_base_ready = (memcmp(comb, ladder, sizeof(comb)) == 0);
+}
+
+int x25519_base(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES], int clamp) {
+	// The table needs the top bit clear and works modulo the prime order subgroup - both hold for clamped scalars
+	if (clamp && ge51_base_ready) {
+		return x25519_base_comb(out, scalar);
+	}
+	return x25519(out, scalar, X25519_BASE_POINT, clamp);
+}
@@ -14,6 +14,11 @@
 //#include "strobe_config.h"
 // STROBE header replacement
 #include <string.h>
+
+#if defined(__SIZEOF_INT128__)
+// 64-bit hosts: radix 2^51 field arithmetic with 128-bit products
+#include "x25519-fe51.h"
+#else
 #define X25519_WBITS 32
 #define X25519_SUPPORT_SIGN 0
 #define X25519_MEMCPY_PARAMS 1
@@ -341,6 +346,15 @@ int x25519(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES], const
     else return 0;
 }
 
+/* No fixed-base table for the 32-bit limbs - the ladder serves both */
+int x25519_base(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES], int clamp) {
+    return x25519(out,scalar,X25519_BASE_POINT,clamp);
+}
+
+void x25519_base_init(void) {
+}
+#endif /* __SIZEOF_INT128__ */
+
 const uint8_t X25519_BASE_POINT[X25519_BYTES] = {9};
 
 #if X25519_SUPPORT_VERIFY
@@ -74,15 +74,21 @@ int x25519 (
  * always returns 0.
  *
  * Same as x255(out,scalar,X255_BASE_POINT), except that
- * other implementations may optimize it.
+ * other implementations may optimize it.  On 64-bit hosts, clamped
+ * scalars use a precomputed table once x25519_base_init() has run.
  */
-static inline int x25519_base (
+int x25519_base (
     unsigned char out[EC_PUBLIC_BYTES],
     const unsigned char scalar[EC_PRIVATE_BYTES],
     int clamp
-) {
-    return x25519(out,scalar,X25519_BASE_POINT,clamp);
-}
+);
+
+/**
+ * Builds the fixed-base table used by x25519_base.  Call once at
+ * startup, before any concurrent use; until then x25519_base falls
+ * back to the ladder.  A no-op where there is no table.
+ */
+void x25519_base_init(void);
 
 /**
  * As x25519_base, but with a scalar that's EC_UNIFORM_BYTES long,
@@ -0,0 +1,74 @@
+/*
+ * Helpers shared by the self-tests (wireguard --selftest)
+ *
+ * A reproducible pseudo-random sequence for the rounds, and the failure
+ * reporting: every failure is printed on stderr with the round it happened in.
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SELFTEST_UTIL_H_
+#define SELFTEST_UTIL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+struct selftest_report {
+	const char *name;	/* prefix of the messages, e.g. "crypto" */
+	bool abort;		/* abort() on the first failure (fuzzer builds) */
+	int failures;
+	char where[64];		/* the round being run */
+};
+
+/* Set where the next failures happen, e.g. "seed 1, round 2" */
+static inline __attribute__((format(printf,2,3)))
+void selftest_set_where(struct selftest_report *report, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(report->where, sizeof(report->where), fmt, ap);
+	va_end(ap);
+}
+
+static inline __attribute__((format(printf,3,4)))
+void selftest_fail(struct selftest_report *report, const char *test, const char *fmt, ...) {
+	va_list ap;
+
+	fprintf(stderr, "%s selftest: %s: ", report->name, test);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, " (%s)\n", report->where);
+	report->failures++;
+	if (report->abort)
+		abort();
+}
+
+/* splitmix64 - fast, and any seed gives a full sequence */
+static inline uint64_t selftest_next(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline void selftest_fill(uint64_t *state, uint8_t *buf, size_t len) {
+	uint64_t r;
+	size_t n;
+
+	while (len > 0) {
+		r = selftest_next(state);
+		n = (len < sizeof(r)) ? len : sizeof(r);
+		memcpy(buf, &r, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+#endif /* SELFTEST_UTIL_H_ */
@@ -9,34 +9,40 @@
 #include "wg_main.h"
 
 #include <time.h>
-#include <pthread.h>
 
 #include <inttypes.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
 
 #include "wg_comm.h"
 #include "wg_tun.h"
 #include "wireguardif.h"
+#include "wireguard-platform.h"
 #include "lwip_h/ip4.h"
-#include "lib/pthread_wrap.h"
 #include "lib/log.h"
+#include "lib/pthread_wrap.h"
 
-extern struct netif *wg_netif;
-
-/* Initialise a timeval structure to use with select */
-static inline void init_timeout(struct timeval *timeout) {
-	timeout->tv_sec = SELECT_DELAY_SEC;
-	timeout->tv_usec = SELECT_DELAY_USEC;
-}
+/* eventfd the signal handler writes to when the daemon is stopping */
+static int stop_fd = -1;
+/* protects stop_fd against stop_vpn() while start_vpn() closes it */
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Create the UDP socket
  * Bind it to config.localIP
  *            config.localport (localport > 0)
  *            config.iface (iface != NULL)
+ * With config.udp_reuseport the first socket (join == 0) is bound on its own,
+ * so that the bind fails if another process holds the port, and only then
+ * opened to SO_REUSEPORT; every later call (join != 0) adds a socket to it.
+ * The first one picks the port if localport is 0
  */
-int create_socket(void) {
+int create_socket(int join) {
 	int sockfd;
 	struct sockaddr_in localaddr, tmp_addr;
 	socklen_t tmp_addr_len;
@@ -65,6 +71,15 @@ int create_socket(void) {
 	}
 #endif
 
+	/* Join the port the first socket holds */
+	if (join) {
+		int on = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+			log_error(errno, "Could not set SO_REUSEPORT on the socket");
+			return -1;
+		}
+	}
+
 	memset(&localaddr, 0, sizeof(localaddr));
 	localaddr.sin_family = AF_INET;
 	localaddr.sin_addr.s_addr = config.localIP.s_addr;
@@ -77,6 +92,26 @@ int create_socket(void) {
 	}
 	log_message_level(2, "Socket opened");
 
+	/* Share the port with the sockets of the other workers. Set after bind(),
+	 * a second daemon on the same port gets EADDRINUSE instead of silently
+	 * taking a share of the peers */
+	if (!join && config.udp_reuseport) {
+		int on = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+			log_message("SO_REUSEPORT is not available (%s)", strerror(errno));
+			config.udp_reuseport = 0;
+		}
+	}
+
+	/* Let the kernel hand over runs of datagrams from the same sender as one */
+	if (config.udp_gro) {
+		int on = 1;
+		if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+			log_message("UDP GRO is not available (%s)", strerror(errno));
+			config.udp_gro = 0;
+		}
+	}
+
 	/* Get the local port */
 	if (config.localport == 0) {
 		tmp_addr_len = sizeof(tmp_addr);
@@ -87,134 +122,423 @@ int create_socket(void) {
 	return sockfd;
 }
 
+/* Hand each datagram to the socket of the port group with the index (in bind
+ * order) of the CPU that received it, modulo the number of sockets, instead of
+ * the kernel hash of the sender address. Only helps when the network device
+ * spreads the packets over CPUs (RSS, RPS); a single peer endpoint still
+ * lands on one socket either way
+ */
+int steer_sockets_by_cpu(int sockfd, unsigned int count) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, count },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		log_message("Could not steer the UDP sockets by CPU (%s)", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* control message with the UDP_GRO segment size of a coalesced datagram */
+union comm_rx_cmsg {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+};
+
+/* recvmmsg() state: config.udp_rx_batch datagram buffers and their senders,
+ * then the wireguard messages split out of them for the RX path */
+struct comm_rx {
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct sockaddr_in *from;
+	union comm_rx_cmsg *cmsg;
+	uint8_t **data;
+	unsigned int batch;
+	struct pbuf *bufs;
+	ip_addr_t *addr;
+	u16_t *port;
+	unsigned int count;
+	unsigned int size;
+};
+
+static void comm_rx_init(struct comm_rx *rx, unsigned int batch, size_t buf_len) {
+	unsigned int i;
+
+	rx->batch = batch;
+	rx->msgs = CHECK_ALLOC_FATAL(calloc(batch, sizeof(*rx->msgs)));
+	rx->iov = CHECK_ALLOC_FATAL(calloc(batch, sizeof(*rx->iov)));
+	rx->from = CHECK_ALLOC_FATAL(calloc(batch, sizeof(*rx->from)));
+	rx->cmsg = CHECK_ALLOC_FATAL(calloc(batch, sizeof(*rx->cmsg)));
+	rx->data = CHECK_ALLOC_FATAL(calloc(batch, sizeof(*rx->data)));
+
+	/* a coalesced datagram holds up to COMM_GRO_MAX_SEGMENTS messages */
+	rx->count = 0;
+	rx->size = batch + COMM_GRO_MAX_SEGMENTS;
+	rx->bufs = CHECK_ALLOC_FATAL(calloc(rx->size, sizeof(*rx->bufs)));
+	rx->addr = CHECK_ALLOC_FATAL(calloc(rx->size, sizeof(*rx->addr)));
+	rx->port = CHECK_ALLOC_FATAL(calloc(rx->size, sizeof(*rx->port)));
+
+	for (i = 0; i < batch; i++) {
+		rx->data[i] = CHECK_ALLOC_FATAL(malloc(buf_len));
+		rx->iov[i].iov_base = rx->data[i];
+		rx->iov[i].iov_len = buf_len;
+		rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msgs[i].msg_hdr.msg_iovlen = 1;
+		rx->msgs[i].msg_hdr.msg_name = &rx->from[i];
+		rx->msgs[i].msg_hdr.msg_control = rx->cmsg[i].buf;
+	}
+}
+
+static void comm_rx_free(struct comm_rx *rx) {
+	unsigned int i;
+
+	for (i = 0; i < rx->batch; i++)
+		free(rx->data[i]);
+	free(rx->msgs);
+	free(rx->iov);
+	free(rx->from);
+	free(rx->cmsg);
+	free(rx->data);
+	free(rx->bufs);
+	free(rx->addr);
+	free(rx->port);
+}
+
+/* Hand the messages split out so far to the wireguard RX path */
+static void comm_rx_dispatch(struct comm_args *args, struct comm_rx *rx) {
+	if (rx->count > 0) {
+		wireguardif_network_rx_batch(args->queue, rx->bufs, rx->addr, rx->port, rx->count);
+		rx->count = 0;
+	}
+}
+
+/* Segment size of a datagram coalesced by UDP_GRO, or 0 if it is a single one */
+static int comm_rx_gro_size(struct msghdr *hdr) {
+	struct cmsghdr *cm;
+	int size;
+
+	for (cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			memcpy(&size, CMSG_DATA(cm), sizeof(size));
+			return size;
+		}
+	}
+	return 0;
+}
+
 /*
  * Manage the incoming messages(VPN packets) from the UDP socket
- * argument: struct comm_args *
+ * Receives up to rx->batch datagrams per recvmmsg() call, splits the ones
+ * coalesced by UDP_GRO and hands all the messages to the wireguard RX path together
+ * Reads at most COMM_BUDGET datagrams; returns 0 once the socket is drained
  */
-static void *comm_socket(void *argument) {
-	struct comm_args * args = argument;
-	struct wireguard_device *device = args->device;
-	int sockfd = args->sockfd;
-
-	int r;
-	int r_select;
-	fd_set fd_select;                           // for the select call
-	struct timeval timeout;                     // timeout used with select
-	struct pbuf u;
-	struct sockaddr_in unknownaddr;             // address of the sender
-	socklen_t len = sizeof(struct sockaddr_in);
-	ip_addr_t addr;
+static int comm_socket(struct comm_args *args, struct comm_rx *rx) {
+	unsigned int len, off, seg;
+	int budget;
+	int r, i;
+
+	for (budget = COMM_BUDGET; budget > 0; budget -= r) {
+		/* msg_namelen and msg_controllen are overwritten by every call */
+		for (i = 0; i < (int) rx->batch; i++) {
+			rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->from[i]);
+			rx->msgs[i].msg_hdr.msg_controllen = sizeof(rx->cmsg[i].buf);
+		}
 
-	size_t u_len = 1<<13;  // 8192
-	u.payload = CHECK_ALLOC_FATAL(malloc(u_len));
+		r = recvmmsg(args->sockfd, rx->msgs, rx->batch, 0, NULL);
+		if (r == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_error(errno, "Error while reading the UDP socket");
+			return 0;
+		}
 
-	while (!end_wireguard) {
-		/* select call initialisation */
-		FD_ZERO(&fd_select);
-		FD_SET(sockfd, &fd_select);
-
-		init_timeout(&timeout);
-		r_select = select(sockfd+1, &fd_select, NULL, NULL, &timeout);
-
-		/* MESSAGE READ FROM THE SOCKET */
-		if (r_select > 0) {
-			while ((r = (int) recvfrom(sockfd, u.payload, u_len,
-							0, (struct sockaddr *)&unknownaddr, &len)) != -1) {
-				/* Message from another peer */
-				if (config.debug)
-					log_message("<<  Received a UDP packet: size %d from %s:%d",
-							r, inet_ntoa(unknownaddr.sin_addr), ntohs(unknownaddr.sin_port));
-
-				u.len = u.tot_len = r;
-				addr.u_addr.ip4.addr = unknownaddr.sin_addr.s_addr;
-				wireguardif_network_rx(device, &u, &addr, ntohs(unknownaddr.sin_port));
+		for (i = 0; i < r; i++) {
+			len = rx->msgs[i].msg_len;
+			seg = comm_rx_gro_size(&rx->msgs[i].msg_hdr);
+			if (seg == 0 || seg > len)
+				seg = len;
+
+			/* Message from another peer */
+			if (config.debug)
+				log_message("<<  Received a UDP packet: size %u (%u per message) from %s:%d",
+						len, seg, inet_ntoa(rx->from[i].sin_addr), ntohs(rx->from[i].sin_port));
+
+			/* split a coalesced datagram back into the wireguard messages, the last may be shorter */
+			for (off = 0; off < len; off += seg) {
+				if (rx->count == rx->size)
+					comm_rx_dispatch(args, rx);
+				rx->bufs[rx->count].payload = rx->data[i] + off;
+				rx->bufs[rx->count].len = rx->bufs[rx->count].tot_len = (len - off < seg) ? len - off : seg;
+				rx->addr[rx->count].u_addr.ip4.addr = rx->from[i].sin_addr.s_addr;
+				rx->port[rx->count] = ntohs(rx->from[i].sin_port);
+				rx->count++;
 			}
 		}
+		comm_rx_dispatch(args, rx);
+
+		/* a short batch means the socket queue is empty */
+		if (r < (int) rx->batch)
+			return 0;
 	}
+	return 1;
+}
 
-	if (u.payload)
-		free(u.payload);
-	return NULL;
+/* Send one IP packet read from the TUN device (or segmented from one) to its peer */
+static void comm_tun_output(void *arg, uint8_t *packet, size_t len) {
+	struct comm_args *args = (struct comm_args *)arg;
+	struct pbuf u;
+	ip_addr_t addr;
+	struct ip_hdr *ip;
+
+	ip = (struct ip_hdr *)packet;
+	if (config.debug) {
+		log_message("<< Sending a VPN message: size %zu from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"",
+				len,
+				(ntohl(ip->src.addr)  >> 24) & 0xFF,
+				(ntohl(ip->src.addr)  >> 16) & 0xFF,
+				(ntohl(ip->src.addr)  >>  8) & 0xFF,
+				(ntohl(ip->src.addr)  >>  0) & 0xFF,
+				(ntohl(ip->dest.addr) >> 24) & 0xFF,
+				(ntohl(ip->dest.addr) >> 16) & 0xFF,
+				(ntohl(ip->dest.addr) >>  8) & 0xFF,
+				(ntohl(ip->dest.addr) >>  0) & 0xFF);
+	}
+
+	u.payload = packet;
+	u.len = u.tot_len = len;
+	addr.u_addr.ip4.addr = ip->dest.addr;
+	wireguardif_output(args->queue, &u, &addr);
 }
 
 /*
  * Manage the incoming messages from the TUN device
- * argument: struct comm_args *
+ * In offload mode a read can be a TCP/UDP super-packet: it is split into
+ * MTU-sized packets in seg_buf first
+ * The encrypted packets are queued and sent together at the end of the burst
+ * Reads at most COMM_BUDGET packets; returns 0 once the device is drained
  */
-static void *comm_tun(void *argument) {
-	struct comm_args *args = argument;
-	int tunfd = args->tunfd;
+static int comm_tun(struct comm_args *args, struct pbuf *u, size_t u_len, uint8_t *seg_buf) {
+	int budget;
 	int r;
-	int r_select;
-	fd_set fd_select;            // for the select call
-	struct timeval timeout;      // timeout used with select
-	struct pbuf u;
-	ip_addr_t addr;
-	struct ip_hdr *ip;
 
-	u.payload = CHECK_ALLOC_FATAL(malloc(MESSAGE_MAX_LENGTH));
+	for (budget = COMM_BUDGET; budget > 0; budget--) {
+		r = (int) read_tun(args->tunfd, u->payload, u_len);
+		if (r <= 0) {
+			wireguardif_output_flush(args->queue);
+			return 0;
+		}
 
-	while (!end_wireguard) {
-		/* select call initialisation */
-		init_timeout(&timeout);
-		FD_ZERO(&fd_select);
-		FD_SET(tunfd, &fd_select);
-		r_select = select(tunfd+1, &fd_select, NULL, NULL, &timeout);
-
-		/* MESSAGE READ FROM TUN DEVICE */
-		if (r_select > 0) {
-			r = (int) read_tun(tunfd, u.payload, MESSAGE_MAX_LENGTH);
-
-			ip = (struct ip_hdr *)u.payload;
-			if (config.debug) {
-				log_message("<< Sending a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"",
-						r,
-						(ntohl(ip->src.addr)  >> 24) & 0xFF,
-						(ntohl(ip->src.addr)  >> 16) & 0xFF,
-						(ntohl(ip->src.addr)  >>  8) & 0xFF,
-						(ntohl(ip->src.addr)  >>  0) & 0xFF,
-						(ntohl(ip->dest.addr) >> 24) & 0xFF,
-						(ntohl(ip->dest.addr) >> 16) & 0xFF,
-						(ntohl(ip->dest.addr) >>  8) & 0xFF,
-						(ntohl(ip->dest.addr) >>  0) & 0xFF);
-			}
+		if (!tun_vnet_hdr) {
+			comm_tun_output(args, u->payload, r);
+		} else if (r < (int) OFFLOAD_VNET_HDR_LEN ||
+				offload_segment((struct virtio_net_hdr *)u->payload, (uint8_t *)u->payload + OFFLOAD_VNET_HDR_LEN,
+					r - OFFLOAD_VNET_HDR_LEN, seg_buf, MESSAGE_MAX_LENGTH, comm_tun_output, args) < 0) {
+			log_message_level(2, "Dropped a malformed packet from the tun device: size %d", r);
+		}
+	}
+	wireguardif_output_flush(args->queue);
+	return 1;
+}
+
+static int comm_epoll_add(int epfd, int fd, uint32_t events) {
+	struct epoll_event ev;
 
-			u.len = u.tot_len = r;
-			addr.u_addr.ip4.addr = ip->dest.addr;
-			wireguardif_output(wg_netif, &u, &addr);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		log_error(errno, "Could not add fd %d to the event loop", fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Event loop of one worker thread: it serves its TUN queue, its UDP socket if
+ * it has one of its own and, for the first one, the periodic wireguard timer
+ * (timerfd); all of them watch the stop request (eventfd)
+ *
+ * The socket and the TUN queue are edge-triggered: each is read until
+ * EAGAIN, COMM_BUDGET packets at a time so neither direction starves the other
+ */
+static void *comm_worker(void *arg) {
+	struct comm_args *args = (struct comm_args *)arg;
+	struct epoll_event events[COMM_MAX_EVENTS];
+	struct itimerspec its;
+	struct comm_rx rx;
+	struct pbuf tun_buf;
+	/* in offload mode a read is a virtio-net header and up to 64 KB of packet */
+	size_t tun_buf_len = tun_vnet_hdr ? OFFLOAD_VNET_HDR_LEN + OFFLOAD_MAX_PACKET : MESSAGE_MAX_LENGTH;
+	uint8_t *seg_buf;
+	/* coalesced datagrams need room for a whole UDP payload, so only a few buffers are kept */
+	size_t sock_buf_len = config.udp_gro ? COMM_GRO_BUF_LEN : 1<<13;  // 8192
+	unsigned int sock_batch = (config.udp_gro && config.udp_rx_batch > COMM_GRO_RX_BATCH) ? COMM_GRO_RX_BATCH : config.udp_rx_batch;
+	int sock_ready = 0, tun_ready = 0;
+	int epfd, timer_fd = -1;
+	uint64_t count;
+	uint32_t jitter;
+	int n, i;
+
+	args->result = -1;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		log_error(errno, "Could not create the event loop");
+		goto stop_all;
+	}
+
+	if (args->timer) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd == -1) {
+			log_error(errno, "Could not create the event loop descriptors");
+			goto clean_end;
+		}
+
+		/* periodic wireguard processing: handshakes, keepalives, key expiry
+		 * the first tick is at a random point of the interval: two peers started
+		 * together would otherwise send their initiations at the same moment on
+		 * every tick and each wipe out the other's handshake */
+		wireguard_random_bytes(&jitter, sizeof(jitter));
+		jitter = 1 + jitter % WIREGUARDIF_TIMER_MSECS;
+		its.it_value.tv_sec = jitter / 1000;
+		its.it_value.tv_nsec = (jitter % 1000) * 1000000L;
+		its.it_interval.tv_sec = WIREGUARDIF_TIMER_MSECS / 1000;
+		its.it_interval.tv_nsec = (WIREGUARDIF_TIMER_MSECS % 1000) * 1000000L;
+		if (timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+			log_error(errno, "Could not start the wireguard timer");
+			goto clean_end;
 		}
+		if (comm_epoll_add(epfd, timer_fd, EPOLLIN) == -1)
+			goto clean_end;
 	}
 
-	if (u.payload)
-		free(u.payload);
+	if ((args->sockfd != -1 && comm_epoll_add(epfd, args->sockfd, EPOLLIN | EPOLLET) == -1) ||
+		comm_epoll_add(epfd, args->tunfd, EPOLLIN | EPOLLET) == -1 ||
+		comm_epoll_add(epfd, stop_fd, EPOLLIN) == -1) {
+		goto clean_end;
+	}
+
+	memset(&rx, 0, sizeof(rx));
+	if (args->sockfd != -1)
+		comm_rx_init(&rx, sock_batch, sock_buf_len);
+	tun_buf.payload = CHECK_ALLOC_FATAL(malloc(tun_buf_len));
+	seg_buf = CHECK_ALLOC_FATAL(malloc(MESSAGE_MAX_LENGTH));
+
+	/* peer vpn -> eth0 -> wg_decrypt -> tun0 -> host application
+	 * host application -> tun0 -> wg_encrypt -> eth0 -> peer vpn */
+	while (!end_wireguard) {
+		/* do not sleep while a descriptor still has packets queued */
+		n = epoll_wait(epfd, events, COMM_MAX_EVENTS, (sock_ready || tun_ready) ? 0 : -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_error(errno, "Error while waiting for events");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == args->sockfd) {
+				sock_ready = 1;
+			} else if (events[i].data.fd == args->tunfd) {
+				tun_ready = 1;
+			} else if (events[i].data.fd == timer_fd) {
+				if (read(timer_fd, &count, sizeof(count)) == sizeof(count))
+					wireguardif_tmr(args->device);
+			}
+			/* stop_fd is left readable for the other workers */
+		}
+
+		if (sock_ready)
+			sock_ready = comm_socket(args, &rx);
+		if (tun_ready)
+			tun_ready = comm_tun(args, &tun_buf, tun_buf_len, seg_buf);
+	}
+	args->result = 0;
+
+	comm_rx_free(&rx);
+	free(tun_buf.payload);
+	free(seg_buf);
+
+clean_end:
+	if (timer_fd != -1)
+		close(timer_fd);
+	close(epfd);
+stop_all:
+	/* one worker failing stops them all */
+	if (args->result == -1) {
+		end_wireguard = 1;
+		stop_vpn();
+	}
 	return NULL;
 }
 
 /*
  * Start the VPN:
- * start a thread running comm_tun and another one running comm_socket
+ * one worker thread per queue of the interface, each reading, encrypting and
+ * sending the packets of its TUN queue, and receiving, decrypting and writing
+ * to its TUN queue the messages of its UDP socket (SO_REUSEPORT) - or of the
+ * one socket, then read by the first worker only. The first one, run by the
+ * calling thread, also runs the wireguard timer
  *
- * set end_wireguard to 1 in order to stop both threads
+ * call stop_vpn() after setting end_wireguard to 1 to stop the workers
  */
 int start_vpn(struct netif *netif) {
-	struct comm_args args;
-	pthread_t th_socket;
-	pthread_t th_tun;
+	struct comm_args *args;
+	pthread_t *threads;
+	int result = 0;
+	int fd;
+	int i;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1) {
+		log_error(errno, "Could not create the event loop descriptors");
+		return -1;
+	}
+	mutexLock(&stop_mutex);
+	stop_fd = fd;
+	mutexUnlock(&stop_mutex);
+
+	args = CHECK_ALLOC_FATAL(calloc(netif->queue_count, sizeof(*args)));
+	threads = CHECK_ALLOC_FATAL(calloc(netif->queue_count, sizeof(*threads)));
+	for (i = 0; i < netif->queue_count; i++) {
+		args[i].sockfd = (i == 0 || netif->queues[i].sockfd != netif->queues[0].sockfd) ? netif->queues[i].sockfd : -1;
+		args[i].tunfd = netif->queues[i].tunfd;
+		args[i].timer = (i == 0);
+		args[i].device = (struct wireguard_device *)(netif->state);
+		args[i].queue = &netif->queues[i];
+	}
 
-	args.sockfd = netif->sockfd;
-	args.tunfd = netif->tunfd;
-	args.device = (struct wireguard_device *)(netif->state);
+	for (i = 1; i < netif->queue_count; i++)
+		threads[i] = createThread(comm_worker, &args[i]);
+	comm_worker(&args[0]);
+	for (i = 1; i < netif->queue_count; i++)
+		joinThread(threads[i], NULL);
 
-	/* peer vpn -> eth0 -> wg_decrypt -> tun0 -> host application */
-	th_socket = createThread(comm_socket, &args);
-	log_message_level(2, "thread id for comm_socket thread is (%ld)", th_socket);
+	mutexLock(&stop_mutex);
+	stop_fd = -1;
+	mutexUnlock(&stop_mutex);
+	close(fd);
 
-	/* host application -> tun0 -> wg_encrypt -> eth0 -> peer vpn */
-	th_tun = createThread(comm_tun, &args);
-	log_message_level(2, "thread id for comm_tun thread is (%ld)", th_tun);
+	for (i = 0; i < netif->queue_count; i++) {
+		if (args[i].result == -1)
+			result = -1;
+	}
+	free(args);
+	free(threads);
+	return result;
+}
 
-	joinThread(th_socket, NULL);
-	joinThread(th_tun, NULL);
+/*
+ * Wake the event loop up so it sees end_wireguard
+ * Safe to call from the signal handling thread
+ */
+void stop_vpn(void) {
+	uint64_t one = 1;
 
-	return 0;
+	mutexLock(&stop_mutex);
+	if (stop_fd != -1)
+		(void) write(stop_fd, &one, sizeof(one));
+	mutexUnlock(&stop_mutex);
 }
@@ -11,10 +11,25 @@
 #include "wireguard.h"
 #include "lwip_h/ip_addr.h"
 
-/*
- * duration of the timeout used with the select calls*/
-#define SELECT_DELAY_SEC 2
-#define SELECT_DELAY_USEC 0
+/* events handled per epoll_wait call */
+#define COMM_MAX_EVENTS 8
+/* packets read from one descriptor before the event loop moves on to the next */
+#define COMM_BUDGET 64
+/* datagrams received per recvmmsg() call: default and upper limit of config.udp_rx_batch */
+#define COMM_RX_BATCH_DEFAULT 32
+#define COMM_RX_BATCH_MAX 256
+/* data messages queued per sendmmsg() call: default and upper limit of config.udp_tx_batch */
+#define COMM_TX_BATCH_DEFAULT 32
+#define COMM_TX_BATCH_MAX 256
+/* UDP_GRO: most messages in one coalesced datagram (the kernel's UDP_MAX_SEGMENTS is 64 or 128)
+ * and the receive buffer size that holds any datagram */
+#define COMM_GRO_MAX_SEGMENTS 128
+#define COMM_GRO_BUF_LEN 65536
+/* UDP_GRO: upper limit of the recvmmsg() batch, as each buffer is COMM_GRO_BUF_LEN
+ * (a coalesced datagram carries up to 64 messages, so a few of them fill a batch) */
+#define COMM_GRO_RX_BATCH 4
+/* upper limit of config.tun_queues: TUN queues, each served by its own worker thread */
+#define COMM_QUEUES_MAX 64
 
 #define TUN_MTU_DEFAULT 1420
 #define MESSAGE_MAX_LENGTH 1500
@@ -33,14 +48,19 @@ struct wgallowedip {
 	struct wgallowedip *next_allowedip;
 };
 
-/* arguments for the comm_tun and comm_socket threads */
+/* descriptors served by the event loop of one worker thread */
 struct comm_args {
-    int sockfd;
+    int sockfd;                         /* -1 if the worker does not read the socket */
     int tunfd;
+    int timer;                          /* non-zero for the worker running the wireguard timer */
     struct wireguard_device *device;
+    struct wireguardif_queue *queue;
+    int result;
 };
 
-int start_vpn();
-int create_socket(void);
+int start_vpn(struct netif *netif);
+void stop_vpn(void);
+int create_socket(int join);
+int steer_sockets_by_cpu(int sockfd, unsigned int count);
 
 #endif /*_WG_COMM_H_*/
@@ -11,6 +11,7 @@
 #include "wg_comm.h"
 #include "wireguard_vpn.h"
 #include "lib/log.h"
+#include "crypto.h"
 
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -22,6 +23,15 @@
 
 struct configuration config;
 
+/* one TUN queue per online CPU */
+static int default_tun_queues(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return (n > COMM_QUEUES_MAX) ? COMM_QUEUES_MAX : (int) n;
+}
+
 /* set default values in config */
 void initConfig() {
 	config.verbose = 0;
@@ -48,6 +58,8 @@ void initConfig() {
 	memset(config.allowed_ips, 0, sizeof(config.allowed_ips));
 
 	config.tun_mtu = TUN_MTU_DEFAULT;
+	config.tun_offload = 1;
+	config.tun_queues = default_tun_queues();
 	config.iface = NULL;
 	config.tun_device = CHECK_ALLOC_FATAL("tun0");
 
@@ -56,6 +68,15 @@ void initConfig() {
 
 	config.pidfile = NULL;
 
+	config.chacha20_kernel = CHACHA20_KERNEL_AUTO;
+	config.crypto_backend = WIREGUARD_CRYPTO_BUNDLED;
+	config.udp_rx_batch = COMM_RX_BATCH_DEFAULT;
+	config.udp_tx_batch = COMM_TX_BATCH_DEFAULT;
+	config.udp_gso = 1;
+	config.udp_gro = 1;
+	config.udp_reuseport = 1;
+	config.udp_reuseport_cpu = 0;
+
 #ifdef HAVE_LINUX
 	config.txqueue = 0;
 	config.tun_one_queue = 0;
@@ -170,6 +191,78 @@ int parse_conf_file(const char *file) {
 					if (s == NULL) continue;
 					memset(config.public_key, '\0', WG_KEY_LEN_BASE64);
 					sprintf((char *)config.public_key, "%s=", &s[1]);
+
+				} else if (!strcmp(s, "chacha20_kernel")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.chacha20_kernel = chacha20_kernel_by_name(s);
+					if (config.chacha20_kernel < 0) {
+						log_message("Unknown chacha20_kernel '%s', using auto", s);
+						config.chacha20_kernel = CHACHA20_KERNEL_AUTO;
+					}
+
+				} else if (!strcmp(s, "crypto_backend")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.crypto_backend = wireguard_crypto_backend_by_name(s);
+					if (config.crypto_backend < 0) {
+						log_message("Unknown crypto_backend '%s', using bundled", s);
+						config.crypto_backend = WIREGUARD_CRYPTO_BUNDLED;
+					}
+
+				} else if (!strcmp(s, "udp_rx_batch")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_rx_batch = atoi(s);
+					if (config.udp_rx_batch < 1 || config.udp_rx_batch > COMM_RX_BATCH_MAX) {
+						log_message("udp_rx_batch must be between 1 and %d, using %d", COMM_RX_BATCH_MAX, COMM_RX_BATCH_DEFAULT);
+						config.udp_rx_batch = COMM_RX_BATCH_DEFAULT;
+					}
+
+				} else if (!strcmp(s, "udp_tx_batch")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_tx_batch = atoi(s);
+					if (config.udp_tx_batch < 1 || config.udp_tx_batch > COMM_TX_BATCH_MAX) {
+						log_message("udp_tx_batch must be between 1 and %d, using %d", COMM_TX_BATCH_MAX, COMM_TX_BATCH_DEFAULT);
+						config.udp_tx_batch = COMM_TX_BATCH_DEFAULT;
+					}
+
+				} else if (!strcmp(s, "udp_gso")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_gso = atoi(s);
+
+				} else if (!strcmp(s, "udp_gro")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_gro = atoi(s);
+
+				} else if (!strcmp(s, "udp_reuseport")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_reuseport = atoi(s);
+
+				} else if (!strcmp(s, "udp_reuseport_cpu")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.udp_reuseport_cpu = atoi(s);
+
+				} else if (!strcmp(s, "tun_offload")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.tun_offload = atoi(s);
+
+				} else if (!strcmp(s, "tun_queues")) {
+					s = strtok_r(NULL, "=", &saveptr);
+					if (s == NULL) continue;
+					config.tun_queues = atoi(s);
+					if (config.tun_queues < 0 || config.tun_queues > COMM_QUEUES_MAX) {
+						log_message("tun_queues must be between 0 and %d, using one per CPU", COMM_QUEUES_MAX);
+						config.tun_queues = 0;
+					}
+					if (config.tun_queues == 0)
+						config.tun_queues = default_tun_queues();
 				}
 			}
 
@@ -32,6 +32,8 @@ struct configuration {
 	uint8_t public_key[WG_KEY_LEN_BASE64];      // peer vpn public key
 
     int tun_mtu;                                // MTU of the tun device
+    int tun_offload;                            // TUN offload mode: TSO/USO super-packets segmented by us
+    int tun_queues;                             // TUN queues (IFF_MULTI_QUEUE), each with its own worker thread
     char *iface;                                // bind to a specific network interface
     char *tun_device;                           // The name of the TUN interface
 
@@ -42,6 +44,15 @@ struct configuration {
 
     char *pidfile;                              // PID file in daemon mode
 
+    int chacha20_kernel;                        // ChaCha20 implementation (0 means the fastest available)
+    int crypto_backend;                         // X25519/AEAD provider (0 means the bundled code)
+    int udp_rx_batch;                           // datagrams read from the UDP socket per recvmmsg() call
+    int udp_tx_batch;                           // data messages sent per sendmmsg() call at most
+    int udp_gso;                                // send same-size data messages as one UDP_SEGMENT datagram
+    int udp_gro;                                // receive coalesced datagrams (UDP_GRO)
+    int udp_reuseport;                          // one UDP socket per TUN queue on the same port (SO_REUSEPORT)
+    int udp_reuseport_cpu;                      // pick the socket by receiving CPU instead of the sender hash
+
 #ifdef HAVE_LINUX
     int txqueue;                                // TX queue length for the TUN device (0 means default)
     int tun_one_queue;                          // Single queue mode
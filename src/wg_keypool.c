@@ -0,0 +1,95 @@
+/*
+ * Pool of pre-generated ephemeral keypairs for the handshake
+ *
+ * Every initiation and response needs a fresh ephemeral keypair, and computing its public key is an X25519
+ * scalar multiplication on whichever thread triggered the handshake. A background thread running at
+ * SCHED_IDLE priority instead keeps a small ring of ready pairs, so the handshake just copies one out.
+ * Each pair is handed out once and its slot wiped.
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "wg_keypool.h"
+#include "wireguard.h"
+#include "crypto.h"
+#include "lib/pthread_wrap.h"
+#include "lib/log.h"
+
+struct wg_keypool_entry {
+	uint8_t private_key[WIREGUARD_PRIVATE_KEY_LEN];
+	uint8_t public_key[WIREGUARD_PUBLIC_KEY_LEN];
+};
+
+static struct wg_keypool_entry pool[WG_KEYPOOL_SIZE];
+static int pool_head;	/* next entry to hand out */
+static int pool_count;
+static bool pool_started;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void *keypool_refill(void *arg) {
+	struct sched_param param = { .sched_priority = 0 };
+	struct wg_keypool_entry entry;
+	int r;
+
+	(void)arg;
+
+	/* Only run when nothing else wants the CPU */
+	r = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (r != 0) {
+		log_message_level(1, "|wg| keypool: cannot set SCHED_IDLE: %s", strerror(r));
+	}
+
+	for (;;) {
+		mutexLock(&pool_mutex);
+		while (pool_count == WG_KEYPOOL_SIZE) {
+			conditionWait(&pool_cond, &pool_mutex);
+		}
+		mutexUnlock(&pool_mutex);
+
+		/* The X25519 runs unlocked so a pop never waits for it */
+		if (!wireguard_generate_keypair(entry.private_key, entry.public_key)) {
+			continue;
+		}
+
+		mutexLock(&pool_mutex);
+		memcpy(&pool[(pool_head + pool_count) % WG_KEYPOOL_SIZE], &entry, sizeof(entry));
+		pool_count++;
+		mutexUnlock(&pool_mutex);
+		crypto_zero(&entry, sizeof(entry));
+	}
+
+	return NULL;
+}
+
+void wg_keypool_start(void) {
+	if (!pool_started) {
+		pool_started = true;
+		createDetachedThread(keypool_refill, NULL);
+	}
+}
+
+bool wg_keypool_pop(uint8_t *private_key, uint8_t *public_key) {
+	struct wg_keypool_entry *entry;
+	bool result = false;
+
+	mutexLock(&pool_mutex);
+	if (pool_count > 0) {
+		entry = &pool[pool_head];
+		memcpy(private_key, entry->private_key, WIREGUARD_PRIVATE_KEY_LEN);
+		memcpy(public_key, entry->public_key, WIREGUARD_PUBLIC_KEY_LEN);
+		crypto_zero(entry, sizeof(*entry));
+		pool_head = (pool_head + 1) % WG_KEYPOOL_SIZE;
+		pool_count--;
+		conditionSignal(&pool_cond);
+		result = true;
+	}
+	mutexUnlock(&pool_mutex);
+	return result;
+}
@@ -0,0 +1,27 @@
+/*
+ * Pool of pre-generated ephemeral keypairs for the handshake
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _WG_KEYPOOL_H_
+#define _WG_KEYPOOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Number of (Epriv, Epub) pairs kept ready */
+#define WG_KEYPOOL_SIZE		8
+
+/* Start the low-priority thread that keeps the pool full */
+void wg_keypool_start(void);
+
+/*
+ * Take one keypair out of the pool, wiping its slot.
+ * Returns false when the pool is empty (or not started) - the caller then generates one itself.
+ */
+bool wg_keypool_pop(uint8_t *private_key, uint8_t *public_key);
+
+#endif /* _WG_KEYPOOL_H_ */
@@ -21,17 +21,24 @@
 #include "wg_tun.h"
 #include "wg_comm.h"
 #include "wg_config.h"
-#include "wg_timer.h"
 #include "wireguard_vpn.h"
 #include "wireguardif.h"
+#include "wireguard-platform.h"
+#include "crypto.h"
+#include "crypto/selftest.h"
+#include "wg_offload_selftest.h"
 #include "lib/log.h"
 #include "lib/pthread_wrap.h"
 
 #define VERSION "0.9.90"
 
+#define SELFTEST_ROUNDS 1000
+
 volatile sig_atomic_t end_wireguard = 0;
 static char *pidfile = NULL;
 struct netif *wg_netif = NULL;
+static unsigned long selftest_rounds = SELFTEST_ROUNDS;
+static uint64_t selftest_seed = 0;
 
 
 static void usage(void) {
@@ -42,6 +49,9 @@ static void usage(void) {
 	fprintf(stderr, " -h, --help              this help message\n");
 	fprintf(stderr, " -m, --mlock             lock the memory into RAM\n");
 	fprintf(stderr, " -p, --pidfile=FILE      write the pid into this file when running in background\n");
+	fprintf(stderr, "     --selftest[=N[,SEED]]  compare the crypto kernels and backends against the reference code\n");
+	fprintf(stderr, "                         and check the TUN offload segmentation and GRO\n");
+	fprintf(stderr, "                         over N random rounds (default %d), then exit\n", SELFTEST_ROUNDS);
 	fprintf(stderr, " -v, --verbose           verbose mode\n");
 	fprintf(stderr, " -V, --version           show version information and exit\n\n");
 	fprintf(stderr, "If no configuration file is given, the default is " DEFAULT_CONF_FILE "\n");
@@ -65,6 +75,7 @@ static int parse_args(int argc, char **argv, const char **configFile) {
 		{"help", 0, NULL, 'h'},
 		{"mlock", 0, NULL, 'm'},
 		{"pidfile", 1, NULL, 'p'},
+		{"selftest", 2, NULL, 'T'},
 		{0, 0, 0, 0}
 	};
 	while ((opt = getopt_long(argc, argv, "vVdDhmp:", long_options, NULL)) >= 0) {
@@ -94,6 +105,18 @@ static int parse_args(int argc, char **argv, const char **configFile) {
 					free(config.pidfile);
 				config.pidfile = CHECK_ALLOC_FATAL(strdup(optarg));
 				break;
+			case 'T' :
+				if (optarg) {
+					char *end;
+					selftest_rounds = strtoul(optarg, &end, 0);
+					if (*end == ',') {
+						selftest_seed = strtoull(end + 1, &end, 0);
+					}
+					if (*end != '\0') {
+						return 1;
+					}
+				}
+				return 3;
 			case 'V' :
 				return 2;
 			case 'h' :
@@ -151,6 +174,42 @@ static void create_pidfile(void) {
 	atexit(remove_pidfile);
 }
 
+static void selftest(void) {
+	int failures;
+
+	if (selftest_seed == 0) {
+		wireguard_random_bytes(&selftest_seed, sizeof(selftest_seed));
+	}
+	wireguard_x25519_base_init();
+	printf("Crypto selftest: %lu rounds, seed %llu\n", selftest_rounds, (unsigned long long)selftest_seed);
+	fflush(stdout);
+	failures = crypto_selftest(selftest_rounds, selftest_seed);
+	if (failures) {
+		printf("Crypto selftest: %d failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+	printf("Crypto selftest: passed\n");
+
+	printf("Offload selftest: %lu rounds, seed %llu\n", selftest_rounds, (unsigned long long)selftest_seed);
+	fflush(stdout);
+	failures = offload_selftest(selftest_rounds, selftest_seed);
+	if (failures) {
+		printf("Offload selftest: %d failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+	printf("Offload selftest: passed\n");
+
+	printf("Offload GRO selftest: %lu rounds, seed %llu\n", selftest_rounds, (unsigned long long)selftest_seed);
+	fflush(stdout);
+	failures = offload_gro_selftest(selftest_rounds, selftest_seed);
+	if (failures) {
+		printf("Offload GRO selftest: %d failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+	printf("Offload GRO selftest: passed\n");
+	exit(EXIT_SUCCESS);
+}
+
 static void daemonize(void) {
     int r;
 
@@ -179,8 +238,8 @@ static void *sig_handler(void *arg __attribute__((unused))) {
 			case SIGINT:
 			case SIGQUIT:
 				end_wireguard = 1;
-				// terminate timer
-				stop_timer(wg_netif->timer);
+				// wake the event loop up
+				stop_vpn();
 				log_message("Received signal %d, exiting...", sig);
 				return NULL;
 			case SIGALRM:
@@ -196,6 +255,11 @@ int main (int argc, char **argv) {
 	int pa;
 	int exit_status = EXIT_SUCCESS;
 	int log_level = 0;
+	int tunfds[COMM_QUEUES_MAX];
+	int i;
+
+	for (i = 0; i < COMM_QUEUES_MAX; i++)
+		tunfds[i] = -1;
 
 	initConfig();
 
@@ -204,6 +268,8 @@ int main (int argc, char **argv) {
 		usage();
 	else if (pa == 2)
 		version();
+	else if (pa == 3)
+		selftest();
 
 	if (parse_conf_file(configFile) != 0) {
 		goto clean_end;
@@ -241,25 +307,39 @@ int main (int argc, char **argv) {
 		goto clean_end;
 	}
 
-	wg_netif->sockfd = create_socket();
-	if (wg_netif->sockfd < 0) {
-		log_error(errno, "Could not create udp socket.");
-		exit_status = EXIT_FAILURE;
-		goto clean_end;
-	}
+	/* one socket per queue sharing the port, or one for all of them */
+	if (wg_netif->queue_count < 2)
+		config.udp_reuseport = 0;
+	for (i = 0; i < wg_netif->queue_count; i++) {
+		if (i > 0 && !config.udp_reuseport) {
+			wg_netif->queues[i].sockfd = wg_netif->queues[0].sockfd;
+			continue;
+		}
 
-	if (fcntl(wg_netif->sockfd, F_SETFL, O_NONBLOCK) == -1) {
-		log_error(errno, "Could not set non-blocking mode on the socket");
-		exit_status = EXIT_FAILURE;
-		goto clean_end;
+		wg_netif->queues[i].sockfd = create_socket(i > 0);
+		if (wg_netif->queues[i].sockfd < 0) {
+			log_error(errno, "Could not create udp socket.");
+			exit_status = EXIT_FAILURE;
+			goto clean_end;
+		}
+
+		if (fcntl(wg_netif->queues[i].sockfd, F_SETFL, O_NONBLOCK) == -1) {
+			log_error(errno, "Could not set non-blocking mode on the socket");
+			exit_status = EXIT_FAILURE;
+			goto clean_end;
+		}
 	}
+	wg_netif->sockfd = wg_netif->queues[0].sockfd;
+	if (config.udp_reuseport && config.udp_reuseport_cpu)
+		steer_sockets_by_cpu(wg_netif->sockfd, wg_netif->queue_count);
 
-	wg_netif->tunfd = init_tun();
-	if (wg_netif->tunfd < 0) {
+	if (init_tun(tunfds, wg_netif->queue_count) < 0) {
 		log_error(errno, "Could not create tun device file.");
 		exit_status = EXIT_FAILURE;
 		goto clean_end;
 	}
+	for (i = 0; i < wg_netif->queue_count; i++)
+		wg_netif->queues[i].tunfd = tunfds[i];
 
 	do {
 		log_message("Starting Wireguard VPN");
@@ -272,11 +352,12 @@ int main (int argc, char **argv) {
 
 clean_end:
 	if (wg_netif) {
-		stop_timer(wg_netif->timer);
-		close_tun(wg_netif->tunfd);
-		close(wg_netif->sockfd);
-		if (wg_netif->state)
-			free(wg_netif->state); //device
+		close_tun(tunfds, wg_netif->queue_count);
+		for (i = 0; i < wg_netif->queue_count; i++) {
+			if (wg_netif->queues[i].sockfd >= 0 && (i == 0 || config.udp_reuseport))
+				close(wg_netif->queues[i].sockfd);
+		}
+		wireguardif_deinit(wg_netif);
 		free(wg_netif);
 	}
 
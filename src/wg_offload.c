@@ -0,0 +1,325 @@
+/*
+ * TUN offload mode: virtio-net headers and userspace segmentation
+ *
+ * With IFF_VNET_HDR and TUNSETOFFLOAD the kernel hands the TUN device TCP and
+ * UDP super-packets of up to 64 KB, plus packets whose transport checksum is
+ * left for us to finish. WireGuard carries IP packets no larger than the tunnel
+ * MTU, so they are split here the way a NIC doing TSO/USO would. On the way
+ * back the decrypted segments of a TCP flow are merged again, as NIC GRO does.
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "wg_offload.h"
+
+#define TCP_FLAG_FIN	0x01
+#define TCP_FLAG_PSH	0x08
+#define TCP_FLAG_ACK	0x10
+#define TCP_FLAG_CWR	0x80
+
+#define IP4_DF		0x4000
+
+static inline uint16_t get_be16(const uint8_t *p) {
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void put_be16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static inline uint32_t get_be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v) {
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+/* one's complement sum of big-endian 16-bit words - fits 32 bits for any IP packet */
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len) {
+	while (len > 1) {
+		sum += get_be16(data);
+		data += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += (uint32_t)data[0] << 8;
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* sum of the IPv4/IPv6 pseudo header for a transport segment of l4_len bytes */
+static uint32_t csum_pseudo(const uint8_t *packet, uint8_t proto, size_t l4_len) {
+	uint32_t sum;
+
+	if ((packet[0] >> 4) == 4)
+		sum = csum_add(0, packet + 12, 8);
+	else
+		sum = csum_add(0, packet + 8, 32);
+	return sum + proto + (uint32_t)(l4_len >> 16) + (uint32_t)(l4_len & 0xffff);
+}
+
+int offload_segment(const struct virtio_net_hdr *vh, uint8_t *packet, size_t len,
+		uint8_t *seg_buf, size_t seg_buf_len, offload_output_fn out, void *arg) {
+	uint8_t gso_type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	size_t l4, hlen, mss, off, seg_len, total;
+	uint16_t csum, ip_id = 0;
+	uint32_t seq = 0;
+	uint8_t proto;
+	int version;
+	int count = 0;
+
+	if (len < 20)
+		return -1;
+	version = packet[0] >> 4;
+	if ((version != 4 && version != 6) || (version == 6 && len < 40))
+		return -1;
+
+	if (gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+			/* the checksum field holds the pseudo header sum: finish it over the rest of the packet */
+			if ((size_t)vh->csum_start + vh->csum_offset + 2 > len)
+				return -1;
+			csum = csum_fold(csum_add(0, packet + vh->csum_start, len - vh->csum_start));
+			/* as the kernel does: 0 would mean no checksum for UDP, 0xffff is the same sum */
+			put_be16(packet + vh->csum_start + vh->csum_offset, csum ? csum : 0xffff);
+		}
+		out(arg, packet, len);
+		return 1;
+	}
+
+	/* the TCP GSO type names the IP version, which must be the packet's */
+	if ((gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && version == 4) || (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 && version == 6))
+		proto = IPPROTO_TCP;
+	else if (gso_type == VIRTIO_NET_HDR_GSO_UDP_L4)
+		proto = IPPROTO_UDP;
+	else
+		return -1;
+
+	/* csum_start is where the transport header starts, right after the IPv4 header
+	 * or past any IPv6 extension headers */
+	l4 = vh->csum_start;
+	if (l4 < (version == 4 ? 20u : 40u) || l4 + 8 > len)
+		return -1;
+	if (version == 4 && l4 != (size_t)(packet[0] & 0x0f) * 4)
+		return -1;
+	if (proto == IPPROTO_TCP) {
+		/* data offset: at least the 20 bytes of the TCP header itself */
+		if (l4 + 20 > len || (packet[l4 + 12] >> 4) < 5)
+			return -1;
+		hlen = l4 + (size_t)(packet[l4 + 12] >> 4) * 4;
+		seq = get_be32(packet + l4 + 4);
+	} else {
+		hlen = l4 + 8;
+	}
+	mss = vh->gso_size;
+	if (mss == 0 || hlen > len || hlen + mss > seg_buf_len)
+		return -1;
+	if (version == 4)
+		ip_id = get_be16(packet + 4);
+
+	for (off = hlen; off < len; off += seg_len) {
+		seg_len = (len - off < mss) ? len - off : mss;
+		total = hlen + seg_len;
+		memcpy(seg_buf, packet, hlen);
+		memcpy(seg_buf + hlen, packet + off, seg_len);
+
+		if (version == 4) {
+			put_be16(seg_buf + 2, (uint16_t)total);
+			put_be16(seg_buf + 4, (uint16_t)(ip_id + count));
+			put_be16(seg_buf + 10, 0);
+			put_be16(seg_buf + 10, csum_fold(csum_add(0, seg_buf, (size_t)(seg_buf[0] & 0x0f) * 4)));
+		} else {
+			put_be16(seg_buf + 4, (uint16_t)(total - 40));
+		}
+
+		if (proto == IPPROTO_TCP) {
+			put_be32(seg_buf + l4 + 4, seq + (uint32_t)(off - hlen));
+			/* FIN and PSH belong to the last segment, CWR to the first */
+			if (off + seg_len < len)
+				seg_buf[l4 + 13] &= (uint8_t)~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+			if (count > 0)
+				seg_buf[l4 + 13] &= (uint8_t)~TCP_FLAG_CWR;
+			put_be16(seg_buf + l4 + 16, 0);
+			csum = csum_fold(csum_add(csum_pseudo(seg_buf, proto, total - l4), seg_buf + l4, total - l4));
+			put_be16(seg_buf + l4 + 16, csum);
+		} else {
+			put_be16(seg_buf + l4 + 4, (uint16_t)(total - l4));
+			put_be16(seg_buf + l4 + 6, 0);
+			csum = csum_fold(csum_add(csum_pseudo(seg_buf, proto, total - l4), seg_buf + l4, total - l4));
+			put_be16(seg_buf + l4 + 6, csum ? csum : 0xffff);
+		}
+
+		out(arg, seg_buf, total);
+		count++;
+	}
+	return count;
+}
+
+struct offload_gro *offload_gro_alloc(void) {
+	struct offload_gro *gro;
+
+	gro = calloc(1, sizeof(*gro));
+	if (gro) {
+		gro->buf = malloc(OFFLOAD_VNET_HDR_LEN + OFFLOAD_MAX_PACKET);
+		if (gro->buf == NULL) {
+			free(gro);
+			gro = NULL;
+		}
+	}
+	return gro;
+}
+
+void offload_gro_free(struct offload_gro *gro) {
+	if (gro) {
+		free(gro->buf);
+		free(gro);
+	}
+}
+
+/*
+ * IP and TCP header lengths of a TCP segment that may be merged: IPv4 without
+ * options or fragmentation and with DF, or IPv6 without extension headers;
+ * ACK set, PSH allowed, no other flags; some payload; valid IPv4 header and
+ * TCP checksums. *len is trimmed to the IP length. Returns false for anything else
+ */
+static bool gro_segment(const uint8_t *packet, size_t *len, size_t *ip_hlen, size_t *hlen) {
+	size_t ip_len, l4;
+	uint8_t flags;
+
+	if (*len < 40)
+		return false;
+	if ((packet[0] >> 4) == 4) {
+		if (packet[0] != 0x45 || packet[9] != IPPROTO_TCP || get_be16(packet + 6) != IP4_DF)
+			return false;
+		ip_len = get_be16(packet + 2);
+		l4 = 20;
+	} else if ((packet[0] >> 4) == 6) {
+		if (packet[6] != IPPROTO_TCP)
+			return false;
+		ip_len = 40 + (size_t)get_be16(packet + 4);
+		l4 = 40;
+	} else {
+		return false;
+	}
+	if (ip_len > *len || l4 + 20 > ip_len)
+		return false;
+
+	flags = packet[l4 + 13];
+	if ((flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+		return false;
+	*hlen = l4 + (size_t)(packet[l4 + 12] >> 4) * 4;
+	if (*hlen < l4 + 20 || *hlen >= ip_len)
+		return false;
+
+	/* the merged packet gets checksums of its own, which would hide a corrupted
+	 * segment: one that does not verify is left for the kernel to drop */
+	if (l4 == 20 && csum_fold(csum_add(0, packet, 20)) != 0)
+		return false;
+	if (csum_fold(csum_add(csum_pseudo(packet, IPPROTO_TCP, ip_len - l4), packet + l4, ip_len - l4)) != 0)
+		return false;
+	*ip_hlen = l4;
+	*len = ip_len;
+	return true;
+}
+
+int offload_gro_add(struct offload_gro *gro, const uint8_t *packet, size_t len) {
+	uint8_t *cur = gro->buf + OFFLOAD_VNET_HDR_LEN;
+	size_t ip_hlen, hlen, payload;
+
+	if (!gro_segment(packet, &len, &ip_hlen, &hlen))
+		return -1;
+	payload = len - hlen;
+
+	if (gro->len == 0) {
+		memcpy(cur, packet, len);
+		gro->len = len;
+		gro->ip_hlen = ip_hlen;
+		gro->hlen = hlen;
+		gro->gso_size = payload;
+		gro->next_seq = get_be32(packet + ip_hlen + 4) + (uint32_t)payload;
+		gro->count = 1;
+		return 0;
+	}
+
+	/* same flow and headers: addresses, ports, ACK number, header lengths and TCP options;
+	 * TOS/TTL for IPv4, traffic class/flow label/hop limit for IPv6 */
+	if (ip_hlen != gro->ip_hlen || hlen != gro->hlen)
+		return 1;
+	if (ip_hlen == 20) {
+		if (packet[1] != cur[1] || packet[8] != cur[8] || memcmp(packet + 12, cur + 12, 8) != 0)
+			return 1;
+	} else {
+		if (memcmp(packet, cur, 4) != 0 || packet[7] != cur[7] || memcmp(packet + 8, cur + 8, 32) != 0)
+			return 1;
+	}
+	if (memcmp(packet + ip_hlen, cur + ip_hlen, 4) != 0 ||				/* ports */
+		memcmp(packet + ip_hlen + 8, cur + ip_hlen + 8, 4) != 0 ||		/* ACK number */
+		memcmp(packet + ip_hlen + 20, cur + ip_hlen + 20, hlen - ip_hlen - 20) != 0)	/* options */
+		return 1;
+
+	/* in order, no larger than the first segment, after a full-size one without PSH, and it all still fits */
+	if (get_be32(packet + ip_hlen + 4) != gro->next_seq || payload > gro->gso_size ||
+		(gro->len - hlen) != gro->gso_size * (size_t)gro->count ||
+		(cur[ip_hlen + 13] & TCP_FLAG_PSH) ||
+		gro->len + payload > OFFLOAD_MAX_PACKET)
+		return 1;
+
+	memcpy(cur + gro->len, packet + hlen, payload);
+	gro->len += payload;
+	gro->next_seq += (uint32_t)payload;
+	gro->count++;
+	/* the merged packet carries the PSH of its last segment */
+	cur[ip_hlen + 13] |= packet[ip_hlen + 13] & TCP_FLAG_PSH;
+	return 0;
+}
+
+size_t offload_gro_finish(struct offload_gro *gro) {
+	struct virtio_net_hdr *vh = (struct virtio_net_hdr *)gro->buf;
+	uint8_t *cur = gro->buf + OFFLOAD_VNET_HDR_LEN;
+	size_t len = gro->len;
+	uint32_t sum;
+
+	if (len == 0)
+		return 0;
+	memset(vh, 0, sizeof(*vh));
+
+	if (gro->count > 1) {
+		if (gro->ip_hlen == 20) {
+			put_be16(cur + 2, (uint16_t)len);
+			put_be16(cur + 10, 0);
+			put_be16(cur + 10, csum_fold(csum_add(0, cur, 20)));
+			vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+		} else {
+			put_be16(cur + 4, (uint16_t)(len - 40));
+			vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+		}
+		/* the kernel completes the TCP checksum of each segment from the pseudo header sum */
+		sum = csum_pseudo(cur, IPPROTO_TCP, len - gro->ip_hlen);
+		put_be16(cur + gro->ip_hlen + 16, (uint16_t)~csum_fold(sum));
+		vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh->hdr_len = (uint16_t)gro->hlen;
+		vh->gso_size = (uint16_t)gro->gso_size;
+		vh->csum_start = (uint16_t)gro->ip_hlen;
+		vh->csum_offset = 16;
+	}
+
+	gro->len = 0;
+	gro->count = 0;
+	return OFFLOAD_VNET_HDR_LEN + len;
+}
@@ -0,0 +1,76 @@
+/*
+ * TUN offload mode: virtio-net headers and userspace segmentation
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _WG_OFFLOAD_H_
+#define _WG_OFFLOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/virtio_net.h>
+
+/* not in older kernel headers */
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4	5
+#endif
+
+/* every packet read from or written to the TUN device in offload mode starts with this */
+#define OFFLOAD_VNET_HDR_LEN	sizeof(struct virtio_net_hdr)
+
+/* largest packet the kernel hands over in offload mode */
+#define OFFLOAD_MAX_PACKET	65535
+
+/* called for each MTU-sized IP packet split out of a super-packet */
+typedef void (*offload_output_fn)(void *arg, uint8_t *packet, size_t len);
+
+/*
+ * Turn a packet read from the TUN device in offload mode (header stripped) into
+ * plain IP packets: a TSO/USO super-packet is split into gso_size segments with
+ * their own IP/TCP/UDP headers and checksums, a packet with a partial checksum
+ * is completed in place.
+ * Segments are built in seg_buf (seg_buf_len bytes) one at a time.
+ * Returns the number of packets passed to out, or -1 if the packet is malformed.
+ */
+int offload_segment(const struct virtio_net_hdr *vh, uint8_t *packet, size_t len,
+		uint8_t *seg_buf, size_t seg_buf_len, offload_output_fn out, void *arg);
+
+/*
+ * Receive side: consecutive in-order segments of one TCP flow are merged into
+ * a single GSO packet for the TUN device, so the host stack handles one
+ * packet instead of dozens
+ */
+struct offload_gro {
+	uint8_t *buf;		/* virtio-net header followed by the packet being built */
+	size_t len;		/* length of that packet, 0 if there is none */
+	size_t ip_hlen;
+	size_t hlen;		/* IP and TCP headers */
+	size_t gso_size;	/* payload of the first segment - all but the last must match */
+	uint32_t next_seq;
+	int count;
+};
+
+struct offload_gro *offload_gro_alloc(void);
+void offload_gro_free(struct offload_gro *gro);
+
+/*
+ * Add a decrypted IP packet (len may include WireGuard padding): it starts a
+ * new packet if none is being built, or is appended if it continues it.
+ * Returns 0 if it was taken, -1 if it is no TCP segment that can be merged
+ * (including one whose IPv4 header or TCP checksum does not verify), 1 if it
+ * cannot be added to the packet being built (finish that one first)
+ */
+int offload_gro_add(struct offload_gro *gro, const uint8_t *packet, size_t len);
+
+/*
+ * Complete the packet being built - lengths, checksums and the virtio-net
+ * header in front of it - and reset. Returns the length of the header and
+ * packet in gro->buf, 0 if nothing was being built
+ */
+size_t offload_gro_finish(struct offload_gro *gro);
+
+#endif /*_WG_OFFLOAD_H_*/
@@ -0,0 +1,513 @@
+/*
+ * Self-test of the TUN offload segmentation and GRO code
+ *
+ * The super-packets the kernel hands the TUN device in offload mode are built
+ * here from pseudo-random parameters: IPv4 and IPv6 (with or without an
+ * extension header), TCP with options and any of FIN/PSH/CWR, and UDP. Each one
+ * is split with offload_segment(), and every segment is checked against fields
+ * worked out here independently: lengths, IPv4 ID, TCP sequence number and
+ * flags, and the IPv4, TCP and UDP checksums. The GRO test feeds the segments
+ * of the same super-packets to the GRO code the way wireguardif_tun_write()
+ * does, and whatever it writes has to segment back into exactly the same
+ * packets. The rounds are reproducible from their seed.
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "wg_offload_selftest.h"
+#include "wg_offload.h"
+#include "lib/selftest_util.h"
+
+/* room for one tunnel packet, as the event loop gives offload_segment() */
+#define SELFTEST_SEG_BUF_LEN	1500
+#define SELFTEST_MAX_SEGMENTS	64
+
+#define TCP_FLAG_FIN	0x01
+#define TCP_FLAG_PSH	0x08
+#define TCP_FLAG_ACK	0x10
+#define TCP_FLAG_CWR	0x80
+
+/* a super-packet as read from the TUN device, and how it was built */
+struct selftest_packet {
+	struct virtio_net_hdr vh;
+	uint8_t data[OFFLOAD_MAX_PACKET];
+	size_t len;
+	int version;
+	uint8_t proto;
+	size_t l4;		/* IP header, with any IPv6 extension header */
+	size_t hlen;		/* IP and transport headers */
+	size_t mss;
+};
+
+/* the packets passed to the output function of offload_segment() */
+struct selftest_segments {
+	uint8_t data[SELFTEST_MAX_SEGMENTS][SELFTEST_SEG_BUF_LEN];
+	size_t len[SELFTEST_MAX_SEGMENTS];
+	int count;
+};
+
+/* GRO of one super-packet's segments: what was written to the TUN device, segmented again */
+struct selftest_gro_run {
+	const struct selftest_packet *p;
+	const struct selftest_segments *segs;
+	struct selftest_segments out;
+	bool whole;		/* every segment can be merged, so one packet must come out */
+	int writes;
+};
+
+static struct selftest_report selftest = { .name = "offload" };
+static uint8_t selftest_seg_buf[SELFTEST_SEG_BUF_LEN];
+
+static uint16_t get16(const uint8_t *p) {
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* one's complement sum folded to 16 bits - a header or segment with a valid checksum sums to 0xffff */
+static uint16_t selftest_sum(uint32_t sum, const uint8_t *data, size_t len) {
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += get16(data + i);
+	if (len & 1)
+		sum += (uint32_t)data[len - 1] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+static uint16_t selftest_pseudo(const uint8_t *ip, uint8_t proto, size_t l4_len) {
+	uint32_t sum = proto + (uint32_t)l4_len;
+
+	if ((ip[0] >> 4) == 4)
+		return selftest_sum(sum, ip + 12, 8);
+	return selftest_sum(sum, ip + 8, 32);
+}
+
+static bool selftest_l4_csum_ok(const uint8_t *ip, uint8_t proto, size_t l4, size_t len) {
+	return selftest_sum(selftest_pseudo(ip, proto, len - l4), ip + l4, len - l4) == 0xffff;
+}
+
+/*
+ * A super-packet of random addresses, ports, sequence numbers and payload, as
+ * the kernel would hand it over: valid IPv4 header checksum, the pseudo header
+ * sum in the transport checksum and a virtio-net header asking for segmentation
+ */
+static void selftest_build(struct selftest_packet *p, uint64_t *state, int version, uint8_t proto, bool ext, uint8_t flags) {
+	uint8_t *d = p->data;
+	size_t opt = 0, max;
+
+	p->version = version;
+	p->proto = proto;
+	p->l4 = (version == 4) ? 20 : (ext ? 48 : 40);
+	if (proto == IPPROTO_TCP)
+		opt = (selftest_next(state) % 11) * 4;
+	p->hlen = p->l4 + ((proto == IPPROTO_TCP) ? 20 + opt : 8);
+
+	/* mostly segments of a usual MTU, sometimes tiny ones; never more than SELFTEST_MAX_SEGMENTS */
+	if (selftest_next(state) & 3)
+		p->mss = SELFTEST_SEG_BUF_LEN - p->hlen - selftest_next(state) % 128;
+	else
+		p->mss = 1 + selftest_next(state) % (SELFTEST_SEG_BUF_LEN - p->hlen);
+	max = p->mss * SELFTEST_MAX_SEGMENTS;
+	if (max > OFFLOAD_MAX_PACKET - p->hlen)
+		max = OFFLOAD_MAX_PACKET - p->hlen;
+	p->len = p->hlen + 1 + selftest_next(state) % max;
+
+	selftest_fill(state, d, p->len);
+	if (version == 4) {
+		d[0] = 0x45;
+		put16(d + 2, (uint16_t)p->len);
+		put16(d + 6, 0x4000);			/* DF, no fragment */
+		d[9] = proto;
+		put16(d + 10, 0);
+		put16(d + 10, (uint16_t)~selftest_sum(0, d, 20));
+	} else {
+		d[0] = 0x60 | (d[0] & 0x0f);
+		put16(d + 4, (uint16_t)(p->len - 40));
+		if (ext) {
+			/* hop-by-hop options header holding only a PadN option */
+			d[6] = 0;
+			d[40] = proto;
+			d[41] = 0;
+			d[42] = 1;
+			d[43] = 4;
+			memset(d + 44, 0, 4);
+		} else {
+			d[6] = proto;
+		}
+	}
+
+	memset(&p->vh, 0, sizeof(p->vh));
+	p->vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	p->vh.hdr_len = (uint16_t)p->hlen;
+	p->vh.gso_size = (uint16_t)p->mss;
+	p->vh.csum_start = (uint16_t)p->l4;
+	if (proto == IPPROTO_TCP) {
+		d[p->l4 + 12] = (uint8_t)(((20 + opt) / 4) << 4);
+		d[p->l4 + 13] = flags;
+		put16(d + p->l4 + 16, selftest_pseudo(d, proto, p->len - p->l4));
+		p->vh.gso_type = (version == 4) ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		p->vh.csum_offset = 16;
+	} else {
+		put16(d + p->l4 + 4, (uint16_t)(p->len - p->l4));
+		put16(d + p->l4 + 6, selftest_pseudo(d, proto, p->len - p->l4));
+		p->vh.gso_type = VIRTIO_NET_HDR_GSO_UDP_L4;
+		p->vh.csum_offset = 6;
+	}
+}
+
+/* A super-packet of one of the kinds above, picked at random */
+static void selftest_random(struct selftest_packet *p, uint64_t *state) {
+	uint64_t r = selftest_next(state);
+	uint8_t flags;
+
+	/* mostly what GRO can merge back: ACK, sometimes PSH; now and then FIN or CWR */
+	flags = TCP_FLAG_ACK;
+	if (r & 0x10)
+		flags |= TCP_FLAG_PSH;
+	if ((r & 0x1e0) == 0)
+		flags |= TCP_FLAG_FIN;
+	if ((r & 0x1e00) == 0)
+		flags |= TCP_FLAG_CWR;
+	selftest_build(p, state, (r & 1) ? 6 : 4, (r & 6) ? IPPROTO_TCP : IPPROTO_UDP, (r & 8) == 0, flags);
+}
+
+static void selftest_collect(void *arg, uint8_t *packet, size_t len) {
+	struct selftest_segments *s = (struct selftest_segments *)arg;
+
+	if (s->count == SELFTEST_MAX_SEGMENTS || len > SELFTEST_SEG_BUF_LEN) {
+		selftest_fail(&selftest, "segment", "too many segments or one too long");
+		return;
+	}
+	memcpy(s->data[s->count], packet, len);
+	s->len[s->count] = len;
+	s->count++;
+}
+
+static int selftest_segment(const struct virtio_net_hdr *vh, uint8_t *packet, size_t len, struct selftest_segments *s) {
+	s->count = 0;
+	return offload_segment(vh, packet, len, selftest_seg_buf, sizeof(selftest_seg_buf), selftest_collect, s);
+}
+
+static void selftest_check_segments(const struct selftest_packet *p, const struct selftest_segments *s, int ret) {
+	const uint8_t *d = p->data, *seg;
+	size_t payload = p->len - p->hlen, l4 = p->l4;
+	size_t off, seg_len, len;
+	uint8_t flags;
+	int i;
+
+	if (ret != (int)((payload + p->mss - 1) / p->mss) || s->count != ret) {
+		selftest_fail(&selftest, "segment", "wrong number of segments");
+		return;
+	}
+	for (i = 0; i < s->count; i++) {
+		seg = s->data[i];
+		len = s->len[i];
+		off = (size_t)i * p->mss;
+		seg_len = (payload - off < p->mss) ? payload - off : p->mss;
+		if (len != p->hlen + seg_len || memcmp(seg + p->hlen, d + p->hlen + off, seg_len) != 0) {
+			selftest_fail(&selftest, "segment", "wrong length or payload");
+			continue;
+		}
+
+		if (p->version == 4) {
+			if (get16(seg + 2) != len || get16(seg + 4) != (uint16_t)(get16(d + 4) + i) ||
+				memcmp(seg, d, 2) != 0 || memcmp(seg + 6, d + 6, 4) != 0 || memcmp(seg + 12, d + 12, 8) != 0)
+				selftest_fail(&selftest, "IPv4 header", "wrong total length, ID or copied field");
+			if (selftest_sum(0, seg, 20) != 0xffff)
+				selftest_fail(&selftest, "IPv4 header", "bad checksum");
+		} else {
+			if (get16(seg + 4) != len - 40 || memcmp(seg, d, 4) != 0 || memcmp(seg + 6, d + 6, l4 - 6) != 0)
+				selftest_fail(&selftest, "IPv6 header", "wrong payload length or copied field");
+		}
+
+		if (p->proto == IPPROTO_TCP) {
+			/* FIN and PSH only on the last segment, CWR only on the first */
+			flags = d[l4 + 13];
+			if (i < s->count - 1)
+				flags &= (uint8_t)~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+			if (i > 0)
+				flags &= (uint8_t)~TCP_FLAG_CWR;
+			if (get32(seg + l4 + 4) != get32(d + l4 + 4) + (uint32_t)off)
+				selftest_fail(&selftest, "TCP header", "wrong sequence number");
+			if (seg[l4 + 13] != flags)
+				selftest_fail(&selftest, "TCP header", "wrong flags");
+			/* ports, ACK number and data offset, window, urgent pointer and options */
+			if (memcmp(seg + l4, d + l4, 4) != 0 || memcmp(seg + l4 + 8, d + l4 + 8, 5) != 0 ||
+				memcmp(seg + l4 + 14, d + l4 + 14, 2) != 0 || memcmp(seg + l4 + 18, d + l4 + 18, p->hlen - l4 - 18) != 0)
+				selftest_fail(&selftest, "TCP header", "wrong copied field");
+			if (!selftest_l4_csum_ok(seg, IPPROTO_TCP, l4, len))
+				selftest_fail(&selftest, "TCP header", "bad checksum");
+		} else {
+			if (get16(seg + l4 + 4) != len - l4 || memcmp(seg + l4, d + l4, 4) != 0)
+				selftest_fail(&selftest, "UDP header", "wrong length or ports");
+			if (get16(seg + l4 + 6) == 0 || !selftest_l4_csum_ok(seg, IPPROTO_UDP, l4, len))
+				selftest_fail(&selftest, "UDP header", "bad checksum");
+		}
+	}
+}
+
+/* A packet that is not segmented but whose checksum is left to us to finish */
+static void selftest_partial_csum(const struct selftest_packet *p, const struct selftest_segments *segs) {
+	static uint8_t packet[SELFTEST_SEG_BUF_LEN];
+	static struct selftest_segments out;
+	struct virtio_net_hdr vh;
+	size_t len = segs->len[0];
+	size_t field = p->l4 + ((p->proto == IPPROTO_TCP) ? 16 : 6);
+
+	memcpy(packet, segs->data[0], len);
+	put16(packet + field, selftest_pseudo(packet, p->proto, len - p->l4));
+	memset(&vh, 0, sizeof(vh));
+	vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh.csum_start = (uint16_t)p->l4;
+	vh.csum_offset = (uint16_t)(field - p->l4);
+
+	if (selftest_segment(&vh, packet, len, &out) != 1 || out.count != 1 || out.len[0] != len) {
+		selftest_fail(&selftest, "partial checksum", "packet not passed on as it is");
+		return;
+	}
+	if (memcmp(out.data[0], segs->data[0], field) != 0 || memcmp(out.data[0] + field + 2, segs->data[0] + field + 2, len - field - 2) != 0)
+		selftest_fail(&selftest, "partial checksum", "packet changed besides the checksum");
+	if (get16(out.data[0] + field) == 0 || !selftest_l4_csum_ok(out.data[0], p->proto, p->l4, len))
+		selftest_fail(&selftest, "partial checksum", "bad checksum");
+}
+
+/* Super-packets with one thing broken must be refused rather than segmented */
+static void selftest_malformed(struct selftest_packet *p, uint64_t *state) {
+	static struct selftest_segments out;
+	struct virtio_net_hdr vh;
+	uint8_t doff;
+	int version;
+
+	for (version = 4; version <= 6; version += 2) {
+		selftest_build(p, state, version, IPPROTO_TCP, false, TCP_FLAG_ACK);
+		doff = p->data[p->l4 + 12];
+		p->data[p->l4 + 12] = 4 << 4;
+		if (selftest_segment(&p->vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "TCP data offset below 5 accepted");
+		p->data[p->l4 + 12] = 0;
+		if (selftest_segment(&p->vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "TCP data offset 0 accepted");
+		p->data[p->l4 + 12] = doff;
+
+		vh = p->vh;
+		vh.gso_type = (version == 4) ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+		if (selftest_segment(&vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "TCP GSO type of the other IP version accepted");
+		vh = p->vh;
+		vh.gso_type = VIRTIO_NET_HDR_GSO_UDP;
+		if (selftest_segment(&vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "UFO accepted");
+		vh = p->vh;
+		vh.gso_size = 0;
+		if (selftest_segment(&vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "GSO size 0 accepted");
+		vh = p->vh;
+		vh.csum_start = (uint16_t)p->len;
+		if (selftest_segment(&vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "transport header past the end accepted");
+		vh = p->vh;
+		vh.csum_start = (uint16_t)(p->l4 + 4);
+		if (version == 4 && selftest_segment(&vh, p->data, p->len, &out) != -1)
+			selftest_fail(&selftest, "malformed", "transport header not after the IPv4 header accepted");
+		if (selftest_segment(&p->vh, p->data, p->len, &out) < 1)
+			selftest_fail(&selftest, "malformed", "valid packet refused");
+	}
+}
+
+int offload_selftest(unsigned long rounds, uint64_t seed) {
+	static struct selftest_packet p;
+	static struct selftest_segments segs;
+	uint64_t state = seed;
+	unsigned long i;
+	int ret;
+
+	selftest.failures = 0;
+
+	selftest_set_where(&selftest, "seed %llu, malformed packets", (unsigned long long)seed);
+	selftest_malformed(&p, &state);
+
+	for (i = 0; i < rounds; i++) {
+		selftest_set_where(&selftest, "seed %llu, round %lu", (unsigned long long)seed, i);
+		selftest_random(&p, &state);
+
+		ret = selftest_segment(&p.vh, p.data, p.len, &segs);
+		selftest_check_segments(&p, &segs, ret);
+		if (segs.count == 0)
+			continue;
+		selftest_partial_csum(&p, &segs);
+	}
+
+	return selftest.failures;
+}
+
+/* GRO */
+
+/* A packet written to the TUN device: checked if it has to be the whole super-packet, and segmented again */
+static void selftest_gro_write(struct selftest_gro_run *run, const struct virtio_net_hdr *vh, uint8_t *packet, size_t len) {
+	const struct selftest_packet *p = run->p;
+	static struct selftest_segments out;
+	struct virtio_net_hdr plain;
+	int i;
+
+	run->writes++;
+	memset(&plain, 0, sizeof(plain));
+	if (run->whole && run->segs->count > 1) {
+		if (vh->flags != VIRTIO_NET_HDR_F_NEEDS_CSUM ||
+			vh->gso_type != ((p->version == 4) ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6) ||
+			vh->gso_size != p->mss || vh->hdr_len != p->hlen || vh->csum_start != p->l4 || vh->csum_offset != 16)
+			selftest_fail(&selftest, "GRO", "wrong virtio-net header");
+		/* the same headers, with the pseudo header sum in the TCP checksum, and the same payload */
+		if (len != p->len || memcmp(packet, p->data, len) != 0)
+			selftest_fail(&selftest, "GRO", "merged packet is not the super-packet");
+	} else if (run->whole) {
+		if (memcmp(vh, &plain, sizeof(plain)) != 0 || len != run->segs->len[0] || memcmp(packet, run->segs->data[0], len) != 0)
+			selftest_fail(&selftest, "GRO", "single segment not written as it is");
+	}
+
+	if (selftest_segment(vh, packet, len, &out) < 0) {
+		selftest_fail(&selftest, "GRO", "written packet does not segment");
+		return;
+	}
+	for (i = 0; i < out.count && run->out.count < SELFTEST_MAX_SEGMENTS; i++) {
+		memcpy(run->out.data[run->out.count], out.data[i], out.len[i]);
+		run->out.len[run->out.count] = out.len[i];
+		run->out.count++;
+	}
+}
+
+/*
+ * Feed the segments to GRO as wireguardif_tun_write() does, WireGuard padding
+ * included: a packet that cannot be merged is written on its own after the one
+ * being built. Everything written must segment back into the same packets
+ */
+static void selftest_gro(const struct selftest_packet *p, const struct selftest_segments *segs, struct offload_gro *gro, uint64_t *state) {
+	static uint8_t buf[SELFTEST_SEG_BUF_LEN + 16];
+	static struct selftest_gro_run run;
+	struct virtio_net_hdr plain;
+	size_t pad, n;
+	int i, r;
+
+	run.p = p;
+	run.segs = segs;
+	run.out.count = 0;
+	run.writes = 0;
+	run.whole = p->proto == IPPROTO_TCP && p->l4 == ((p->version == 4) ? 20u : 40u) &&
+		(p->data[p->l4 + 13] & ~TCP_FLAG_PSH) == TCP_FLAG_ACK;
+	memset(&plain, 0, sizeof(plain));
+
+	for (i = 0; i < segs->count; i++) {
+		pad = selftest_next(state) % 16;
+		memcpy(buf, segs->data[i], segs->len[i]);
+		memset(buf + segs->len[i], 0, pad);
+		r = offload_gro_add(gro, buf, segs->len[i] + pad);
+		if (r > 0) {
+			n = offload_gro_finish(gro);
+			selftest_gro_write(&run, (struct virtio_net_hdr *)gro->buf, gro->buf + OFFLOAD_VNET_HDR_LEN, n - OFFLOAD_VNET_HDR_LEN);
+			if (offload_gro_add(gro, buf, segs->len[i] + pad) != 0)
+				selftest_fail(&selftest, "GRO", "segment refused after a flush");
+		} else if (r < 0) {
+			if (run.whole)
+				selftest_fail(&selftest, "GRO", "segment refused");
+			n = offload_gro_finish(gro);
+			if (n > 0)
+				selftest_gro_write(&run, (struct virtio_net_hdr *)gro->buf, gro->buf + OFFLOAD_VNET_HDR_LEN, n - OFFLOAD_VNET_HDR_LEN);
+			selftest_gro_write(&run, &plain, buf, segs->len[i]);
+		}
+	}
+	n = offload_gro_finish(gro);
+	if (n > 0)
+		selftest_gro_write(&run, (struct virtio_net_hdr *)gro->buf, gro->buf + OFFLOAD_VNET_HDR_LEN, n - OFFLOAD_VNET_HDR_LEN);
+
+	if (run.whole && run.writes != 1)
+		selftest_fail(&selftest, "GRO", "segments of one super-packet not merged into one");
+	if (run.out.count != segs->count) {
+		selftest_fail(&selftest, "GRO", "written packets segment into a different number of packets");
+		return;
+	}
+	for (i = 0; i < segs->count; i++) {
+		if (run.out.len[i] != segs->len[i] || memcmp(run.out.data[i], segs->data[i], segs->len[i]) != 0) {
+			selftest_fail(&selftest, "GRO", "written packets segment into different packets");
+			return;
+		}
+	}
+}
+
+/* GRO merges in-order ACK/PSH segments with valid checksums only */
+static void selftest_gro_malformed(struct selftest_packet *p, struct offload_gro *gro, uint64_t *state) {
+	static struct selftest_segments out;
+	static uint8_t buf[SELFTEST_SEG_BUF_LEN];
+	int version;
+
+	for (version = 4; version <= 6; version += 2) {
+		selftest_build(p, state, version, IPPROTO_TCP, false, TCP_FLAG_ACK);
+		if (selftest_segment(&p->vh, p->data, p->len, &out) < 1 || out.count < 3)
+			continue;
+		if (offload_gro_add(gro, out.data[0], out.len[0]) != 0 || offload_gro_add(gro, out.data[2], out.len[2]) != 1)
+			selftest_fail(&selftest, "GRO", "segment out of order merged");
+		offload_gro_finish(gro);
+		memcpy(buf, out.data[1], out.len[1]);
+		buf[p->l4 + 13] |= TCP_FLAG_FIN;
+		if (offload_gro_add(gro, buf, out.len[1]) != -1)
+			selftest_fail(&selftest, "GRO", "took a FIN segment");
+		memcpy(buf, out.data[1], out.len[1]);
+		buf[p->l4 + 12] = 4 << 4;
+		if (offload_gro_add(gro, buf, out.len[1]) != -1)
+			selftest_fail(&selftest, "GRO", "took a TCP data offset below 5");
+		memcpy(buf, out.data[1], out.len[1]);
+		buf[out.len[1] - 1] ^= 0x01;
+		if (offload_gro_add(gro, buf, out.len[1]) != -1)
+			selftest_fail(&selftest, "GRO", "took a segment with a bad TCP checksum");
+		memcpy(buf, out.data[1], out.len[1]);
+		buf[8] ^= 0x01;
+		if (version == 4 && offload_gro_add(gro, buf, out.len[1]) != -1)
+			selftest_fail(&selftest, "GRO", "took a segment with a bad IPv4 header checksum");
+		offload_gro_finish(gro);
+	}
+}
+
+int offload_gro_selftest(unsigned long rounds, uint64_t seed) {
+	static struct selftest_packet p;
+	static struct selftest_segments segs;
+	struct offload_gro *gro;
+	uint64_t state = seed;
+	unsigned long i;
+
+	selftest.failures = 0;
+	gro = offload_gro_alloc();
+	if (gro == NULL) {
+		fprintf(stderr, "offload selftest: out of memory\n");
+		return 1;
+	}
+
+	selftest_set_where(&selftest, "seed %llu, malformed segments", (unsigned long long)seed);
+	selftest_gro_malformed(&p, gro, &state);
+
+	for (i = 0; i < rounds; i++) {
+		selftest_set_where(&selftest, "seed %llu, round %lu", (unsigned long long)seed, i);
+		selftest_random(&p, &state);
+		if (selftest_segment(&p.vh, p.data, p.len, &segs) < 1)
+			continue;
+		selftest_gro(&p, &segs, gro, &state);
+	}
+
+	offload_gro_free(gro);
+	return selftest.failures;
+}
@@ -0,0 +1,30 @@
+/*
+ * Self-test of the TUN offload segmentation and GRO code
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _WG_OFFLOAD_SELFTEST_H_
+#define _WG_OFFLOAD_SELFTEST_H_
+
+#include <stdint.h>
+
+/*
+ * Checks that malformed super-packets are refused, then splits "rounds"
+ * pseudo-random IPv4/IPv6 TCP and UDP super-packets with offload_segment().
+ * The same seed reproduces the same rounds. Failures are reported on stderr;
+ * returns their number.
+ */
+int offload_selftest(unsigned long rounds, uint64_t seed);
+
+/*
+ * Checks that GRO refuses segments it must not merge, then splits "rounds"
+ * pseudo-random super-packets as offload_selftest() does and merges the
+ * segments back with offload_gro_add(): what is written to the TUN device has
+ * to segment back into the same packets. Returns the number of failures.
+ */
+int offload_gro_selftest(unsigned long rounds, uint64_t seed);
+
+#endif /*_WG_OFFLOAD_SELFTEST_H_*/
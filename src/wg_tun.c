@@ -23,6 +23,15 @@
 
 static char *device;
 
+/* set by init_tun() when the device is in offload mode (IFF_VNET_HDR) */
+int tun_vnet_hdr = 0;
+
+/* not in older kernel headers */
+#ifndef TUN_F_USO4
+#define TUN_F_USO4	0x20
+#define TUN_F_USO6	0x40
+#endif
+
 const char *tun_default_up[] = {
 	"ifconfig %D %V mtu %M up",
 	"ip route replace %N via %V || route add -net %N gw %V",
@@ -145,20 +154,52 @@ void exec_down(const char *device) {
 }
 
 /*
- * Open a new TUN virtual interface
- * Bind it to config.vpnIP
+ * Open one queue of the TUN interface in ifr: the first call creates the
+ * interface and writes its name back into ifr, the others attach to it
  */
-int init_tun() {
+static int open_tun_queue(struct ifreq *ifr) {
 	int tunfd;
-	struct ifreq ifr;           // interface request used to open the TUN device
 
-	/* Open TUN interface */
-	log_message_level(1, "TUN interface initialization");
-	if( (tunfd = open("/dev/net/tun", O_RDWR)) < 0 ) {
+	if( (tunfd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0 ) {
 		log_error(errno, "Could not open /dev/net/tun");
 		return -1;
 	}
 
+	if ((ioctl(tunfd, TUNSETIFF, (void *) ifr)) < 0) {
+		log_error(errno, "Error ioctl TUNSETIFF");
+		close(tunfd);
+		return -1;
+	}
+	if ((ioctl(tunfd, TUNSETNOCSUM, 1)) < 0) {
+		log_error(errno, "Error ioctl TUNSETNOCSUM");
+		close(tunfd);
+		return -1;
+	}
+
+	/* Offload mode: the kernel may hand us TCP/UDP super-packets and unfinished
+	 * checksums, comm_tun segments them. USO needs Linux 6.2, try without it */
+	if (config.tun_offload) {
+		tun_vnet_hdr = 1;
+		if (ioctl(tunfd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_USO4 | TUN_F_USO6) < 0 &&
+			ioctl(tunfd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0) {
+			log_error(errno, "Error ioctl TUNSETOFFLOAD, no TUN offloads");
+		}
+	}
+	return tunfd;
+}
+
+/*
+ * Open a new TUN virtual interface with count queues, their descriptors in fds
+ * Bind it to config.vpnIP
+ * Returns 0, or -1 after closing the queues already opened
+ */
+int init_tun(int *fds, int count) {
+	struct ifreq ifr;           // interface request used to open the TUN device
+	int i;
+
+	/* Open TUN interface */
+	log_message_level(1, "TUN interface initialization (%d queues)", count);
+
 	memset(&ifr, 0, sizeof(ifr));
 
 	/* IFF_TUN       - TUN device (no Ethernet headers)
@@ -167,6 +208,13 @@ int init_tun() {
 	   will only use its internal queue.
 	 */
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	/* IFF_VNET_HDR  - Every packet carries a virtio-net header (offload mode) */
+	if (config.tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	/* IFF_MULTI_QUEUE - One descriptor per queue, the kernel picks the queue
+	   of a packet by its flow */
+	if (count > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
 	if (config.tun_device != NULL) {
 		strncpy(ifr.ifr_name, config.tun_device, IFNAMSIZ);
@@ -176,15 +224,15 @@ int init_tun() {
 		strncpy(ifr.ifr_name, "tun%d", IFNAMSIZ);
 	}
 
-	if ((ioctl(tunfd, TUNSETIFF, (void *) &ifr)) < 0) {
-		log_error(errno, "Error ioctl TUNSETIFF");
-		close(tunfd);
-		return -1;
-	}
-	if ((ioctl(tunfd, TUNSETNOCSUM, 1)) < 0) {
-		log_error(errno, "Error ioctl TUNSETNOCSUM");
-		close(tunfd);
-		return -1;
+	for (i = 0; i < count; i++) {
+		fds[i] = open_tun_queue(&ifr);
+		if (fds[i] < 0) {
+			while (i-- > 0) {
+				close(fds[i]);
+				fds[i] = -1;
+			}
+			return -1;
+		}
 	}
 
 #if 0
@@ -213,11 +261,20 @@ int init_tun() {
 			config.tun_mtu);
 	exec_up(device);
 
-	return tunfd;
+	return 0;
 }
 
-int close_tun(int fd) {
-	exec_down(device);
-	free(device);
-	return close(fd); // the close call destroys the device
+void close_tun(int *fds, int count) {
+	int i;
+
+	if (device != NULL) {
+		exec_down(device);
+		free(device);
+		device = NULL;
+	}
+	/* closing the last queue destroys the device */
+	for (i = 0; i < count; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
 }
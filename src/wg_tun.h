@@ -8,30 +8,53 @@
 #define _WG_TUN_H_
 
 #include <errno.h>
+#include <sys/uio.h>
 #include "wg_main.h"
+#include "wg_offload.h"
 #include "lib/log.h"
 
-extern int init_tun(void);
-extern int close_tun(int fd);
+extern int init_tun(int *fds, int count);
+extern void close_tun(int *fds, int count);
 
 extern void exec_up(const char *device);
 extern void exec_down(const char *device);
 extern const char *tun_default_up[];
 extern const char *tun_default_down[];
+/* non-zero when every packet on the device carries a virtio-net header */
+extern int tun_vnet_hdr;
 
+/* the device is non-blocking: returns -1 once there is nothing left to read */
 static inline ssize_t read_tun(int fd, void *buf, size_t count) {
     ssize_t r;
     r = read(fd, buf, count);
     if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return -1;
         log_error(errno, "Error while reading the tun device");
         abort();
     }
     return r;
 }
 
-static inline ssize_t write_tun(int fd, const void *buf, size_t count) {
+/* in offload mode buf is written behind vh - or an empty header if vh is NULL */
+static inline ssize_t write_tun_vnet(int fd, const struct virtio_net_hdr *vh, const void *buf, size_t count) {
+    struct virtio_net_hdr none;
+    struct iovec iov[2];
     ssize_t r;
-    r = write(fd, buf, count);
+
+    if (tun_vnet_hdr) {
+        if (vh == NULL) {
+            memset(&none, 0, sizeof(none));
+            vh = &none;
+        }
+        iov[0].iov_base = (void *)vh;
+        iov[0].iov_len = OFFLOAD_VNET_HDR_LEN;
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = count;
+        r = writev(fd, iov, 2);
+    } else {
+        r = write(fd, buf, count);
+    }
     if (r == -1) {
         log_error(errno, "Error while writting to the tun device");
         abort();
@@ -39,4 +62,8 @@ static inline ssize_t write_tun(int fd, const void *buf, size_t count) {
     return r;
 }
 
+static inline ssize_t write_tun(int fd, const void *buf, size_t count) {
+    return write_tun_vnet(fd, NULL, buf, count);
+}
+
 #endif /*_WG_TUN_H_*/
@@ -0,0 +1,18 @@
+/*
+ * Parts of wireguard.c not meant for the interface code - for the benchmarks
+ *
+ * Copyright (c) 2024 Chunghan Yi <chunghan.yi@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _WIREGUARD_INTERNAL_H_
+#define _WIREGUARD_INTERNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 5.4 KDF2: tau1 and tau2 (WIREGUARD_HASH_LEN bytes each) from chaining_key and data
+void wireguard_kdf2(uint8_t *tau1, uint8_t *tau2, const uint8_t *chaining_key, const uint8_t *data, size_t data_len);
+
+#endif /* _WIREGUARD_INTERNAL_H_ */
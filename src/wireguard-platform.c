@@ -39,20 +39,37 @@
 #include <stdlib.h>
 
 #include "crypto.h"
+#include "wg_keypool.h"
 #include <sys/time.h>
+#include <sys/random.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
 
 // This file contains a sample Wireguard platform integration
 
-// DO NOT USE THIS FUNCTION - IMPLEMENT A BETTER RANDOM BYTE GENERATOR IN YOUR IMPLEMENTATION
+// Kernel CSPRNG - safe to call from the keypool thread and the handshake concurrently, unlike rand()
 void wireguard_random_bytes(void *bytes, size_t size) {
-	srand(time(NULL));
-	for (unsigned int i=0; i<size; i++) {
-		((char *)bytes)[i] = rand() % size;
+	uint8_t *p = (uint8_t *)bytes;
+	ssize_t n;
+
+	while (size > 0) {
+		n = getrandom(p, size, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			abort();
+		}
+		p += n;
+		size -= n;
 	}
 }
 
+bool wireguard_pregenerated_keypair(uint8_t *private_key, uint8_t *public_key) {
+	return wg_keypool_pop(private_key, public_key);
+}
+
 uint32_t wireguard_sys_now() {
 	struct timeval te;
 	gettimeofday(&te, NULL); // get current time
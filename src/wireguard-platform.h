@@ -54,6 +54,10 @@ uint32_t wireguard_sys_now();
 // Fill the supplied buffer with random data - random data is used for generating new session keys periodically
 void wireguard_random_bytes(void *bytes, size_t size);
 
+// Supply a ready-made ephemeral keypair (clamped private key and its public key) for a handshake, which must
+// never be handed out again - return false if none is available and the keypair will be generated inline
+bool wireguard_pregenerated_keypair(uint8_t *private_key, uint8_t *public_key);
+
 // Get the current time in tai64n format - 8 byte seconds, 4 byte nano sub-second - see https://cr.yp.to/libtai/tai64.html for details
 // Output buffer passed is 12 bytes
 // The Wireguard implementation doesn't strictly need this to be a time, but instead an increasing value
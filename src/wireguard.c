@@ -31,6 +31,7 @@
  */
 
 #include "wireguard.h"
+#include "wireguard-internal.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -68,6 +69,8 @@ void wireguard_init() {
 	wireguard_blake2s_update(&ctx, construction_hash, sizeof(construction_hash));
 	wireguard_blake2s_update(&ctx, IDENTIFIER, sizeof(IDENTIFIER));
 	wireguard_blake2s_final(&ctx, identifier_hash);
+	// Build the fixed-base table used for ephemeral (and static) public keys
+	wireguard_x25519_base_init();
 }
 
 struct wireguard_peer *peer_alloc(struct wireguard_device *device) {
@@ -212,10 +215,15 @@ static void wireguard_mix_hash(uint8_t *hash, const uint8_t *src, size_t src_len
 	wireguard_blake2s_final(&ctx, hash);
 }
 
-static void wireguard_hmac(uint8_t *digest, const uint8_t *key, size_t key_len,
-	const uint8_t *text, size_t text_len) {
+// HMAC-BLAKE2s key schedule: the inner and outer hash states with their key pad blocks already compressed, so that
+// every HMAC under the same key (as the tau1..tau3 expansion in the KDFs) just clones them
+struct wireguard_hmac_key {
+	wireguard_blake2s_ctx inner;
+	wireguard_blake2s_ctx outer;
+};
+
+static void wireguard_hmac_key_init(struct wireguard_hmac_key *hkey, const uint8_t *key, size_t key_len) {
 	// Adapted from appendix example in RFC2104 to use BLAKE2S instead of MD5 - https://tools.ietf.org/html/rfc2104
-	wireguard_blake2s_ctx ctx;
 	uint8_t k_ipad[WIREGUARD_BLAKE2S_BLOCK_SIZE]; // inner padding - key XORd with ipad
 	uint8_t k_opad[WIREGUARD_BLAKE2S_BLOCK_SIZE]; // outer padding - key XORd with opad
 
@@ -248,17 +256,49 @@ static void wireguard_hmac(uint8_t *digest, const uint8_t *key, size_t key_len,
 		k_ipad[i] ^= 0x36;
 		k_opad[i] ^= 0x5c;
 	}
+	// Both passes start with a pad block - hash those once here
+	wireguard_blake2s_init(&hkey->inner, WIREGUARD_HASH_LEN, NULL, 0);
+	wireguard_blake2s_update(&hkey->inner, k_ipad, WIREGUARD_BLAKE2S_BLOCK_SIZE);
+	wireguard_blake2s_init(&hkey->outer, WIREGUARD_HASH_LEN, NULL, 0);
+	wireguard_blake2s_update(&hkey->outer, k_opad, WIREGUARD_BLAKE2S_BLOCK_SIZE);
+	// The outer pass is always followed by the inner digest; the inner one only if there is text (see wireguard_hmac)
+	wireguard_blake2s_compress_pending(&hkey->outer);
+
+	crypto_zero(k_ipad, sizeof(k_ipad));
+	crypto_zero(k_opad, sizeof(k_opad));
+	crypto_zero(tk, sizeof(tk));
+}
+
+// Compress the inner pad too - only for keys whose every HMAC has non-empty text
+static void wireguard_hmac_key_init_nonempty(struct wireguard_hmac_key *hkey, const uint8_t *key, size_t key_len) {
+	wireguard_hmac_key_init(hkey, key, key_len);
+	wireguard_blake2s_compress_pending(&hkey->inner);
+}
+
+static void wireguard_hmac_keyed(uint8_t *digest, const struct wireguard_hmac_key *hkey,
+	const uint8_t *text, size_t text_len) {
+	wireguard_blake2s_ctx ctx;
+
 	// perform inner HASH
-	wireguard_blake2s_init(&ctx, WIREGUARD_HASH_LEN, NULL, 0); // init context for 1st pass
-	wireguard_blake2s_update(&ctx, k_ipad, WIREGUARD_BLAKE2S_BLOCK_SIZE); // start with inner pad
+	ctx = hkey->inner; // start with inner pad
 	wireguard_blake2s_update(&ctx, text, text_len); // then text of datagram
 	wireguard_blake2s_final(&ctx, digest); // finish up 1st pass
 
 	// perform outer HASH
-	wireguard_blake2s_init(&ctx, WIREGUARD_HASH_LEN, NULL, 0); // init context for 2nd pass
-	wireguard_blake2s_update(&ctx, k_opad, WIREGUARD_BLAKE2S_BLOCK_SIZE); // start with outer pad
+	ctx = hkey->outer; // start with outer pad
 	wireguard_blake2s_update(&ctx, digest, WIREGUARD_HASH_LEN); // then results of 1st hash
 	wireguard_blake2s_final(&ctx, digest); // finish up 2nd pass
+
+	crypto_zero(&ctx, sizeof(ctx));
+}
+
+static void wireguard_hmac(uint8_t *digest, const uint8_t *key, size_t key_len,
+	const uint8_t *text, size_t text_len) {
+	struct wireguard_hmac_key hkey;
+
+	wireguard_hmac_key_init(&hkey, key, key_len);
+	wireguard_hmac_keyed(digest, &hkey, text, text_len);
+	crypto_zero(&hkey, sizeof(hkey));
 }
 
 static void wireguard_kdf1(uint8_t *tau1, const uint8_t *chaining_key, const uint8_t *data, size_t data_len) {
@@ -277,97 +317,99 @@ static void wireguard_kdf1(uint8_t *tau1, const uint8_t *chaining_key, const uin
 	crypto_zero(output, sizeof(output));
 }
 
-static void wireguard_kdf2(uint8_t *tau1, uint8_t *tau2, const uint8_t *chaining_key,
+void wireguard_kdf2(uint8_t *tau1, uint8_t *tau2, const uint8_t *chaining_key,
 	const uint8_t *data, size_t data_len) {
 	uint8_t tau0[WIREGUARD_HASH_LEN];
 	uint8_t output[WIREGUARD_HASH_LEN + 1];
+	struct wireguard_hmac_key hkey;
 
 	// tau0 = Hmac(key, input)
 	wireguard_hmac(tau0, chaining_key, WIREGUARD_HASH_LEN, data, data_len);
+	// tau1 and tau2 are both keyed with tau0
+	wireguard_hmac_key_init_nonempty(&hkey, tau0, WIREGUARD_HASH_LEN);
 	// tau1 := Hmac(tau0, 0x1)
 	output[0] = 1;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, 1);
+	wireguard_hmac_keyed(output, &hkey, output, 1);
 	memcpy(tau1, output, WIREGUARD_HASH_LEN);
 
 	// tau2 := Hmac(tau0,tau1 || 0x2)
 	output[WIREGUARD_HASH_LEN] = 2;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_keyed(output, &hkey, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau2, output, WIREGUARD_HASH_LEN);
 
 	// Wipe intermediates
 	crypto_zero(tau0, sizeof(tau0));
 	crypto_zero(output, sizeof(output));
+	crypto_zero(&hkey, sizeof(hkey));
 }
 
 static void wireguard_kdf3(uint8_t *tau1, uint8_t *tau2, uint8_t *tau3, const uint8_t *chaining_key,
 	const uint8_t *data, size_t data_len) {
 	uint8_t tau0[WIREGUARD_HASH_LEN];
 	uint8_t output[WIREGUARD_HASH_LEN + 1];
+	struct wireguard_hmac_key hkey;
 
 	// tau0 = Hmac(key, input)
 	wireguard_hmac(tau0, chaining_key, WIREGUARD_HASH_LEN, data, data_len);
+	// tau1, tau2 and tau3 are all keyed with tau0
+	wireguard_hmac_key_init_nonempty(&hkey, tau0, WIREGUARD_HASH_LEN);
 	// tau1 := Hmac(tau0, 0x1)
 	output[0] = 1;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, 1);
+	wireguard_hmac_keyed(output, &hkey, output, 1);
 	memcpy(tau1, output, WIREGUARD_HASH_LEN);
 
 	// tau2 := Hmac(tau0,tau1 || 0x2)
 	output[WIREGUARD_HASH_LEN] = 2;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_keyed(output, &hkey, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau2, output, WIREGUARD_HASH_LEN);
 
 	// tau3 := Hmac(tau0,tau1,tau2 || 0x3)
 	output[WIREGUARD_HASH_LEN] = 3;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_keyed(output, &hkey, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau3, output, WIREGUARD_HASH_LEN);
 
 	// Wipe intermediates
 	crypto_zero(tau0, sizeof(tau0));
 	crypto_zero(output, sizeof(output));
+	crypto_zero(&hkey, sizeof(hkey));
 }
 
 bool wireguard_check_replay(struct wireguard_keypair *keypair, uint64_t seq) {
-	// Implementation of packet replay window - as per RFC2401
-	// Adapted from code in Appendix C at https://tools.ietf.org/html/rfc2401
-	uint32_t diff;
-	bool result = false;
-	size_t ReplayWindowSize = sizeof(keypair->replay_bitmap); // 32 bits
-
-	if (seq != 0) {
-		if (seq > keypair->replay_counter) {
-			// new larger sequence number
-			diff = seq - keypair->replay_counter;
-			if (diff < ReplayWindowSize) {
-				// In window
-				keypair->replay_bitmap <<= diff;
-				// set bit for this packet
-				keypair->replay_bitmap |= 1;
-			} else {
-				// This packet has a "way larger"
-				keypair->replay_bitmap = 1;
-			}
-			keypair->replay_counter = seq;
-			// larger is good
-			result = true;
-		} else {
-			diff = keypair->replay_counter - seq;
-			if (diff < ReplayWindowSize) {
-				if (keypair->replay_bitmap & ((uint32_t)1 << diff)) {
-					// already seen
-				} else {
-					// mark as seen
-					keypair->replay_bitmap |= ((uint32_t)1 << diff);
-					// out of order but good
-					result = true;
-				}
-			} else {
-				// too old or wrapped
-			}
+	// Sliding window as per RFC 6479 - the bitmap is a ring of words, so moving the window forward only clears the
+	// words it moves into however far it jumps
+	// Counters are kept plus one so that 0, the first one sent, is valid too
+	uint64_t counter = seq + 1;
+	uint64_t word = counter / 64;
+	uint64_t newest = keypair->replay_counter / 64;
+	uint64_t bit = (uint64_t)1 << (counter % 64);
+	uint64_t top, i;
+
+	if (seq >= REJECT_AFTER_MESSAGES) {
+		return false;
+	}
+	if (counter + WIREGUARD_REPLAY_WINDOW < keypair->replay_counter) {
+		// too old
+		return false;
+	}
+	if (counter > keypair->replay_counter) {
+		// new larger sequence number - clear the words between the newest one and this one
+		top = word - newest;
+		if (top > WIREGUARD_REPLAY_WORDS) {
+			top = WIREGUARD_REPLAY_WORDS;
 		}
-	} else {
-		// first == 0 or wrapped
+		for (i = 1; i <= top; i++) {
+			keypair->replay_bitmap[(newest + i) % WIREGUARD_REPLAY_WORDS] = 0;
+		}
+		keypair->replay_counter = counter;
 	}
-	return result;
+	word %= WIREGUARD_REPLAY_WORDS;
+	if (keypair->replay_bitmap[word] & bit) {
+		// already seen
+		return false;
+	}
+	// mark as seen - in order or not, it is good
+	keypair->replay_bitmap[word] |= bit;
+	return true;
 }
 
 struct wireguard_keypair *get_peer_keypair_for_idx(struct wireguard_peer *peer, uint32_t idx) {
@@ -420,15 +462,27 @@ static void wireguard_generate_private_key(uint8_t *key) {
 }
 
 static bool wireguard_generate_public_key(uint8_t *public_key, const uint8_t *private_key) {
-	static const uint8_t basepoint[WIREGUARD_PUBLIC_KEY_LEN] = { 9 };
 	bool result = false;
 
 	if (memcmp(private_key, zero_key, WIREGUARD_PUBLIC_KEY_LEN) != 0) {
-		result = (wireguard_x25519(public_key, private_key, basepoint) == 0);
+		result = (wireguard_x25519_base(public_key, private_key) == 0);
 	}
 	return result;
 }
 
+bool wireguard_generate_keypair(uint8_t *private_key, uint8_t *public_key) {
+	wireguard_generate_private_key(private_key);
+	return wireguard_generate_public_key(public_key, private_key);
+}
+
+// (Epriv, Epub) := DH-Generate() - from the platform's pre-generated pool when it has one ready
+static bool wireguard_generate_ephemeral_keypair(uint8_t *private_key, uint8_t *public_key) {
+	if (wireguard_pregenerated_keypair(private_key, public_key)) {
+		return true;
+	}
+	return wireguard_generate_keypair(private_key, public_key);
+}
+
 bool wireguard_check_mac1(struct wireguard_device *device, const uint8_t *data, size_t len, const uint8_t *mac1) {
 	bool result = false;
 	uint8_t calculated[WIREGUARD_COOKIE_LEN];
@@ -440,6 +494,30 @@ bool wireguard_check_mac1(struct wireguard_device *device, const uint8_t *data,
 	return result;
 }
 
+// As wireguard_check_mac1 for count messages of the same length (e.g. a batch of received initiations), hashed
+// WIREGUARD_BLAKE2S_LANES at a time - valid[i] is set for each message whose mac1 matches
+void wireguard_check_mac1_batch(struct wireguard_device *device, const uint8_t *const data[], size_t len,
+	const uint8_t *const mac1[], bool *valid, size_t count) {
+	uint8_t calculated[WIREGUARD_BLAKE2S_LANES][WIREGUARD_COOKIE_LEN];
+	uint8_t *out[WIREGUARD_BLAKE2S_LANES];
+	size_t i, n;
+
+	for (i = 0; i < WIREGUARD_BLAKE2S_LANES; i++) {
+		out[i] = calculated[i];
+	}
+	while (count > 0) {
+		n = (count < WIREGUARD_BLAKE2S_LANES) ? count : WIREGUARD_BLAKE2S_LANES;
+		wireguard_blake2s_many(out, WIREGUARD_COOKIE_LEN, device->label_mac1_key, WIREGUARD_SESSION_KEY_LEN, data, len, n);
+		for (i = 0; i < n; i++) {
+			valid[i] = crypto_equal(calculated[i], mac1[i], WIREGUARD_COOKIE_LEN);
+		}
+		data += n;
+		mac1 += n;
+		valid += n;
+		count -= n;
+	}
+}
+
 bool wireguard_check_mac2(struct wireguard_device *device, const uint8_t *data, size_t len,
 	uint8_t *source_addr_port, size_t source_length, const uint8_t *mac2) {
 	bool result = false;
@@ -456,6 +534,7 @@ bool wireguard_check_mac2(struct wireguard_device *device, const uint8_t *data,
 }
 
 void keypair_destroy(struct wireguard_keypair *keypair) {
+	// Wipes the expanded key state along with the raw keys
 	crypto_zero(keypair, sizeof(struct wireguard_keypair));
 	keypair->valid = false;
 }
@@ -483,6 +562,7 @@ static void add_new_keypair(struct wireguard_peer *peer, struct wireguard_keypai
 		peer->next_keypair =  new_keypair;
 		keypair_destroy(&peer->prev_keypair);
 	}
+	crypto_zero(&new_keypair, sizeof(new_keypair));
 }
 
 void wireguard_start_session(struct wireguard_peer *peer, bool initiator) {
@@ -505,8 +585,10 @@ void wireguard_start_session(struct wireguard_peer *peer, bool initiator) {
 	} else {
 		wireguard_kdf2(new_keypair.receiving_key, new_keypair.sending_key, handshake->chaining_key, NULL, 0);
 	}
+	wireguard_aead_init_ctx(&new_keypair.sending_ctx, new_keypair.sending_key);
+	wireguard_aead_init_ctx(&new_keypair.receiving_ctx, new_keypair.receiving_key);
 
-	new_keypair.replay_bitmap = 0;
+	memset(new_keypair.replay_bitmap, 0, sizeof(new_keypair.replay_bitmap));
 	new_keypair.replay_counter = 0;
 
 	new_keypair.last_tx = 0;
@@ -524,6 +606,9 @@ void wireguard_start_session(struct wireguard_peer *peer, bool initiator) {
 	handshake->valid = false;
 
 	add_new_keypair(peer, new_keypair);
+
+	// The keys now live in the peer - leave no copy on the stack
+	crypto_zero(&new_keypair, sizeof(new_keypair));
 }
 
 uint8_t wireguard_get_message_type(const uint8_t *data, size_t len) {
@@ -796,8 +881,7 @@ bool wireguard_create_handshake_initiation(struct wireguard_device *device, stru
 	wireguard_mix_hash(handshake->hash, peer->public_key, WIREGUARD_PUBLIC_KEY_LEN);
 
 	// (Eprivi, Epubi) := DH-Generate()
-	wireguard_generate_private_key(handshake->ephemeral_private);
-	if (wireguard_generate_public_key(dst->ephemeral, handshake->ephemeral_private)) {
+	if (wireguard_generate_ephemeral_keypair(handshake->ephemeral_private, dst->ephemeral)) {
 
 		// Ci := Kdf1(Ci, Epubi)
 		wireguard_kdf1(handshake->chaining_key, handshake->chaining_key, dst->ephemeral, WIREGUARD_PUBLIC_KEY_LEN);
@@ -878,8 +962,7 @@ bool wireguard_create_handshake_response(struct wireguard_device *device, struct
 	if (handshake->valid && !handshake->initiator) {
 
 		// (Eprivr, Epubr) := DH-Generate()
-		wireguard_generate_private_key(handshake->ephemeral_private);
-		if (wireguard_generate_public_key(dst->ephemeral, handshake->ephemeral_private)) {
+		if (wireguard_generate_ephemeral_keypair(handshake->ephemeral_private, dst->ephemeral)) {
 
 			// Cr := Kdf1(Cr,Epubr)
 			wireguard_kdf1(handshake->chaining_key, handshake->chaining_key, dst->ephemeral, WIREGUARD_PUBLIC_KEY_LEN);
@@ -1021,14 +1104,36 @@ bool wireguard_device_init(struct wireguard_device *device, const uint8_t *priva
 	return device->valid;
 }
 
+// Called with netif->lock held, which also guards sending_counter
 void wireguard_encrypt_packet(uint8_t *dst, const uint8_t *src, size_t src_len, struct wireguard_keypair *keypair) {
-	wireguard_aead_encrypt(dst, src, src_len, NULL, 0, keypair->sending_counter, keypair->sending_key);
+	wireguard_aead_encrypt_ctx(dst, src, src_len, NULL, 0, keypair->sending_counter, &keypair->sending_ctx);
 	keypair->sending_counter++;
 }
 
 bool wireguard_decrypt_packet(uint8_t *dst, const uint8_t *src, size_t src_len, uint64_t counter,
 	struct wireguard_keypair *keypair) {
-	return wireguard_aead_decrypt(dst, src, src_len, NULL, 0, counter, keypair->receiving_key);
+	return wireguard_aead_decrypt_ctx(dst, src, src_len, NULL, 0, counter, &keypair->receiving_ctx);
+}
+
+void wireguard_encrypt_packets_ctx(wireguard_aead_batch *packets, size_t count, uint64_t counter, const wireguard_aead_ctx *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		packets[i].ad = NULL;
+		packets[i].ad_len = 0;
+		packets[i].nonce = counter + i;
+	}
+	wireguard_aead_encrypt_batch(packets, count, ctx);
+}
+
+void wireguard_decrypt_packets_ctx(wireguard_aead_batch *packets, size_t count, const wireguard_aead_ctx *ctx) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		packets[i].ad = NULL;
+		packets[i].ad_len = 0;
+	}
+	wireguard_aead_decrypt_batch(packets, count, ctx);
 }
 
 bool wireguard_base64_decode(const char *str, uint8_t *out, size_t *outlen) {
@@ -48,6 +48,9 @@
 // Platform-specific functions that need to be implemented per-platform
 #include "wireguard-platform.h"
 
+// Crypto primitives - only needed here for the expanded session key state in the keypair
+#include "crypto.h"
+
 // tai64n contains 64-bit seconds and 32-bit nano offset (12 bytes)
 #define WIREGUARD_TAI64N_LEN		(12)
 // Auth algorithm is chacha20pol1305 which is 128bit (16 byte) authenticator
@@ -73,6 +76,11 @@
 #define REKEY_TIMEOUT				(5)
 #define KEEPALIVE_TIMEOUT			(10)
 
+// Replay window (RFC 6479): a ring of 64-bit words, all but the one holding the newest counter cover the counters
+// behind it - wide enough for batches sent by several threads to arrive interleaved
+#define WIREGUARD_REPLAY_WORDS		(32)
+#define WIREGUARD_REPLAY_WINDOW		((WIREGUARD_REPLAY_WORDS - 1) * 64)
+
 struct wireguard_keypair {
 	bool valid;
 	bool initiator; // Did we initiate this session (send the initiation packet rather than sending the response packet)
@@ -85,11 +93,15 @@ struct wireguard_keypair {
 	uint8_t receiving_key[WIREGUARD_SESSION_KEY_LEN];
 	bool receiving_valid;
 
+	// The session keys expanded once into cipher state templates - per packet only the nonce is filled in
+	wireguard_aead_ctx sending_ctx;
+	wireguard_aead_ctx receiving_ctx;
+
 	uint32_t last_tx;
 	uint32_t last_rx;
 
-	uint32_t replay_bitmap;
-	uint64_t replay_counter;
+	uint64_t replay_bitmap[WIREGUARD_REPLAY_WORDS];
+	uint64_t replay_counter; // Newest counter received plus one, 0 before the first
 
 	uint32_t local_index; // This is the index we generated for our end
 	uint32_t remote_index; // This is the index on the other end
@@ -160,6 +172,8 @@ struct wireguard_peer {
 	uint32_t last_initiation_rx;
 	// The last time we sent an initiation message to this peer
 	uint32_t last_initiation_tx;
+	// Random extra wait before the next initiation retry, in milliseconds
+	uint32_t initiation_jitter;
 
 	// last_tx and last_rx of data packets
 	uint32_t last_tx;
@@ -269,8 +283,12 @@ bool wireguard_create_handshake_initiation(struct wireguard_device *device, stru
 bool wireguard_create_handshake_response(struct wireguard_device *device, struct wireguard_peer *peer, struct message_handshake_response *dst);
 void wireguard_create_cookie_reply(struct wireguard_device *device, struct message_cookie_reply *dst, const uint8_t *mac1, uint32_t index, uint8_t *source_addr_port, size_t source_length);
 
+// Generate a fresh (clamped) private key and its public key
+bool wireguard_generate_keypair(uint8_t *private_key, uint8_t *public_key);
+
 
 bool wireguard_check_mac1(struct wireguard_device *device, const uint8_t *data, size_t len, const uint8_t *mac1);
+void wireguard_check_mac1_batch(struct wireguard_device *device, const uint8_t *const data[], size_t len, const uint8_t *const mac1[], bool *valid, size_t count);
 bool wireguard_check_mac2(struct wireguard_device *device, const uint8_t *data, size_t len, uint8_t *source_addr_port, size_t source_length, const uint8_t *mac2);
 
 bool wireguard_expired(uint32_t created_millis, uint32_t valid_seconds);
@@ -278,6 +296,14 @@ bool wireguard_expired(uint32_t created_millis, uint32_t valid_seconds);
 void wireguard_encrypt_packet(uint8_t *dst, const uint8_t *src, size_t src_len, struct wireguard_keypair *keypair);
 bool wireguard_decrypt_packet(uint8_t *dst, const uint8_t *src, size_t src_len, uint64_t counter, struct wireguard_keypair *keypair);
 
+// Batches of packets under one keypair - dst, src and src_len must be set in each entry
+// They take a copy of the keypair's cipher state, so they can run without holding the lock that guards the keypair.
+// Encryption stores counter + i in the nonce field of packet i - counter is the first of count sending counters
+// reserved from the keypair while holding it, all below REJECT_AFTER_MESSAGES; for decryption the caller sets
+// each nonce to the packet's counter and checks valid on return
+void wireguard_encrypt_packets_ctx(wireguard_aead_batch *packets, size_t count, uint64_t counter, const wireguard_aead_ctx *ctx);
+void wireguard_decrypt_packets_ctx(wireguard_aead_batch *packets, size_t count, const wireguard_aead_ctx *ctx);
+
 bool wireguard_base64_decode(const char *str, uint8_t *out, size_t *outlen);
 bool wireguard_base64_encode(const uint8_t *in, size_t inlen, char *out, size_t *outlen);
 
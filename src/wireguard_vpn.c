@@ -42,7 +42,6 @@
 
 #include "wireguard_vpn.h"
 #include "wg_main.h"
-#include "wg_timer.h"
 
 #if !defined(WG_CLIENT_PRIVATE_KEY) || !defined(WG_PEER_PUBLIC_KEY)
 #error "Please update configuratiuon with your VPN-specific keys!"
@@ -72,6 +71,8 @@ int wireguard_setup(void) {
 	if (wg_netif == NULL)
 		return -1;
 	wg_netif->state = &wg;
+	wg_netif->queues = NULL;
+	wg_netif->queue_count = 0;
 
 	wireguardif_init(wg_netif);
 
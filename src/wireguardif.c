@@ -46,8 +46,9 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <netinet/udp.h>
 
-#include "wg_timer.h"
+#include "wg_keypool.h"
 #include "wg_tun.h"
 #include "wg_comm.h"
 #include "lib/pthread_wrap.h"
@@ -63,7 +64,6 @@
 
 #include <stdio.h>
 
-#define WIREGUARDIF_TIMER_MSECS 4000
 #define pbuf_free(x) \
 	{\
 		free(x->payload); \
@@ -98,7 +98,7 @@ static struct wireguard_peer *peer_lookup_by_allowed_ip(struct wireguard_device
 }
 
 static bool wireguardif_can_send_initiation(struct wireguard_peer *peer) {
-	return ((peer->last_initiation_tx == 0) || (wireguard_expired(peer->last_initiation_tx, REKEY_TIMEOUT)));
+	return ((peer->last_initiation_tx == 0) || ((wireguard_sys_now() - peer->last_initiation_tx) >= (REKEY_TIMEOUT * 1000 + peer->initiation_jitter)));
 }
 
 static err_t wireguardif_peer_output(struct netif *netif, struct pbuf *q, struct wireguard_peer *peer) {
@@ -116,6 +116,244 @@ static err_t wireguardif_peer_output(struct netif *netif, struct pbuf *q, struct
 	return sendto(netif->sockfd, q->payload, q->len, 0, (struct sockaddr *)&peeraddr, sizeof(struct sockaddr_in));
 }
 
+struct wireguardif_tx_slot {
+	// NULL once dropped
+	struct wireguard_peer *peer;
+	// The keypair is looked up again by the flush - it may have moved or gone by then
+	uint32_t local_index;
+	// Message header followed by the padded plain text, encrypted in place by the flush
+	uint8_t data[WIREGUARDIF_TX_SLOT_LEN];
+};
+
+// Control message carrying the UDP_SEGMENT size of a GSO send
+union wireguardif_tx_cmsg {
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+};
+
+struct wireguardif_tx_queue {
+	struct wireguardif_tx_slot *slots;
+	wireguard_aead_batch *packets;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct sockaddr_in *to;
+	union wireguardif_tx_cmsg *cmsg;
+	size_t count;
+	size_t size;
+	// Same-size messages to the same endpoint go out as one UDP_SEGMENT send - cleared if the kernel refuses it
+	bool gso;
+};
+
+static struct wireguardif_tx_queue *wireguardif_tx_alloc(size_t size) {
+	struct wireguardif_tx_queue *tx;
+	size_t i;
+
+	tx = (struct wireguardif_tx_queue *)calloc(1, sizeof(struct wireguardif_tx_queue));
+	if (tx) {
+		tx->size = size;
+		tx->slots = calloc(size, sizeof(*tx->slots));
+		tx->packets = calloc(size, sizeof(*tx->packets));
+		tx->msgs = calloc(size, sizeof(*tx->msgs));
+		tx->iov = calloc(size, sizeof(*tx->iov));
+		tx->to = calloc(size, sizeof(*tx->to));
+		tx->cmsg = calloc(size, sizeof(*tx->cmsg));
+		tx->gso = config.udp_gso;
+		if (tx->slots && tx->packets && tx->msgs && tx->iov && tx->to && tx->cmsg) {
+			for (i = 0; i < size; i++) {
+				tx->iov[i].iov_base = tx->slots[i].data;
+				tx->to[i].sin_family = AF_INET;
+			}
+		} else {
+			free(tx->slots);
+			free(tx->packets);
+			free(tx->msgs);
+			free(tx->iov);
+			free(tx->to);
+			free(tx->cmsg);
+			free(tx);
+			tx = NULL;
+		}
+	}
+	return tx;
+}
+
+// Queue a data packet for the keypair - the flush assigns the counter and encrypts it
+// Only what needs the lock is taken here: the indexes and the endpoint. wireguardif_output_copy() adds the packet.
+static err_t wireguardif_output_queue(struct wireguardif_queue *queue, size_t padded_len,
+	struct wireguard_peer *peer, struct wireguard_keypair *keypair) {
+	struct wireguardif_tx_queue *tx = queue->tx;
+	struct wireguardif_tx_slot *slot = &tx->slots[tx->count];
+	struct message_transport_data *hdr = (struct message_transport_data *)slot->data;
+
+	hdr->receiver = keypair->remote_index;
+	slot->peer = peer;
+	slot->local_index = keypair->local_index;
+	tx->packets[tx->count].src_len = padded_len;
+	tx->iov[tx->count].iov_len = sizeof(struct message_transport_data) + padded_len + WIREGUARD_AUTHTAG_LEN;
+	// Send to last known port, not the connect port
+	tx->to[tx->count].sin_addr.s_addr = peer->ip.u_addr.ip4.addr;
+	tx->to[tx->count].sin_port = htons(peer->port);
+	tx->count++;
+	return ERR_OK;
+}
+
+// Fill in the rest of the slot queued last, after the lock is released - the queue belongs to the calling worker
+static void wireguardif_output_copy(struct wireguardif_tx_queue *tx, struct pbuf *q) {
+	struct wireguardif_tx_slot *slot = &tx->slots[tx->count - 1];
+	struct message_transport_data *hdr = (struct message_transport_data *)slot->data;
+	size_t padded_len = tx->packets[tx->count - 1].src_len;
+
+	hdr->type = MESSAGE_TRANSPORT_DATA;
+	memset(hdr->reserved, 0, sizeof(hdr->reserved));
+	memcpy(&hdr->enc_packet[0], q->payload, q->tot_len);
+	memset(&hdr->enc_packet[q->tot_len], 0, padded_len - q->tot_len);
+}
+
+// Build the sendmmsg() vector for the encrypted slots from first on (dropped slots have no peer). With GSO a
+// message carries a run of slots to the same endpoint, all the size of the first but the last which may be shorter.
+static size_t wireguardif_tx_build(struct wireguardif_tx_queue *tx, size_t first, bool gso) {
+	struct msghdr *hdr = NULL;
+	struct cmsghdr *cm;
+	size_t seg_len = 0;
+	size_t total = 0;
+	size_t count = 0;
+	size_t k, len;
+
+	for (k = first; k < tx->count; k++) {
+		if (tx->slots[k].peer == NULL) {
+			hdr = NULL;
+			continue;
+		}
+		len = tx->iov[k].iov_len;
+		if (gso && hdr && (hdr->msg_iovlen < WIREGUARDIF_GSO_MAX_SEGMENTS) &&
+				(tx->iov[k - 1].iov_len == seg_len) && (len <= seg_len) &&
+				(total + len <= WIREGUARDIF_GSO_MAX_BYTES) &&
+				(tx->to[k].sin_addr.s_addr == tx->to[k - 1].sin_addr.s_addr) &&
+				(tx->to[k].sin_port == tx->to[k - 1].sin_port)) {
+			hdr->msg_iovlen++;
+			total += len;
+			if (hdr->msg_iovlen == 2) {
+				// Now more than one datagram - let the kernel split them
+				hdr->msg_control = tx->cmsg[count - 1].buf;
+				hdr->msg_controllen = sizeof(tx->cmsg[count - 1].buf);
+				cm = CMSG_FIRSTHDR(hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*(uint16_t *)CMSG_DATA(cm) = (uint16_t)seg_len;
+			}
+			continue;
+		}
+
+		memset(&tx->msgs[count], 0, sizeof(struct mmsghdr));
+		hdr = &tx->msgs[count].msg_hdr;
+		hdr->msg_name = &tx->to[k];
+		hdr->msg_namelen = sizeof(struct sockaddr_in);
+		hdr->msg_iov = &tx->iov[k];
+		hdr->msg_iovlen = 1;
+		seg_len = len;
+		total = len;
+		count++;
+	}
+	return count;
+}
+
+void wireguardif_output_flush(struct wireguardif_queue *queue) {
+	struct wireguardif_tx_queue *tx = queue->tx;
+	struct wireguard_keypair *keypair;
+	struct wireguard_peer *peer;
+	struct message_transport_data *hdr;
+	wireguard_aead_ctx ctx;
+	uint64_t counter;
+	uint32_t idx;
+	size_t i, j, k;
+	size_t count;
+	size_t sent;
+	uint32_t now;
+	bool gso;
+	int r;
+
+	if (!tx || tx->count == 0) {
+		return;
+	}
+
+	// Encrypt each run of packets for the same keypair together
+	now = wireguard_sys_now();
+	for (i = 0; i < tx->count; i = j) {
+		peer = tx->slots[i].peer;
+		idx = tx->slots[i].local_index;
+		for (j = i; (j < tx->count) && (tx->slots[j].peer == peer) && (tx->slots[j].local_index == idx); j++) {
+			hdr = (struct message_transport_data *)tx->slots[j].data;
+			tx->packets[j].dst = &hdr->enc_packet[0];
+			tx->packets[j].src = &hdr->enc_packet[0];
+		}
+
+		// Take the counters and the cipher state under the lock, encrypt without it
+		mutexLock(&queue->netif->lock);
+		keypair = get_peer_keypair_for_idx(peer, idx);
+		if (!keypair || !keypair->sending_valid || (keypair->sending_counter > REJECT_AFTER_MESSAGES - (j - i))) {
+			mutexUnlock(&queue->netif->lock);
+			// Destroyed (expired) or out of counters since these were queued
+			for (k = i; k < j; k++) {
+				tx->slots[k].peer = NULL;
+			}
+			continue;
+		}
+		counter = keypair->sending_counter;
+		keypair->sending_counter += j - i;
+		ctx = keypair->sending_ctx;
+		peer->last_tx = now;
+		keypair->last_tx = now;
+
+		// Check to see if we should rekey
+		if (keypair->sending_counter >= REKEY_AFTER_MESSAGES) {
+			peer->send_handshake = true;
+		} else if (keypair->initiator && wireguard_expired(keypair->keypair_millis, REKEY_AFTER_TIME)) {
+			peer->send_handshake = true;
+		}
+		mutexUnlock(&queue->netif->lock);
+
+		wireguard_encrypt_packets_ctx(&tx->packets[i], j - i, counter, &ctx);
+		crypto_zero(&ctx, sizeof(ctx));
+		for (k = i; k < j; k++) {
+			hdr = (struct message_transport_data *)tx->slots[k].data;
+			U64TO8_LITTLE(hdr->counter, tx->packets[k].nonce);
+		}
+	}
+
+	gso = tx->gso;
+	count = wireguardif_tx_build(tx, 0, gso);
+	for (sent = 0; sent < count; sent += r) {
+		r = sendmmsg(queue->sockfd, &tx->msgs[sent], count - sent, 0);
+		if (r == -1) {
+			if (gso && (errno == EIO || errno == EINVAL || (errno == EMSGSIZE && tx->msgs[sent].msg_hdr.msg_iovlen > 1))) {
+				if (errno != EMSGSIZE) {
+					// No UDP GSO here (EINVAL) or on the outgoing device (EIO)
+					log_message("(%s) UDP GSO is not usable (%s), disabling it", __func__, strerror(errno));
+					tx->gso = false;
+				}
+				// A segment larger than the path MTU is refused where a single datagram would be fragmented
+				// - either way resend the rest one datagram at a time
+				gso = false;
+				count = wireguardif_tx_build(tx, tx->msgs[sent].msg_hdr.msg_iov - tx->iov, false);
+				sent = 0;
+				r = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				// The socket itself is full - drop the rest
+				log_message_level(2, "(%s) sendmmsg() failed: %s", __func__, strerror(errno));
+				break;
+			}
+			// sendmmsg() stops at the first message that fails, so this is the one (ENETUNREACH, EPERM,
+			// EMSGSIZE...) - drop it alone, as sendto() would have, and send the rest
+			log_message_level(2, "(%s) sendmmsg() failed: %s", __func__, strerror(errno));
+			r = 1;
+		}
+	}
+	tx->count = 0;
+}
+
 static err_t wireguardif_device_output(struct wireguard_device *device, struct pbuf *q,
 	const ip_addr_t *ipaddr, u16_t port) {
 	if (device->netif) {
@@ -132,7 +370,8 @@ static err_t wireguardif_device_output(struct wireguard_device *device, struct p
 		return 0;
 }
 
-static err_t wireguardif_output_to_peer(struct netif *netif, struct pbuf *q,
+// queue is NULL for a keepalive, which is sent right away
+static err_t wireguardif_output_to_peer(struct netif *netif, struct wireguardif_queue *queue, struct pbuf *q,
 	const ip_addr_t *ipaddr __attribute__((unused)), struct wireguard_peer *peer) {
 	// The LWIP IP layer wants to send an IP packet out over the interface - we need to encrypt and send it to the peer
 	struct message_transport_data *hdr;
@@ -165,6 +404,10 @@ static err_t wireguardif_output_to_peer(struct netif *netif, struct pbuf *q,
 			}
 			padded_len = (unpadded_len + 15) & 0xFFFFFFF0; // Round up to next 16 byte boundary
 
+			if (q && queue && queue->tx && (header_len + padded_len + WIREGUARD_AUTHTAG_LEN <= WIREGUARDIF_TX_SLOT_LEN)) {
+				return wireguardif_output_queue(queue, padded_len, peer, keypair);
+			}
+
 			// The buffer needs to be allocated from "transport" pool to leave room for LwIP generated IP headers
 			// The IP packet consists of 16 byte header (struct message_transport_data), data padded upto 16 byte boundary + encrypted auth tag (16 bytes)
 			pbuf = (struct pbuf *)malloc(sizeof(struct pbuf));
@@ -241,10 +484,17 @@ static err_t wireguardif_output_to_peer(struct netif *netif, struct pbuf *q,
 
 // This is used as the output function for the Wireguard netif
 // The ipaddr here is the one inside the VPN which we use to lookup the correct peer/endpoint
-err_t wireguardif_output(struct netif *netif, struct pbuf *q, const ip_addr_t *ipaddr) {
+err_t wireguardif_output(struct wireguardif_queue *queue, struct pbuf *q, const ip_addr_t *ipaddr) {
+	struct netif *netif = queue->netif;
 	struct wireguard_device *device = (struct wireguard_device *)netif->state;
+	struct wireguard_peer *peer;
+	size_t queued = queue->tx ? queue->tx->count : 0;
+	err_t result;
+
+	// Only the peer lookup and the keypair and endpoint reads are done under the lock
+	mutexLock(&netif->lock);
 	// Send to peer that matches dest IP
-	struct wireguard_peer *peer = peer_lookup_by_allowed_ip(device, ipaddr);
+	peer = peer_lookup_by_allowed_ip(device, ipaddr);
 	if (peer) {
 #if 0
 		log_message_level(2, "<< Found peer ipaddr = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"",
@@ -253,15 +503,25 @@ err_t wireguardif_output(struct netif *netif, struct pbuf *q, const ip_addr_t *i
 				(ntohl(ipaddr->u_addr.ip4.addr) >>  8) & 0xFF,
 				(ntohl(ipaddr->u_addr.ip4.addr) >>  0) & 0xFF);
 #endif
-		return wireguardif_output_to_peer(netif, q, ipaddr, peer);
+		result = wireguardif_output_to_peer(netif, queue, q, ipaddr, peer);
 	} else {
-		return ERR_RTE;
+		result = ERR_RTE;
+	}
+	mutexUnlock(&netif->lock);
+
+	if (queue->tx && (queue->tx->count > queued)) {
+		wireguardif_output_copy(queue->tx, q);
+	}
+	// The flush takes the lock itself
+	if (queue->tx && (queue->tx->count == queue->tx->size)) {
+		wireguardif_output_flush(queue);
 	}
+	return result;
 }
 
 static void wireguardif_send_keepalive(struct wireguard_device *device, struct wireguard_peer *peer) {
 	// Send a NULL packet as a keep-alive
-	wireguardif_output_to_peer(device->netif, NULL, NULL, peer);
+	wireguardif_output_to_peer(device->netif, NULL, NULL, NULL, peer);
 }
 
 static void wireguardif_process_response_message(struct wireguard_device *device, struct wireguard_peer *peer,
@@ -307,143 +567,152 @@ static bool peer_add_ip(struct wireguard_peer *peer, ip_addr_t ip, ip_addr_t mas
 	return result;
 }
 
-static void wireguardif_process_data_message(struct wireguard_device *device, struct wireguard_peer *peer,
-	struct message_transport_data *data_hdr, size_t data_len, const ip_addr_t *addr, u16_t port) {
-	struct wireguard_keypair *keypair;
-	uint64_t nonce;
-	uint8_t *src;
-	size_t src_len;
-	struct pbuf *pbuf;
+// Keypair a data message was sent under, if it may still be used to receive
+static struct wireguard_keypair *wireguardif_data_keypair(struct wireguard_peer *peer, uint32_t idx) {
+	struct wireguard_keypair *keypair = get_peer_keypair_for_idx(peer, idx);
+
+	if (keypair) {
+		if (!((keypair->receiving_valid) &&
+			!wireguard_expired(keypair->keypair_millis, REJECT_AFTER_TIME) &&
+			(keypair->sending_counter < REJECT_AFTER_MESSAGES))) {
+			//After Reject-After-Messages transport data messages or after the current secure session is Reject- After-Time seconds old,
+			// whichever comes first, WireGuard will refuse to send or receive any more transport data messages using the current secure session,
+			// until a new secure session is created through the 1-RTT handshake
+			keypair_destroy(keypair);
+			keypair = NULL;
+		}
+	} else {
+		// Could not locate valid keypair for remote index
+	}
+	return keypair;
+}
+
+// Write out the TCP segments merged so far - at the end of every batch of received messages
+static void wireguardif_tun_flush(struct wireguardif_queue *queue) {
+	size_t n;
+
+	if (queue->gro) {
+		n = offload_gro_finish(queue->gro);
+		if (n > 0) {
+			write_tun_vnet(queue->tunfd, (struct virtio_net_hdr *)queue->gro->buf,
+				queue->gro->buf + OFFLOAD_VNET_HDR_LEN, n - OFFLOAD_VNET_HDR_LEN);
+		}
+	}
+}
+
+// Write a decrypted packet to the TUN queue - in offload mode TCP segments are held back to be merged
+static void wireguardif_tun_write(struct wireguardif_queue *queue, const uint8_t *packet, size_t len) {
+	int r;
+
+	if (queue->gro && tun_vnet_hdr) {
+		r = offload_gro_add(queue->gro, packet, len);
+		if (r > 0) {
+			// Does not continue the packet being built - send that and start again
+			wireguardif_tun_flush(queue);
+			r = offload_gro_add(queue->gro, packet, len);
+		}
+		if (r == 0) {
+			return;
+		}
+		// Cannot be merged - the segments taken before it still go first
+		wireguardif_tun_flush(queue);
+	}
+	write_tun(queue->tunfd, packet, len);
+}
+
+// A data message has been decrypted and authenticated - the plain text is len bytes at payload
+// Returns the length to write to the TUN device, 0 if the packet is to be dropped (or was a keepalive)
+static size_t wireguardif_accept_data_message(struct wireguard_peer *peer, struct wireguard_keypair *keypair,
+	uint64_t nonce, uint8_t *payload, size_t len, const ip_addr_t *addr, u16_t port) {
 	struct ip_hdr *iphdr;
 	ip_addr_t dest;
 	bool dest_ok = false;
 	int x;
 	uint32_t now;
+	uint32_t idx;
 	uint16_t header_len = 0xFFFF;
-	uint32_t idx = data_hdr->receiver;
-
-	keypair = get_peer_keypair_for_idx(peer, idx);
-
-	if (keypair) {
-		if ((keypair->receiving_valid) &&
-			!wireguard_expired(keypair->keypair_millis, REJECT_AFTER_TIME) &&
-			(keypair->sending_counter < REJECT_AFTER_MESSAGES)) {
-
-			nonce = U8TO64_LITTLE(data_hdr->counter);
-			src = &data_hdr->enc_packet[0];
-			src_len = data_len;
-
-			// We don't know the unpadded size until we have decrypted the packet and validated/inspected the IP header
-			pbuf = (struct pbuf *)malloc(sizeof(struct pbuf));
-			if (pbuf) {
-				pbuf->payload = (void *)malloc(src_len - WIREGUARD_AUTHTAG_LEN);
-				if (pbuf->payload == NULL) {
-					free(pbuf);
-					log_message_level(2, "(%s) Can not allocate an area for payload.", __func__);
-					return;
-				}
-				pbuf->len = src_len - WIREGUARD_AUTHTAG_LEN;
-				pbuf->tot_len = pbuf->len;
 
-				// Decrypt the packet
-				memset(pbuf->payload, 0, pbuf->tot_len);
-				if (wireguard_decrypt_packet(pbuf->payload, src, src_len, nonce, keypair)) {
+	// 3. Since the packet has authenticated correctly, the source IP of the outer UDP/IP packet is used to update the endpoint for peer TrMv...WXX0.
+	// Update the peer location
+	update_peer_addr(peer, addr, port);
 
-					// 3. Since the packet has authenticated correctly, the source IP of the outer UDP/IP packet is used to update the endpoint for peer TrMv...WXX0.
-					// Update the peer location
-					update_peer_addr(peer, addr, port);
+	now = wireguard_sys_now();
+	keypair->last_rx = now;
+	peer->last_rx = now;
 
-					now = wireguard_sys_now();
-					keypair->last_rx = now;
-					peer->last_rx = now;
+	// Might need to shuffle next key --> current keypair - which moves it, so look it up again afterwards
+	idx = keypair->local_index;
+	keypair_update(peer, keypair);
+	keypair = get_peer_keypair_for_idx(peer, idx);
+	if (!keypair) {
+		return 0;
+	}
 
-					// Might need to shuffle next key --> current keypair
-					keypair_update(peer, keypair);
+	// Check to see if we should rekey
+	if (keypair->initiator && wireguard_expired(keypair->keypair_millis, REJECT_AFTER_TIME - peer->keepalive_interval - REKEY_TIMEOUT)) {
+		peer->send_handshake = true;
+	}
 
-					// Check to see if we should rekey
-					if (keypair->initiator && wireguard_expired(keypair->keypair_millis, REJECT_AFTER_TIME - peer->keepalive_interval - REKEY_TIMEOUT)) {
-						peer->send_handshake = true;
+	if (len > 0) {
+		//4a. Once the packet payload is decrypted, the interface has a plaintext packet. If this is not an IP packet, it is dropped.
+		iphdr = (struct ip_hdr *)payload;
+		// Check for packet replay / dupes
+		if (wireguard_check_replay(keypair, nonce)) {
+
+			// 4b. Otherwise, WireGuard checks to see if the source IP address of the plaintext inner-packet routes correspondingly in the cryptokey routing table
+			// Also check packet length!
+			if (IPH_V(iphdr) == 4) {
+				ip_addr_copy_from_ip4(dest, iphdr->dest);
+				for (x=0; x < WIREGUARD_MAX_SRC_IPS; x++) {
+					if (peer->allowed_source_ips[x].valid) {
+						if (ip_addr_netcmp(&dest, &peer->allowed_source_ips[x].ip,
+								ip_2_ip4(&peer->allowed_source_ips[x].mask))) {
+							dest_ok = true;
+							header_len = ntohs(IPH_LEN(iphdr));  // PP_NTOHS -> ntohs
+							break;
+						}
 					}
-
-					if (pbuf->tot_len > 0) {
-						//4a. Once the packet payload is decrypted, the interface has a plaintext packet. If this is not an IP packet, it is dropped.
-						iphdr = (struct ip_hdr *)pbuf->payload;
-						// Check for packet replay / dupes
-						if (wireguard_check_replay(keypair, nonce)) {
-
-							// 4b. Otherwise, WireGuard checks to see if the source IP address of the plaintext inner-packet routes correspondingly in the cryptokey routing table
-							// Also check packet length!
-							if (IPH_V(iphdr) == 4) {
-								ip_addr_copy_from_ip4(dest, iphdr->dest);
-								for (x=0; x < WIREGUARD_MAX_SRC_IPS; x++) {
-									if (peer->allowed_source_ips[x].valid) {
-										if (ip_addr_netcmp(&dest, &peer->allowed_source_ips[x].ip,
-												ip_2_ip4(&peer->allowed_source_ips[x].mask))) {
-											dest_ok = true;
-											header_len = ntohs(IPH_LEN(iphdr));  // PP_NTOHS -> ntohs
-											break;
-										}
-									}
-								}
-							}
+				}
+			}
 #if LWIP_IPV6
-							if (IPH_V(iphdr) == 6) {
-								// TODO: IPV6 support for route filtering
-								header_len = ntohs(IPH_LEN(iphdr));  // PP_NTOHS -> ntohs
-								dest_ok = true;
-							}
+			if (IPH_V(iphdr) == 6) {
+				// TODO: IPV6 support for route filtering
+				header_len = ntohs(IPH_LEN(iphdr));  // PP_NTOHS -> ntohs
+				dest_ok = true;
+			}
 #endif /* LWIP_IPV6 */
-							if (header_len <= pbuf->tot_len) {
-
-								// 5. If the plaintext packet has not been dropped, it is inserted into the receive queue of the wg0 interface.
-								if (dest_ok) {
-									// Send packet to be processed by application
-									if (config.debug) {
-										struct ip_hdr *tip;
-										tip = (struct ip_hdr *)pbuf->payload;
-										log_message(">> Received a VPN message: size %d from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"",
-												pbuf->tot_len,
-												(ntohl(tip->src.addr)  >> 24) & 0xFF,
-												(ntohl(tip->src.addr)  >> 16) & 0xFF,
-												(ntohl(tip->src.addr)  >>  8) & 0xFF,
-												(ntohl(tip->src.addr)  >>  0) & 0xFF,
-												(ntohl(tip->dest.addr) >> 24) & 0xFF,
-												(ntohl(tip->dest.addr) >> 16) & 0xFF,
-												(ntohl(tip->dest.addr) >>  8) & 0xFF,
-												(ntohl(tip->dest.addr) >>  0) & 0xFF);
-									}
-
-									write_tun(device->netif->tunfd, pbuf->payload, pbuf->tot_len);
-									pbuf = NULL;
-								}
-							} else {
-								// IP header is corrupt or lied about packet size
-								log_message_level(2, "(%s) IP header is corrupt or lied about packet size !", __func__);
-							}
-						} else {
-							// This is a duplicate packet / replayed / too far out of order
-							log_message_level(2, "(%s) This is a duplicate packet / replayed / too far out of order !", __func__);
-						}
-					} else {
-						// This was a keep-alive packet
+			if (header_len <= len) {
+
+				// 5. If the plaintext packet has not been dropped, it is inserted into the receive queue of the wg0 interface.
+				if (dest_ok) {
+					// Send packet to be processed by application
+					if (config.debug) {
+						log_message(">> Received a VPN message: size %zu from SRC = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32" to DST = %"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"",
+								len,
+								(ntohl(iphdr->src.addr)  >> 24) & 0xFF,
+								(ntohl(iphdr->src.addr)  >> 16) & 0xFF,
+								(ntohl(iphdr->src.addr)  >>  8) & 0xFF,
+								(ntohl(iphdr->src.addr)  >>  0) & 0xFF,
+								(ntohl(iphdr->dest.addr) >> 24) & 0xFF,
+								(ntohl(iphdr->dest.addr) >> 16) & 0xFF,
+								(ntohl(iphdr->dest.addr) >>  8) & 0xFF,
+								(ntohl(iphdr->dest.addr) >>  0) & 0xFF);
 					}
-				}
 
-				if (pbuf) {
-					pbuf_free(pbuf);
+					return len;
 				}
+			} else {
+				// IP header is corrupt or lied about packet size
+				log_message_level(2, "(%s) IP header is corrupt or lied about packet size !", __func__);
 			}
-
 		} else {
-			//After Reject-After-Messages transport data messages or after the current secure session is Reject- After-Time seconds old,
-			// whichever comes first, WireGuard will refuse to send or receive any more transport data messages using the current secure session,
-			// until a new secure session is created through the 1-RTT handshake
-			keypair_destroy(keypair);
+			// This is a duplicate packet / replayed / too far out of order
+			log_message_level(2, "(%s) This is a duplicate packet / replayed / too far out of order !", __func__);
 		}
-
 	} else {
-		// Could not locate valid keypair for remote index
+		// This was a keep-alive packet
 	}
+	return 0;
 }
 
 static struct pbuf *wireguardif_initiate_handshake(struct wireguard_device *device, struct wireguard_peer *peer,
@@ -563,16 +832,16 @@ static void wireguardif_send_handshake_cookie(struct wireguard_device *device, c
 	}
 }
 
+// mac1_valid is the result of wireguard_check_mac1() on the message, done up front so a batch can be hashed together
 static bool wireguardif_check_initiation_message(struct wireguard_device *device,
-	struct message_handshake_initiation *msg, const ip_addr_t *addr, u16_t port) {
+	struct message_handshake_initiation *msg, bool mac1_valid, const ip_addr_t *addr, u16_t port) {
 	bool result = false;
 	uint8_t *data = (uint8_t *)msg;
 	uint8_t source_buf[18];
 	size_t source_len;
 	// We received an initiation packet check it is valid
 
-	if (wireguard_check_mac1(device, data,
-		sizeof(struct message_handshake_initiation) - (2 * WIREGUARD_COOKIE_LEN), msg->mac1)) {
+	if (mac1_valid) {
 		// mac1 is valid!
 		if (!wireguard_is_under_load()) {
 			// If we aren't under load we only need mac1 to be correct
@@ -599,16 +868,16 @@ static bool wireguardif_check_initiation_message(struct wireguard_device *device
 	return result;
 }
 
+// mac1_valid is the result of wireguard_check_mac1() on the message, done up front so a batch can be hashed together
 static bool wireguardif_check_response_message(struct wireguard_device *device,
-	struct message_handshake_response *msg, const ip_addr_t *addr, u16_t port) {
+	struct message_handshake_response *msg, bool mac1_valid, const ip_addr_t *addr, u16_t port) {
 	bool result = false;
 	uint8_t *data = (uint8_t *)msg;
 	uint8_t source_buf[18];
 	size_t source_len;
 	// We received an initiation packet check it is valid
 
-	if (wireguard_check_mac1(device, data,
-			sizeof(struct message_handshake_response) - (2 * WIREGUARD_COOKIE_LEN), msg->mac1)) {
+	if (mac1_valid) {
 		// mac1 is valid!
 		if (!wireguard_is_under_load()) {
 			// If we aren't under load we only need mac1 to be correct
@@ -635,29 +904,23 @@ static bool wireguardif_check_response_message(struct wireguard_device *device,
 	return result;
 }
 
-void wireguardif_network_rx(void *arg, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
-	assert(arg != NULL);
-	assert(p != NULL);
-
-	// We have received a packet from the base_netif to our UDP port - process this as a possible Wireguard packet
-	struct wireguard_device *device = (struct wireguard_device *)arg;
+// Process one received handshake or cookie message of the given type (from wireguard_get_message_type) - called with
+// netif->lock held. Data messages go through wireguardif_batch_data()
+static void wireguardif_process_message(struct wireguardif_queue *queue, uint8_t *data, uint8_t type,
+	bool mac1_valid, const ip_addr_t *addr, u16_t port) {
+	struct wireguard_device *device = (struct wireguard_device *)queue->netif->state;
 	struct wireguard_peer *peer;
-	uint8_t *data = p->payload;
-	size_t len = p->len; // This buf, not chained ones
 
 	struct message_handshake_initiation *msg_initiation;
 	struct message_handshake_response *msg_response;
 	struct message_cookie_reply *msg_cookie;
-	struct message_transport_data *msg_data;
-
-	uint8_t type = wireguard_get_message_type(data, len);
 
 	switch (type) {
 		case MESSAGE_HANDSHAKE_INITIATION:
 			msg_initiation = (struct message_handshake_initiation *)data;
 
 			// Check mac1 (and optionally mac2) are correct - note it may internally generate a cookie reply packet
-			if (wireguardif_check_initiation_message(device, msg_initiation, addr, port)) {
+			if (wireguardif_check_initiation_message(device, msg_initiation, mac1_valid, addr, port)) {
 
 				peer = wireguard_process_initiation_message(device, msg_initiation);
 				if (peer) {
@@ -674,7 +937,7 @@ void wireguardif_network_rx(void *arg, struct pbuf *p, const ip_addr_t *addr, u1
 			msg_response = (struct message_handshake_response *)data;
 
 			// Check mac1 (and optionally mac2) are correct - note it may internally generate a cookie reply packet
-			if (wireguardif_check_response_message(device, msg_response, addr, port)) {
+			if (wireguardif_check_response_message(device, msg_response, mac1_valid, addr, port)) {
 
 				peer = peer_lookup_by_handshake(device, msg_response->receiver);
 				if (peer) {
@@ -697,21 +960,152 @@ void wireguardif_network_rx(void *arg, struct pbuf *p, const ip_addr_t *addr, u1
 			}
 			break;
 
-		case MESSAGE_TRANSPORT_DATA:
-			msg_data = (struct message_transport_data *)data;
-			peer = peer_lookup_by_receiver(device, msg_data->receiver);
-			if (peer) {
-				// header is 16 bytes long so take that off the length
-				wireguardif_process_data_message(device, peer, msg_data, len - 16, addr, port);
-			}
-			break;
-
 		default:
 			// Unknown or bad packet header
 			break;
 	}
 }
 
+// Check mac1 of the messages of one handshake type in a batch together - msg_len is the size of that message,
+// which ends with mac1 and mac2
+static void wireguardif_batch_mac1(struct wireguard_device *device, const struct pbuf *p, const uint8_t *type,
+	uint8_t msg_type, size_t msg_len, bool *mac1_valid, size_t count) {
+	const uint8_t *data[WIREGUARDIF_RX_BATCH];
+	const uint8_t *mac1[WIREGUARDIF_RX_BATCH];
+	bool valid[WIREGUARDIF_RX_BATCH];
+	size_t index[WIREGUARDIF_RX_BATCH];
+	size_t i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (type[i] == msg_type) {
+			index[n] = i;
+			data[n] = p[i].payload;
+			mac1[n] = data[n] + msg_len - (2 * WIREGUARD_COOKIE_LEN);
+			n++;
+		}
+	}
+	if (n > 0) {
+		wireguard_check_mac1_batch(device, data, msg_len - (2 * WIREGUARD_COOKIE_LEN), mac1, valid, n);
+		for (i = 0; i < n; i++) {
+			mac1_valid[index[i]] = valid[i];
+		}
+	}
+}
+
+// Decrypt and deliver the run of data messages at the start of a batch that share the receiver index of the first,
+// decrypting them in place together - returns the length of the run
+// The lock is only held to find the keypair and to check the decrypted packets, not while decrypting or writing them
+static size_t wireguardif_batch_data(struct wireguardif_queue *queue, struct pbuf *p, const uint8_t *type,
+	const ip_addr_t *addr, const u16_t *port, size_t count) {
+	struct wireguard_device *device = (struct wireguard_device *)queue->netif->state;
+	wireguard_aead_batch packets[WIREGUARDIF_RX_BATCH];
+	size_t deliver_len[WIREGUARDIF_RX_BATCH];
+	struct message_transport_data *msg_data = (struct message_transport_data *)p[0].payload;
+	struct wireguard_peer *peer;
+	struct wireguard_keypair *keypair = NULL;
+	wireguard_aead_ctx ctx;
+	uint32_t idx = msg_data->receiver;
+	size_t i, n;
+
+	for (n = 1; n < count; n++) {
+		if (type[n] != MESSAGE_TRANSPORT_DATA || ((struct message_transport_data *)p[n].payload)->receiver != idx) {
+			break;
+		}
+	}
+
+	mutexLock(&queue->netif->lock);
+	peer = peer_lookup_by_receiver(device, idx);
+	if (peer) {
+		keypair = wireguardif_data_keypair(peer, idx);
+		if (keypair) {
+			ctx = keypair->receiving_ctx;
+		}
+	}
+	mutexUnlock(&queue->netif->lock);
+	if (!keypair) {
+		return n;
+	}
+
+	for (i = 0; i < n; i++) {
+		msg_data = (struct message_transport_data *)p[i].payload;
+		packets[i].dst = &msg_data->enc_packet[0];
+		packets[i].src = &msg_data->enc_packet[0];
+		// header is 16 bytes long so take that off the length
+		packets[i].src_len = p[i].len - 16;
+		packets[i].nonce = U8TO64_LITTLE(msg_data->counter);
+	}
+	wireguard_decrypt_packets_ctx(packets, n, &ctx);
+	crypto_zero(&ctx, sizeof(ctx));
+
+	mutexLock(&queue->netif->lock);
+	for (i = 0; i < n; i++) {
+		deliver_len[i] = 0;
+		if (packets[i].valid) {
+			// The keypair may have gone meanwhile, and delivering a packet can move it from next to current
+			keypair = get_peer_keypair_for_idx(peer, idx);
+			if (keypair) {
+				deliver_len[i] = wireguardif_accept_data_message(peer, keypair, packets[i].nonce, packets[i].dst,
+					packets[i].src_len - WIREGUARD_AUTHTAG_LEN, &addr[i], port[i]);
+			}
+		}
+	}
+	mutexUnlock(&queue->netif->lock);
+
+	for (i = 0; i < n; i++) {
+		if (deliver_len[i] > 0) {
+			wireguardif_tun_write(queue, packets[i].dst, deliver_len[i]);
+		}
+	}
+	return n;
+}
+
+void wireguardif_network_rx_batch(void *arg, struct pbuf *p, const ip_addr_t *addr, const u16_t *port, size_t count) {
+	assert(arg != NULL);
+	assert(p != NULL);
+
+	struct wireguardif_queue *queue = (struct wireguardif_queue *)arg;
+	struct wireguard_device *device = (struct wireguard_device *)queue->netif->state;
+	uint8_t type[WIREGUARDIF_RX_BATCH];
+	bool mac1_valid[WIREGUARDIF_RX_BATCH];
+	size_t i, n;
+
+	while (count > 0) {
+		n = (count < WIREGUARDIF_RX_BATCH) ? count : WIREGUARDIF_RX_BATCH;
+
+		for (i = 0; i < n; i++) {
+			type[i] = wireguard_get_message_type(p[i].payload, p[i].len);
+			mac1_valid[i] = false;
+		}
+		wireguardif_batch_mac1(device, p, type, MESSAGE_HANDSHAKE_INITIATION,
+			sizeof(struct message_handshake_initiation), mac1_valid, n);
+		wireguardif_batch_mac1(device, p, type, MESSAGE_HANDSHAKE_RESPONSE,
+			sizeof(struct message_handshake_response), mac1_valid, n);
+
+		// Messages are still handled in the order they arrived
+		i = 0;
+		while (i < n) {
+			if (type[i] == MESSAGE_TRANSPORT_DATA) {
+				i += wireguardif_batch_data(queue, &p[i], &type[i], &addr[i], &port[i], n - i);
+			} else {
+				mutexLock(&queue->netif->lock);
+				wireguardif_process_message(queue, p[i].payload, type[i], mac1_valid[i], &addr[i], port[i]);
+				mutexUnlock(&queue->netif->lock);
+				i++;
+			}
+		}
+
+		p += n;
+		addr += n;
+		port += n;
+		count -= n;
+	}
+	wireguardif_tun_flush(queue);
+}
+
+void wireguardif_network_rx(void *arg, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+	wireguardif_network_rx_batch(arg, p, addr, &port, 1);
+}
+
 static err_t wireguard_start_handshake(struct netif *netif, struct wireguard_peer *peer) {
 	struct wireguard_device *device = (struct wireguard_device *)netif->state;
 	err_t result;
@@ -724,6 +1118,8 @@ static err_t wireguard_start_handshake(struct netif *netif, struct wireguard_pee
 		pbuf_free(pbuf);
 		peer->send_handshake = false;
 		peer->last_initiation_tx = wireguard_sys_now();
+		wireguard_random_bytes(&peer->initiation_jitter, sizeof(peer->initiation_jitter));
+		peer->initiation_jitter %= WIREGUARDIF_REKEY_JITTER_MSECS;
 		memcpy(peer->handshake_mac1, msg.mac1, WIREGUARD_COOKIE_LEN);
 		peer->handshake_mac1_valid = true;
 	}
@@ -753,7 +1149,10 @@ static err_t wireguardif_lookup_peer(struct netif *netif, u8_t peer_index, struc
 
 err_t wireguardif_connect(struct netif *netif, u8_t peer_index) {
 	struct wireguard_peer *peer;
-	err_t result = wireguardif_lookup_peer(netif, peer_index, &peer);
+	err_t result;
+
+	mutexLock(&netif->lock);
+	result = wireguardif_lookup_peer(netif, peer_index, &peer);
 	if (result == ERR_OK) {
 		// Check that a valid connect ip and port have been set
 		if (!ip_addr_isany(&peer->connect_ip) && (peer->connect_port > 0)) {
@@ -766,12 +1165,16 @@ err_t wireguardif_connect(struct netif *netif, u8_t peer_index) {
 			result = ERR_ARG;
 		}
 	}
+	mutexUnlock(&netif->lock);
 	return result;
 }
 
 err_t wireguardif_disconnect(struct netif *netif, u8_t peer_index) {
 	struct wireguard_peer *peer;
-	err_t result = wireguardif_lookup_peer(netif, peer_index, &peer);
+	err_t result;
+
+	mutexLock(&netif->lock);
+	result = wireguardif_lookup_peer(netif, peer_index, &peer);
 	if (result == ERR_OK) {
 		// Set the flag that we want to try connecting
 		peer->active = false;
@@ -781,12 +1184,16 @@ err_t wireguardif_disconnect(struct netif *netif, u8_t peer_index) {
 		keypair_destroy(&peer->prev_keypair);
 		result = ERR_OK;
 	}
+	mutexUnlock(&netif->lock);
 	return result;
 }
 
 err_t wireguardif_peer_is_up(struct netif *netif, u8_t peer_index, ip_addr_t *current_ip, u16_t *current_port) {
 	struct wireguard_peer *peer;
-	err_t result = wireguardif_lookup_peer(netif, peer_index, &peer);
+	err_t result;
+
+	mutexLock(&netif->lock);
+	result = wireguardif_lookup_peer(netif, peer_index, &peer);
 	if (result == ERR_OK) {
 		if ((peer->curr_keypair.valid) || (peer->prev_keypair.valid)) {
 			result = ERR_OK;
@@ -800,28 +1207,37 @@ err_t wireguardif_peer_is_up(struct netif *netif, u8_t peer_index, ip_addr_t *cu
 			*current_port = peer->port;
 		}
 	}
+	mutexUnlock(&netif->lock);
 	return result;
 }
 
 err_t wireguardif_remove_peer(struct netif *netif, u8_t peer_index) {
 	struct wireguard_peer *peer;
-	err_t result = wireguardif_lookup_peer(netif, peer_index, &peer);
+	err_t result;
+
+	mutexLock(&netif->lock);
+	result = wireguardif_lookup_peer(netif, peer_index, &peer);
 	if (result == ERR_OK) {
 		crypto_zero(peer, sizeof(struct wireguard_peer));
 		peer->valid = false;
 		result = ERR_OK;
 	}
+	mutexUnlock(&netif->lock);
 	return result;
 }
 
 err_t wireguardif_update_endpoint(struct netif *netif, u8_t peer_index, const ip_addr_t *ip, u16_t port) {
 	struct wireguard_peer *peer;
-	err_t result = wireguardif_lookup_peer(netif, peer_index, &peer);
+	err_t result;
+
+	mutexLock(&netif->lock);
+	result = wireguardif_lookup_peer(netif, peer_index, &peer);
 	if (result == ERR_OK) {
 		peer->connect_ip = *ip;
 		peer->connect_port = port;
 		result = ERR_OK;
 	}
+	mutexUnlock(&netif->lock);
 	return result;
 }
 
@@ -837,6 +1253,7 @@ err_t wireguardif_add_peer(struct netif *netif, struct wireguardif_peer *p, u8_t
 
 	uint32_t t1 = wireguard_sys_now();
 
+	mutexLock(&netif->lock);
 	if (wireguard_base64_decode(p->public_key, public_key, &public_key_len)
 			&& (public_key_len == WIREGUARD_PUBLIC_KEY_LEN)) {
 
@@ -874,9 +1291,6 @@ err_t wireguardif_add_peer(struct netif *netif, struct wireguardif_peer *p, u8_t
 		result = ERR_ARG;
 	}
 
-	uint32_t t2 = wireguard_sys_now();
-	log_message_level(2, "Adding peer took %ums", (t2-t1));
-
 	if (peer_index) {
 		if (peer) {
 			*peer_index = wireguard_peer_index(device, peer);
@@ -884,6 +1298,10 @@ err_t wireguardif_add_peer(struct netif *netif, struct wireguardif_peer *p, u8_t
 			*peer_index = WIREGUARDIF_INVALID_INDEX;
 		}
 	}
+	mutexUnlock(&netif->lock);
+
+	uint32_t t2 = wireguard_sys_now();
+	log_message_level(2, "Adding peer took %ums", (t2-t1));
 	return result;
 }
 
@@ -932,13 +1350,14 @@ static bool should_reset_peer(struct wireguard_peer *peer) {
 	return result;
 }
 
-void wireguardif_tmr(union sigval data) {
-	struct wireguard_device *device = (struct wireguard_device *)(data.sival_ptr);
+void wireguardif_tmr(void *arg) {
+	struct wireguard_device *device = (struct wireguard_device *)arg;
 	struct wireguard_peer *peer;
 	int x;
 
 	// Check periodic things
 	bool link_up = false;
+	mutexLock(&device->netif->lock);
 	for (x=0; x < WIREGUARD_MAX_PEERS; x++) {
 		peer = &device->peers[x];
 		if (peer->valid) {
@@ -970,6 +1389,7 @@ void wireguardif_tmr(union sigval data) {
 			}
 		}
 	}
+	mutexUnlock(&device->netif->lock);
 
 	if (!link_up) {
 		// Clear the IF-UP flag on netif
@@ -981,14 +1401,40 @@ err_t wireguardif_init(struct netif *netif) {
 	err_t result = ERR_ARG;
 	struct wireguardif_init_data *init_data;
 	struct wireguard_device *device;
+	struct wireguardif_queue *queue;
 	uint8_t private_key[WIREGUARD_PRIVATE_KEY_LEN];
 	size_t private_key_len = sizeof(private_key);
+	int backend;
+	int kernel;
+	int x;
 
 	assert(netif != NULL);
 	assert(netif->state != NULL);
 
+	mutexInit(&netif->lock, NULL);
+
+	// Use the configured X25519/AEAD provider, falling back to the bundled code
+	backend = wireguard_crypto_select(config.crypto_backend);
+	if (backend != config.crypto_backend) {
+		log_message("Crypto backend %s is not available", wireguard_crypto_backend_name(config.crypto_backend));
+	}
+	log_message_level(1, "Crypto backend: %s", wireguard_crypto_backend_name(backend));
+
+	// Use the configured ChaCha20 implementation, or the fastest one this CPU supports
+	kernel = chacha20_select_kernel(config.chacha20_kernel);
+	if ((config.chacha20_kernel != CHACHA20_KERNEL_AUTO) && (kernel != config.chacha20_kernel)) {
+		log_message("ChaCha20 kernel %s is not usable on this CPU", chacha20_kernel_name(config.chacha20_kernel));
+	}
+	log_message_level(1, "ChaCha20 kernel: %s", chacha20_kernel_name(kernel));
+	kernel = poly1305_select_kernel(POLY1305_KERNEL_AUTO);
+	log_message_level(1, "Poly1305 kernel: %s", poly1305_kernel_name(kernel));
+	kernel = blake2s_select_kernel(BLAKE2S_KERNEL_AUTO);
+	log_message_level(1, "BLAKE2s kernel: %s", blake2s_kernel_name(kernel));
+
 	// We need to initialise the wireguard module
 	wireguard_init();
+	// Keep ephemeral keypairs ready so handshakes need not compute them inline
+	wg_keypool_start();
 
 	if (netif && netif->state) {
 		/*
@@ -999,22 +1445,43 @@ err_t wireguardif_init(struct netif *netif) {
 
 		// Clear out and set if function is successful
 		netif->state = NULL;
+		netif->queues = NULL;
+		netif->queue_count = 0;
 
 		if (wireguard_base64_decode(init_data->private_key, private_key, &private_key_len)
 				&& (private_key_len == WIREGUARD_PRIVATE_KEY_LEN)) {
 
+			netif->queues = (struct wireguardif_queue *)calloc(config.tun_queues, sizeof(struct wireguardif_queue));
+			netif->queue_count = netif->queues ? config.tun_queues : 0;
+			for (x = 0; x < netif->queue_count; x++) {
+				queue = &netif->queues[x];
+				queue->netif = netif;
+				queue->sockfd = -1;
+				queue->tunfd = -1;
+
+				queue->tx = wireguardif_tx_alloc(config.udp_tx_batch);
+				if (queue->tx == NULL) {
+					log_message("(%s) Can not allocate the transmit queue, sending packets one at a time.", __func__);
+				}
+
+				if (config.tun_offload) {
+					queue->gro = offload_gro_alloc();
+					if (queue->gro == NULL) {
+						log_message("(%s) Can not allocate the receive coalescing buffer, writing packets one at a time.", __func__);
+					}
+				}
+			}
+
 			device = (struct wireguard_device *)calloc(1, sizeof(struct wireguard_device));
-			if (device) {
+			if (device && netif->queues) {
 				device->netif = netif;
 				if (wireguard_device_init(device, private_key)) {
 					netif->state = device;
 
-					// Start a periodic timer for this wireguard device
-					netif->timer = start_timer(WIREGUARDIF_TIMER_MSECS, wireguardif_tmr, device);
-
 					result = ERR_OK;
 				}
 			} else {
+				free(device);
 				result = ERR_MEM;
 			}
 		} else {
@@ -1024,6 +1491,33 @@ err_t wireguardif_init(struct netif *netif) {
 	return result;
 }
 
+void wireguardif_deinit(struct netif *netif) {
+	struct wireguardif_tx_queue *tx;
+	int x;
+
+	for (x = 0; x < netif->queue_count; x++) {
+		tx = netif->queues[x].tx;
+		if (tx) {
+			free(tx->slots);
+			free(tx->packets);
+			free(tx->msgs);
+			free(tx->iov);
+			free(tx->to);
+			free(tx->cmsg);
+			free(tx);
+		}
+		offload_gro_free(netif->queues[x].gro);
+	}
+	free(netif->queues);
+	netif->queues = NULL;
+	netif->queue_count = 0;
+	if (netif->state) {
+		free(netif->state); //device
+		netif->state = NULL;
+	}
+	mutexDestroy(&netif->lock);
+}
+
 void wireguardif_peer_init(struct wireguardif_peer *peer) {
 	assert(peer != NULL);
 	memset(peer, 0, sizeof(struct wireguardif_peer));
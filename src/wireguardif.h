@@ -39,6 +39,7 @@
 #define _WIREGUARDIF_H_
 
 #include <stddef.h>
+#include <pthread.h>
 #include "lwip_h/arch.h"
 #include "lwip_h/ip_addr.h"
 #include "wg_config.h"
@@ -46,12 +47,47 @@
 // Default MTU for WireGuard is 1420 bytes
 #define WIREGUARDIF_MTU (1420)
 #define WIREGUARDIF_KEEPALIVE_DEFAULT	(0xFFFF)
+// Interval of the periodic processing in wireguardif_tmr()
+#define WIREGUARDIF_TIMER_MSECS 4000
+// Each handshake retry waits REKEY_TIMEOUT plus a fresh random delay of up to this much. It spans a whole timer
+// tick, so two peers whose retries fall due on the same tick drift apart on the next attempt.
+#define WIREGUARDIF_REKEY_JITTER_MSECS WIREGUARDIF_TIMER_MSECS
+
+// Messages wireguardif_network_rx_batch() classifies, authenticates and decrypts together
+#define WIREGUARDIF_RX_BATCH 32
+
+// Size of a slot of the transmit queue - larger data messages are sent on their own
+#define WIREGUARDIF_TX_SLOT_LEN 2048
+// Limits of one UDP_SEGMENT send: the kernel's UDP_MAX_SEGMENTS and what fits an IPv4 datagram
+#define WIREGUARDIF_GSO_MAX_SEGMENTS 64
+#define WIREGUARDIF_GSO_MAX_BYTES 65000
+
+struct wireguardif_tx_queue;
+struct offload_gro;
+struct netif;
+
+// One queue of the interface, served by its own worker thread: a queue of the TUN device, the UDP socket its
+// packets are sent on and the buffers that batch them
+struct wireguardif_queue {
+	struct netif *netif;
+	int sockfd;
+	int tunfd;
+	// Data messages waiting for wireguardif_output_flush()
+	struct wireguardif_tx_queue *tx;
+	// Received TCP segments being merged for the TUN device in offload mode
+	struct offload_gro *gro;
+};
 
 typedef struct netif {
+	// Socket for handshakes, cookies and keepalives
 	int sockfd;
-	int tunfd;
 	void *state;
-	timer_t *timer;
+	// Guards the device and peer state shared by the workers - the data messages are encrypted and decrypted
+	// without holding it, with a copy of the keypair's cipher state
+	pthread_mutex_t lock;
+	// config.tun_queues queues
+	struct wireguardif_queue *queues;
+	int queue_count;
 } netif_t;
 
 struct pbuf {
@@ -104,14 +140,26 @@ struct wireguardif_peer {
 
 #define WIREGUARDIF_INVALID_INDEX (0xFF)
 
-// Initialise a new WireGuard network interface (netif)
+// Initialise a new WireGuard network interface (netif) and its config.tun_queues queues - their sockfd and tunfd are
+// left to the caller
 err_t wireguardif_init(struct netif *netif);
+// Release what wireguardif_init() allocated
+void wireguardif_deinit(struct netif *netif);
 
-// rx(eth0 -> tun0)
+// rx(eth0 -> tun0) - arg is the wireguardif_queue whose TUN queue the packets are written to
+// count datagrams received together - p, addr and port are arrays of count entries. Data messages are decrypted in place.
+void wireguardif_network_rx_batch(void *arg, struct pbuf *p, const ip_addr_t *addr, const u16_t *port, size_t count);
+// One datagram - the same as wireguardif_network_rx_batch() with a count of 1
 void wireguardif_network_rx(void *arg, struct pbuf *p, const ip_addr_t *addr, u16_t port);
 
 // tx(-> eth0)
-err_t wireguardif_output(struct netif *netif, struct pbuf *q, const ip_addr_t *ipaddr);
+// Data packets are queued and only encrypted and sent by wireguardif_output_flush(), or once config.udp_tx_batch are waiting
+err_t wireguardif_output(struct wireguardif_queue *queue, struct pbuf *q, const ip_addr_t *ipaddr);
+// Encrypt the queued packets and send them with one sendmmsg() - call at the end of every burst of wireguardif_output()
+void wireguardif_output_flush(struct wireguardif_queue *queue);
+
+// Periodic processing - handshakes, keepalives and key expiry - run by the event loop every WIREGUARDIF_TIMER_MSECS
+void wireguardif_tmr(void *arg);
 
 // Helper to initialise the peer struct with defaults
 void wireguardif_peer_init(struct wireguardif_peer *peer);